@@ -17,10 +17,19 @@ const int TOTAL_BATCH_NO = 200;
 
 const int SAMPLE_GAP = 100;
 
+// Internal counters since the workload started and segment histograms of `index`, only in
+// builds with `WAHL_STATS`.
+template<typename Index>
+void PrintStats(Index &index) {
+    if (!wahl::kStatsEnabled) return;
+    cout << "stats:" << wahl::GetStats().ToString() << endl;
+    index.DumpSegmentStats(cout);
+}
+
 template<typename KeyType, typename ValueType>
 void PointLookup(const string data_file) {
     // Load data
-    vector<KeyType> keys = util::load_data<KeyType>(data_file);
+    auto keys = util::map_data<KeyType>(data_file);
 
     vector<KeyType> init_keys, insert_keys;
 
@@ -38,6 +47,7 @@ void PointLookup(const string data_file) {
     }
 
     // Run workload
+    wahl::ResetStats();
     const int num_lookups_per_batch = TOTAL_NUM_OPS / TOTAL_BATCH_NO;
     int batch_no = 0;
     cout << "batch_no,ns-lookup" << endl;
@@ -66,12 +76,13 @@ void PointLookup(const string data_file) {
 
         delete[] lookup_keys;
     }
+    PrintStats(arts);
 }
 
 template<typename KeyType, typename ValueType>
 void Range(const string data_file) {
     // Load data
-    vector<KeyType> keys = util::load_data<KeyType>(data_file);
+    auto keys = util::map_data<KeyType>(data_file);
 
     vector<KeyType> init_keys, insert_keys;
 
@@ -91,6 +102,7 @@ void Range(const string data_file) {
     const int max_range = 1000;
 
     // Run workload
+    wahl::ResetStats();
     const int num_range_per_batch = TOTAL_NUM_OPS / TOTAL_BATCH_NO;
     int batch_no = 0;
     cout << "batch_no,ns-range" << endl;
@@ -115,6 +127,54 @@ void Range(const string data_file) {
         batch_no++;
         cout << batch_no << "," << batch_range_time / num_range_per_batch <<  endl;
     }
+    PrintStats(index);
+}
+
+// Sliding window over the sorted keys, like a time-series index: every batch appends the next
+// slice of keys and erases the oldest one. Tracks how the segment count and the ART size follow
+// the live key count as appends create segments and deletes shrink and merge them.
+template<typename KeyType, typename ValueType>
+void Churn(const string data_file) {
+    // Load data
+    auto keys = util::map_data<KeyType>(data_file);
+
+    const int window = TOTAL_BATCH_NO / 4;
+    const size_t num_ops_per_batch = keys.size() / (TOTAL_BATCH_NO + window);
+
+    vector<KeyType> init_keys(keys.begin(), keys.begin() + window * num_ops_per_batch);
+    auto init_values = util::make_values<KeyType, ValueType>(init_keys);
+
+    // Create and bulk load
+    wahl::WahlIndex<KeyType, ValueType> index(MAX_ERROR);
+    index.BulkLoad(init_keys, init_values);
+    wahl::ResetStats();
+
+    int batch_no = 0;
+    cout << "batch_no,ns-insert,ns-erase,num_seg,art_byte,total_byte" << endl;
+    while (batch_no < TOTAL_BATCH_NO) {
+        auto insert_start_time = std::chrono::high_resolution_clock::now();
+        for (size_t j = (batch_no + window) * num_ops_per_batch; j < (batch_no + window + 1) * num_ops_per_batch; j++) {
+            index.Insert(keys[j], keys[j]);
+        }
+        auto erase_start_time = std::chrono::high_resolution_clock::now();
+        for (size_t j = batch_no * num_ops_per_batch; j < (batch_no + 1) * num_ops_per_batch; j++) {
+            index.Erase(keys[j]);
+        }
+        auto erase_end_time = std::chrono::high_resolution_clock::now();
+        double batch_insert_time =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(erase_start_time - insert_start_time).count();
+        double batch_erase_time =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(erase_end_time - erase_start_time).count();
+
+        batch_no++;
+        cout << batch_no << ","
+             << batch_insert_time / num_ops_per_batch << ","
+             << batch_erase_time / num_ops_per_batch << ","
+             << index.num_seg() << ","
+             << index.GetDirectorySizeInByte() << ","
+             << index.GetSizeInByte() << endl;
+    }
+    PrintStats(index);
 }
 
 int main(int argc, char** argv) {
@@ -131,8 +191,10 @@ int main(int argc, char** argv) {
         PointLookup<uint64_t, uint64_t>(data_file);
     else if (type == "range")
         Range<uint64_t, uint64_t>(data_file);
+    else if (type == "churn")
+        Churn<uint64_t, uint64_t>(data_file);
     else
-        cerr << "error type, either point or range." << endl;
+        cerr << "error type, either point, range or churn." << endl;
 
     return 0;
 }
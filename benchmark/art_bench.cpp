@@ -17,8 +17,7 @@ using namespace std;
 template<typename KeyType, typename ValueType>
 void ReadOnlyBenchmark(const string data_file, const Config &config) {
     // Load data
-    vector<KeyType> origin_keys = util::load_data<KeyType>(data_file);
-    auto keys = vector<KeyType>(origin_keys.begin(), origin_keys.begin() + config.init_num_keys);
+    auto keys = util::map_data<KeyType>(data_file, config.init_num_keys);
     auto values = util::make_key_value<KeyType, ValueType>(keys);
 
     // Build
@@ -31,20 +30,26 @@ void ReadOnlyBenchmark(const string data_file, const Config &config) {
     vector<KeyType> lookup_keys;
     util::generate_point_lookup<KeyType>(keys, lookup_keys, config.num_operations, config.lookup_distribution);
 
+    util::LatencyHistogram lookup_latency;
     auto lookup_begin = chrono::high_resolution_clock::now();
     for (size_t i = 0; i < lookup_keys.size(); ++i) {
+        uint64_t start_cycles = util::read_cycles();
         auto v = t.LowerBound(lookup_keys[i]);
+        lookup_latency.Record(util::read_cycles() - start_cycles);
     }
     auto lookup_end = chrono::high_resolution_clock::now();
 
     // Range queries
     vector<RangeLookup<KeyType>> range_lookup = util::generate_range_lookups<KeyType>(keys, keys.size(), config.num_operations, config.max_range, config.lookup_distribution);
 
+    util::LatencyHistogram range_latency;
     auto range_lookup_begin = chrono::high_resolution_clock::now();
     for (const RangeLookup<KeyType>& lookup_iter : range_lookup) {
+        uint64_t start_cycles = util::read_cycles();
         std::vector<std::pair<KeyType, uint64_t>> kvs;
         kvs.reserve(config.max_range+1);
         t.Range(lookup_iter.start, lookup_iter.end, kvs);
+        range_latency.Record(util::read_cycles() - start_cycles);
     }
     auto range_lookup_end = chrono::high_resolution_clock::now();
 
@@ -59,7 +64,9 @@ void ReadOnlyBenchmark(const string data_file, const Config &config) {
          << " used_memory[MB]:" << (data_size / 1000.0) / 1000.0
          << " build_time[s]:" << (build_ns / 1000.0 / 1000.0) / 1000.0
          << " ns/lookup:" << lookup_ns / lookup_keys.size()
+         << lookup_latency.Columns("lookup")
          << " ns/range:" << range_lookup_ns / range_lookup.size()
+         << range_latency.Columns("range")
          << endl;
 }
 
@@ -67,9 +74,9 @@ void ReadOnlyBenchmark(const string data_file, const Config &config) {
 template<typename KeyType, typename ValueType>
 void ReadWriteBenchmark( const string data_file, const Config &config) {
     // Load data
-    vector<KeyType> keys = util::load_data<KeyType>(data_file);
+    auto keys = util::map_data<KeyType>(data_file);
 
-    auto init_keys = vector<KeyType>(keys.begin(), keys.begin() + config.init_num_keys);
+    auto init_keys = keys.Prefix(config.init_num_keys);
     auto init_values = util::make_key_value<KeyType, ValueType>(init_keys);
 
     // Create and bulk load
@@ -89,6 +96,7 @@ void ReadWriteBenchmark( const string data_file, const Config &config) {
     double cumulative_insert_time = 0;
     double cumulative_lookup_time = 0;
     double cumulative_range_time = 0;
+    util::LatencyHistogram insert_latency, lookup_latency, range_latency;
 
     int batch_no = 0;
     int total_batch_no = config.num_operations / config.batch_size;
@@ -102,7 +110,9 @@ void ReadWriteBenchmark( const string data_file, const Config &config) {
         auto inserts_start_time = std::chrono::high_resolution_clock::now();
         for (size_t i = 0; i < num_inserts_per_batch; i++) {
             // Perform operation
+            uint64_t start_cycles = util::read_cycles();
             t.Insert(insert_keys[i], i);
+            insert_latency.Record(util::read_cycles() - start_cycles);
         }
         auto inserts_end_time = std::chrono::high_resolution_clock::now();
         double batch_insert_time =
@@ -127,7 +137,9 @@ void ReadWriteBenchmark( const string data_file, const Config &config) {
         ValueType v;
         for (int j = 0; j < num_lookups_per_batch; j++) {
             // Perform operation
+            uint64_t start_cycles = util::read_cycles();
             auto v = t.LowerBound(lookup_keys[j]);
+            lookup_latency.Record(util::read_cycles() - start_cycles);
         }
         auto lookups_end_time = std::chrono::high_resolution_clock::now();
         double batch_lookup_time =
@@ -144,9 +156,11 @@ void ReadWriteBenchmark( const string data_file, const Config &config) {
         auto range_start_time = std::chrono::high_resolution_clock::now();
         for (int j = 0; j < num_range_per_batch; j++) {
             // Perform operation
+            uint64_t start_cycles = util::read_cycles();
             std::vector<std::pair<KeyType, uint64_t>> kvs;
             kvs.reserve(config.max_range+1);
             t.Range(range_lookup[j].start, range_lookup[j].end, kvs);
+            range_latency.Record(util::read_cycles() - start_cycles);
         }
         auto range_end_time = std::chrono::high_resolution_clock::now();
         double batch_range_time =
@@ -163,10 +177,13 @@ void ReadWriteBenchmark( const string data_file, const Config &config) {
               << " data_file:" << util::get_file_name(data_file)
               << " ns/lookup:"
               << cumulative_lookup_time / cumulative_lookups
+              << lookup_latency.Columns("lookup")
               << " ns/range:"
               << cumulative_range_time / cumulative_ranges
+              << range_latency.Columns("range")
               << " ns/insert:"
               << cumulative_insert_time / cumulative_inserts
+              << insert_latency.Columns("insert")
               << " ns/op:"
               << cumulative_time / cumulative_operations
               << std::endl;
@@ -210,6 +227,8 @@ int main(int argc, char** argv) {
             ReadWriteBenchmark<uint64_t, uint64_t>(data_file, config);
             break;
         }
+        default:
+            util::fail("unsupported workload: " + workload_type);
     }
     return 0;
 }
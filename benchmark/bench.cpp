@@ -3,87 +3,298 @@
 #include <chrono>
 #include <thread>
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <type_traits>
 #include "wahl_index.h"
 #include "util.h"
 using namespace std;
 
 const int MAX_ERROR = 32;
+// Entries of the segment cache of the `cache` variant.
+const size_t kSegmentCacheSize = 1024;
+// Error bounds of hot and cold segments in the `adaptive` variant.
+const size_t kHotError = 8;
+const size_t kColdError = 128;
+// Goal of the `tuned` variant: the fastest estimated lookups within this many bytes of segment
+// headers and directory.
+const size_t kTunedMemoryBudget = 64 * 1000 * 1000;
+
+// Formats the memory breakdown of an index as result columns.
+static string MemoryStatsColumns(const wahl::MemoryStats &stats) {
+    auto mb = [](size_t bytes) { return (bytes / 1000.0) / 1000.0; };
+    std::ostringstream out;
+    out << " art_inner[MB]:" << mb(stats.inner_node_bytes)
+        << " art_leaf[MB]:" << mb(stats.leaf_bytes)
+        << " segments[MB]:" << mb(stats.segment_bytes)
+        << " segment_arrays[MB]:" << mb(stats.segment_array_bytes)
+        << " slot_buffers[MB]:" << mb(stats.slot_buffer_bytes)
+        << " overflow_buffer[MB]:" << mb(stats.overflow_buffer_bytes)
+        << " total_memory[MB]:" << mb(stats.Total())
+        << " reserved_memory[MB]:" << mb(stats.reserved_bytes);
+    return out.str();
+}
+
+// Internal counters since the last `ResetStats`, only in builds with `WAHL_STATS`.
+static string StatsColumns() {
+    return wahl::kStatsEnabled ? wahl::GetStats().ToString() : "";
+}
+
+// What the variants of the read-only benchmark switch on.
+struct ReadOnlyOptions {
+    // Bulk load the index straight from the file instead of from vectors.
+    bool stream = false;
+    // Entries of the index's segment cache, 0 for none.
+    size_t segment_cache_size = 0;
+    // Run the point queries once untimed in adaptive error mode and rebuild the segments with
+    // `AdaptSegmentErrors` before measuring.
+    bool adaptive_error = false;
+    // Pick `max_error` and `overflow_threshold` for `kTunedMemoryBudget` with `Tune`, timed as
+    // part of the build.
+    bool tune = false;
+};
 
 // First bulk load 200M key value pairs,
 // then perform 10M point lookup in `zipf` distribution
-template<typename KeyType, typename ValueType>
-void ReadOnlyBenchmark(const string data_file, const Config &config) {
+// With or without `stream`, the keys are only mapped for the queries after the build, so
+// `build_peak_rss` doesn't count the file's pages.
+template<typename KeyType, typename ValueType, wahl::SlotLayout kLayout = wahl::SlotLayout::kSplit,
+         template<typename> class Directory = wahl::ArtTree>
+void ReadOnlyBenchmark(const string data_file, const Config &config, const ReadOnlyOptions &options = ReadOnlyOptions()) {
+    const bool stream = options.stream, adaptive_error = options.adaptive_error, tune = options.tune;
+    const size_t segment_cache_size = options.segment_cache_size;
     // Load data
-    vector<KeyType> origin_keys = util::load_data<KeyType>(data_file);
-    auto keys = vector<KeyType>(origin_keys.begin(), origin_keys.begin() + config.init_num_keys);
-    auto values = util::make_values<KeyType, ValueType>(keys);
+    vector<KeyType> build_keys;
+    vector<ValueType> values;
+    if (!stream) {
+        auto data = util::map_data<KeyType>(data_file, config.init_num_keys);
+        build_keys.assign(data.begin(), data.end());
+        values = util::make_values<KeyType, ValueType>(build_keys);
+    }
 
     // Build
+    size_t rss_before_build = util::get_rss_bytes();
     auto build_begin = chrono::high_resolution_clock::now();
-    wahl::WahlIndex<KeyType, ValueType> index(MAX_ERROR);
-    index.BulkLoad(keys, values);
+    typedef wahl::WahlIndex<KeyType, ValueType, false, false, kLayout, Directory> Index;
+    std::unique_ptr<Index> index_ptr(new Index(MAX_ERROR));
+    auto &index = *index_ptr;
+    wahl::ResetStats();
+    wahl::TuningResult tuning{};
+    if (tune) {
+        wahl::TuningGoal goal;
+        goal.memory_budget = kTunedMemoryBudget;
+        tuning = index.Tune(build_keys, goal);
+    }
+    auto tune_end = chrono::high_resolution_clock::now();
+    if (stream) {
+        index.BulkLoad(util::DataFileIterator<KeyType, ValueType>(data_file, config.init_num_keys),
+                       util::DataFileIterator<KeyType, ValueType>());
+    } else {
+        index.BulkLoad(build_keys, values);
+    }
     auto build_end = chrono::high_resolution_clock::now();
+    size_t build_rss = util::get_rss_bytes() - rss_before_build;
+    size_t build_peak_rss = util::get_peak_rss_bytes();
+    vector<KeyType>().swap(build_keys);
+    vector<ValueType>().swap(values);
+    auto keys = util::map_data<KeyType>(data_file, config.init_num_keys);
+    index.EnableSegmentCache(segment_cache_size);
 
     // Point queries
     vector<KeyType> lookup_keys;
     util::generate_point_lookup<KeyType>(keys, lookup_keys, config.num_operations, config.lookup_distribution);
 
+    size_t adapted_runs = 0;
+    auto adapt_begin = chrono::high_resolution_clock::now();
+    if (adaptive_error) {
+        ValueType v;
+        index.EnableAdaptiveError(kHotError, kColdError);
+        for (KeyType key : lookup_keys) index.Find(key, v);
+        adapted_runs = index.AdaptSegmentErrors();
+    }
+    auto adapt_end = chrono::high_resolution_clock::now();
+
+    util::LatencyHistogram lookup_latency;
     auto lookup_begin = chrono::high_resolution_clock::now();
     ValueType v;
     for (size_t i = 0; i < lookup_keys.size(); ++i) {
+        uint64_t start_cycles = util::read_cycles();
         index.Find(lookup_keys[i], v);
+        lookup_latency.Record(util::read_cycles() - start_cycles);
     }
     auto lookup_end = chrono::high_resolution_clock::now();
 
+    // Same point queries, resolved `kLookupBatchSize` keys per `FindBatch` call
+    const size_t kLookupBatchSize = 1024;
+    vector<ValueType> batch_values(kLookupBatchSize);
+    std::unique_ptr<bool[]> batch_found(new bool[kLookupBatchSize]);
+    auto batch_lookup_begin = chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < lookup_keys.size(); i += kLookupBatchSize) {
+        index.FindBatch(lookup_keys.data() + i, std::min(kLookupBatchSize, lookup_keys.size() - i),
+                        batch_values.data(), batch_found.get());
+    }
+    auto batch_lookup_end = chrono::high_resolution_clock::now();
+
     // Range queries
     vector<RangeLookup<KeyType>> range_lookup = util::generate_range_lookups<KeyType>(keys, keys.size(), config.num_operations, config.max_range, config.lookup_distribution);
 
+    util::LatencyHistogram range_latency;
     auto range_lookup_begin = chrono::high_resolution_clock::now();
     for (const RangeLookup<KeyType>& lookup_iter : range_lookup) {
+        uint64_t start_cycles = util::read_cycles();
         std::vector<std::pair<KeyType, ValueType>> kvs;
         kvs.reserve(config.max_range+1);
         index.Range(lookup_iter.start, lookup_iter.end, kvs);
+        range_latency.Record(util::read_cycles() - start_cycles);
     }
     auto range_lookup_end = chrono::high_resolution_clock::now();
 
+    size_t used_memory = index.GetSizeInByte();
+    size_t num_seg = index.num_seg();
+    size_t max_error = index.max_error(), overflow_threshold = index.overflow_threshold();
+    wahl::MemoryStats memory_stats = index.GetMemoryStats();
+    if (wahl::kStatsEnabled) index.DumpSegmentStats(cout);
+    auto teardown_begin = chrono::high_resolution_clock::now();
+    index_ptr.reset();
+    auto teardown_end = chrono::high_resolution_clock::now();
+
     uint64_t build_ns = chrono::duration_cast<chrono::nanoseconds>(build_end - build_begin).count();
+    uint64_t tune_ns = chrono::duration_cast<chrono::nanoseconds>(tune_end - build_begin).count();
+    uint64_t teardown_ns = chrono::duration_cast<chrono::nanoseconds>(teardown_end - teardown_begin).count();
+    uint64_t adapt_ns = chrono::duration_cast<chrono::nanoseconds>(adapt_end - adapt_begin).count();
     uint64_t lookup_ns = chrono::duration_cast<chrono::nanoseconds>(lookup_end - lookup_begin).count();
+    uint64_t batch_lookup_ns = chrono::duration_cast<chrono::nanoseconds>(batch_lookup_end - batch_lookup_begin).count();
     uint64_t range_lookup_ns = chrono::duration_cast<chrono::nanoseconds>(range_lookup_end - range_lookup_begin).count();
 
     cout << "index:Ours"
          << " data_file:" << util::get_file_name(data_file)
-         << " used_memory[MB]:" << (index.GetSizeInByte() / 1000.0) / 1000.0
+         << " layout:" << (kLayout == wahl::SlotLayout::kInterleaved ? "interleaved" :
+                           kLayout == wahl::SlotLayout::kBlocked ? "blocked" : "split")
+         << " directory:" << (std::is_same<Directory<KeyType>, wahl::LearnedDirectory<KeyType>>::value ? "learned" : "art")
+         << " segment_cache:" << segment_cache_size
+         << " lookup_distribution:" << config.lookup_distribution
+         << " adaptive_error:" << (adaptive_error ? std::to_string(kHotError) + "/" + std::to_string(kColdError) : "off")
+         << " adapted_runs:" << adapted_runs
+         << " adapt_time[s]:" << (adapt_ns / 1000.0 / 1000.0) / 1000.0
+         << " max_error:" << max_error
+         << " overflow_threshold:" << overflow_threshold
+         << " tuned:" << (tune ? (tuning.goal_missed ? "missed" : "met") : "off")
+         << " tune_time[s]:" << (tune_ns / 1000.0 / 1000.0) / 1000.0
+         << " est_num_seg:" << tuning.num_seg
+         << " est_memory[MB]:" << (tuning.memory_bytes / 1000.0) / 1000.0
+         << " est_ns/lookup:" << tuning.lookup_ns
+         << " num_seg:" << num_seg
+         << " used_memory[MB]:" << (used_memory / 1000.0) / 1000.0
+         << MemoryStatsColumns(memory_stats)
          << " build_time[s]:" << (build_ns / 1000.0 / 1000.0) / 1000.0
+         << " build_threads:" << (stream ? 1 : util::get_max_threads())
+         << " build_rss[MB]:" << (build_rss / 1000.0) / 1000.0
+         << " build_peak_rss[MB]:" << (build_peak_rss / 1000.0) / 1000.0
+         << " teardown_time[s]:" << (teardown_ns / 1000.0 / 1000.0) / 1000.0
          << " ns/lookup:" << lookup_ns / lookup_keys.size()
+         << lookup_latency.Columns("lookup")
+         << " ns/lookup-batch:" << batch_lookup_ns / lookup_keys.size()
          << " ns/range:" << range_lookup_ns / range_lookup.size()
+         << range_latency.Columns("range")
+         << StatsColumns()
          << endl;
 }
 
+// Compares the time to the first lookup of an index built with `BulkLoad` against one mapped
+// with `Load` from a file written by `Save`, then runs the read-only lookups on the mapped index.
 template<typename KeyType, typename ValueType>
-void ReadWriteBenchmark( const string data_file, const Config &config) {
+void ColdStartBenchmark(const string data_file, const Config &config) {
+    auto keys = util::map_data<KeyType>(data_file, config.init_num_keys);
+    vector<KeyType> build_keys(keys.begin(), keys.end());
+    auto values = util::make_values<KeyType, ValueType>(keys);
+    const string index_file = data_file + ".wahl";
+    ValueType v;
+
+    auto build_begin = chrono::high_resolution_clock::now();
+    std::unique_ptr<wahl::WahlIndex<KeyType, ValueType>> built(new wahl::WahlIndex<KeyType, ValueType>(MAX_ERROR));
+    built->BulkLoad(build_keys, values);
+    built->Find(keys[keys.size() / 2], v);
+    auto build_end = chrono::high_resolution_clock::now();
+
+    auto save_begin = chrono::high_resolution_clock::now();
+    if (!built->Save(index_file)) util::fail("failed to save " + index_file);
+    auto save_end = chrono::high_resolution_clock::now();
+    built.reset();
+
+    auto load_begin = chrono::high_resolution_clock::now();
+    wahl::WahlIndex<KeyType, ValueType> index;
+    if (!index.Load(index_file)) util::fail("failed to load " + index_file);
+    index.Find(keys[keys.size() / 2], v);
+    auto load_end = chrono::high_resolution_clock::now();
+
+    vector<KeyType> lookup_keys;
+    util::generate_point_lookup<KeyType>(keys, lookup_keys, config.num_operations, config.lookup_distribution);
+    util::LatencyHistogram lookup_latency;
+    auto lookup_begin = chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < lookup_keys.size(); ++i) {
+        uint64_t start_cycles = util::read_cycles();
+        index.Find(lookup_keys[i], v);
+        lookup_latency.Record(util::read_cycles() - start_cycles);
+    }
+    auto lookup_end = chrono::high_resolution_clock::now();
+    remove(index_file.c_str());
+
+    uint64_t build_ns = chrono::duration_cast<chrono::nanoseconds>(build_end - build_begin).count();
+    uint64_t save_ns = chrono::duration_cast<chrono::nanoseconds>(save_end - save_begin).count();
+    uint64_t load_ns = chrono::duration_cast<chrono::nanoseconds>(load_end - load_begin).count();
+    uint64_t lookup_ns = chrono::duration_cast<chrono::nanoseconds>(lookup_end - lookup_begin).count();
+
+    cout << "index:Ours"
+         << " data_file:" << util::get_file_name(data_file)
+         << " build_to_first_lookup[s]:" << (build_ns / 1000.0 / 1000.0) / 1000.0
+         << " save_time[s]:" << (save_ns / 1000.0 / 1000.0) / 1000.0
+         << " load_to_first_lookup[s]:" << (load_ns / 1000.0 / 1000.0) / 1000.0
+         << " ns/lookup:" << lookup_ns / lookup_keys.size()
+         << lookup_latency.Columns("lookup")
+         << " rss[MB]:" << (util::get_rss_bytes() / 1000.0) / 1000.0
+         << endl;
+}
+
+// With `kThreadSafe`, runs the thread-safe index, and with `async_retrain` as well, rebuilds its
+// segments on the background worker. Without, the inserting thread rebuilds them, which makes
+// the thread-safe synchronous run the baseline of the asynchronous one.
+// With `kArrayBuffer`, segments buffer inserts in `SortedArrayBuffer` slots.
+template<typename KeyType, typename ValueType, bool kThreadSafe = false, bool kArrayBuffer = false,
+         template<typename> class Directory = wahl::ArtTree>
+void ReadWriteBenchmark( const string data_file, const Config &config, bool async_retrain = false) {
     // Load data
-    vector<KeyType> keys = util::load_data<KeyType>(data_file);
+    auto keys = util::map_data<KeyType>(data_file);
 
     auto init_keys = vector<KeyType>(keys.begin(), keys.begin() + config.init_num_keys);
     auto init_values = util::make_values<KeyType, ValueType>(init_keys);
 
     // Create and bulk load
-    wahl::WahlIndex<KeyType, ValueType> index(MAX_ERROR);
+    wahl::WahlIndex<KeyType, ValueType, kThreadSafe, kArrayBuffer, wahl::SlotLayout::kSplit, Directory> index(MAX_ERROR);
     index.BulkLoad(init_keys, init_values);
+    if constexpr (kThreadSafe) {
+        if (async_retrain) index.StartBackgroundRetrain();
+    }
+    wahl::ResetStats();
 
     // Run workload
     int total_num_keys = config.init_num_keys;
     long long cumulative_inserts = 0;
     long long cumulative_lookups = 0;
     long long cumulative_ranges = 0;
+    long long cumulative_deletes = 0;
     int batch_size = config.batch_size;
     int num_inserts_per_batch = static_cast<int>(batch_size * config.insert_frac);
-    int num_lookups_per_batch = batch_size - num_inserts_per_batch;
+    int num_deletes_per_batch = static_cast<int>(batch_size * config.delete_frac);
+    int num_lookups_per_batch = batch_size - num_inserts_per_batch - num_deletes_per_batch;
     int num_range_per_batch =  static_cast<int>(num_lookups_per_batch * config.range_frac);
     num_lookups_per_batch -= num_range_per_batch;
     double cumulative_insert_time = 0;
     double cumulative_lookup_time = 0;
     double cumulative_range_time = 0;
+    double cumulative_delete_time = 0;
+    // Per-operation latencies, for the tail that `Retrain` adds to inserts.
+    util::LatencyHistogram insert_latency, lookup_latency, range_latency, delete_latency;
 
     int batch_no = 0;
     int total_batch_no = config.num_operations / config.batch_size;
@@ -97,7 +308,9 @@ void ReadWriteBenchmark( const string data_file, const Config &config) {
         auto inserts_start_time = std::chrono::high_resolution_clock::now();
         for (size_t i = 0; i < num_inserts_per_batch; i++) {
             // Perform operation
+            uint64_t start_cycles = util::read_cycles();
             index.Insert(insert_keys[i], i);
+            insert_latency.Record(util::read_cycles() - start_cycles);
         }
         auto inserts_end_time = std::chrono::high_resolution_clock::now();
         double batch_insert_time =
@@ -107,6 +320,23 @@ void ReadWriteBenchmark( const string data_file, const Config &config) {
         cumulative_insert_time += batch_insert_time;
         cumulative_inserts += num_inserts_per_batch;
 
+        // Do deletes
+        if (num_deletes_per_batch > 0) {
+            KeyType* delete_keys = util::get_search_keys(keys, total_num_keys, num_deletes_per_batch, batch_no);
+            auto deletes_start_time = std::chrono::high_resolution_clock::now();
+            for (int j = 0; j < num_deletes_per_batch; j++) {
+                // Perform operation
+                uint64_t start_cycles = util::read_cycles();
+                index.Erase(delete_keys[j]);
+                delete_latency.Record(util::read_cycles() - start_cycles);
+            }
+            auto deletes_end_time = std::chrono::high_resolution_clock::now();
+            cumulative_delete_time += std::chrono::duration_cast<std::chrono::nanoseconds>(deletes_end_time -
+                                                                                           deletes_start_time).count();
+            cumulative_deletes += num_deletes_per_batch;
+            delete[] delete_keys;
+        }
+
         // Do lookups
         KeyType* lookup_keys = nullptr;
         if (config.lookup_distribution == "uniform") {
@@ -122,7 +352,9 @@ void ReadWriteBenchmark( const string data_file, const Config &config) {
         ValueType v;
         for (int j = 0; j < num_lookups_per_batch; j++) {
             // Perform operation
+            uint64_t start_cycles = util::read_cycles();
             index.Find(lookup_keys[j], v);
+            lookup_latency.Record(util::read_cycles() - start_cycles);
         }
         auto lookups_end_time = std::chrono::high_resolution_clock::now();
         double batch_lookup_time =
@@ -139,9 +371,11 @@ void ReadWriteBenchmark( const string data_file, const Config &config) {
         auto range_start_time = std::chrono::high_resolution_clock::now();
         for (int j = 0; j < num_range_per_batch; j++) {
             // Perform operation
+            uint64_t start_cycles = util::read_cycles();
             std::vector<std::pair<KeyType, uint64_t>> kvs;
             kvs.reserve(config.max_range+1);
             index.Range(range_lookup[j].start, range_lookup[j].end, kvs);
+            range_latency.Record(util::read_cycles() - start_cycles);
         }
 
         auto range_end_time = std::chrono::high_resolution_clock::now();
@@ -154,55 +388,255 @@ void ReadWriteBenchmark( const string data_file, const Config &config) {
 
     }
 
-    long long cumulative_operations = cumulative_lookups + cumulative_ranges + cumulative_inserts;
-    double cumulative_time = cumulative_lookup_time + cumulative_insert_time + (cumulative_ranges == 0 ? 0 : cumulative_range_time);
-    std::cout << "index:Ours"
+    if (wahl::kStatsEnabled) {
+        // The dump must not race the retrain worker.
+        if constexpr (kThreadSafe) index.StopBackgroundRetrain();
+        index.DumpSegmentStats(cout);
+    }
+    long long cumulative_operations = cumulative_lookups + cumulative_ranges + cumulative_inserts + cumulative_deletes;
+    double cumulative_time = cumulative_lookup_time + cumulative_insert_time + cumulative_delete_time + (cumulative_ranges == 0 ? 0 : cumulative_range_time);
+    const bool learned = std::is_same<Directory<KeyType>, wahl::LearnedDirectory<KeyType>>::value;
+    std::cout << (async_retrain ? "index:Ours-async" : kThreadSafe ? "index:Ours-ts" : kArrayBuffer ? "index:Ours-array" :
+                  learned ? "index:Ours-learned" : "index:Ours")
               << " data_file:" << util::get_file_name(data_file)
               << " ns/lookup:"
               << cumulative_lookup_time / cumulative_lookups
+              << lookup_latency.Columns("lookup")
               << " ns/range:"
               << cumulative_range_time / cumulative_ranges
+              << range_latency.Columns("range")
               << " ns/insert:"
               << cumulative_insert_time / cumulative_inserts
+              << insert_latency.Columns("insert")
+              << " ns/delete:"
+              << cumulative_delete_time / cumulative_deletes
+              << delete_latency.Columns("delete")
               << " ns/op:"
               << cumulative_time / cumulative_operations
+              << " used_memory[MB]:" << (index.GetSizeInByte() / 1000.0) / 1000.0
+              << MemoryStatsColumns(index.GetMemoryStats())
+              << StatsColumns()
               << std::endl;
 }
 
+// Bulk loads the thread-safe index and runs `config.num_operations` mixed lookups and inserts
+// (in `config.insert_frac`) split evenly over 1, 2, 4, ... `max_threads` threads.
+template<typename KeyType, typename ValueType>
+void ConcurrentBenchmark(const string data_file, const Config &config, size_t max_threads) {
+    // Load data
+    auto keys = util::map_data<KeyType>(data_file);
+
+    auto init_keys = vector<KeyType>(keys.begin(), keys.begin() + config.init_num_keys);
+    auto init_values = util::make_values<KeyType, ValueType>(init_keys);
+
+    // Operations are generated once and shared by all runs.
+    size_t num_inserts = static_cast<size_t>(config.num_operations * config.insert_frac);
+    size_t num_lookups = config.num_operations - num_inserts;
+    vector<KeyType> insert_keys, lookup_keys;
+    util::generate_insert<KeyType>(keys, insert_keys, num_inserts, config.insert_distribution);
+    util::generate_point_lookup<KeyType>(init_keys, lookup_keys, num_lookups, config.lookup_distribution);
+
+    for (size_t num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        wahl::WahlIndex<KeyType, ValueType, true> index(MAX_ERROR);
+        index.BulkLoad(init_keys, init_values);
+        wahl::ResetStats();
+
+        std::atomic<size_t> ready{0};
+        std::atomic<bool> start{false};
+        vector<thread> workers;
+        // One pair of histograms per thread, merged after the run.
+        vector<util::LatencyHistogram> insert_latency(num_threads), lookup_latency(num_threads);
+        for (size_t t = 0; t < num_threads; ++t) {
+            workers.emplace_back([&, t] {
+                util::set_cpu_affinity(t);
+                // Interleave this thread's share of inserts with its share of lookups.
+                size_t insert_begin = num_inserts * t / num_threads, insert_end = num_inserts * (t + 1) / num_threads;
+                size_t lookup_begin = num_lookups * t / num_threads, lookup_end = num_lookups * (t + 1) / num_threads;
+                ready++;
+                while (!start.load(std::memory_order_acquire)) std::this_thread::yield();
+
+                ValueType v;
+                size_t i = insert_begin, j = lookup_begin;
+                while (i < insert_end || j < lookup_end) {
+                    // Keep the insert ratio of this thread close to `config.insert_frac`.
+                    if (i < insert_end && (j == lookup_end || (i - insert_begin) * (lookup_end - lookup_begin) <=
+                                                              (j - lookup_begin) * (insert_end - insert_begin))) {
+                        uint64_t start_cycles = util::read_cycles();
+                        index.Insert(insert_keys[i], i);
+                        insert_latency[t].Record(util::read_cycles() - start_cycles);
+                        ++i;
+                    } else {
+                        uint64_t start_cycles = util::read_cycles();
+                        index.Find(lookup_keys[j], v);
+                        lookup_latency[t].Record(util::read_cycles() - start_cycles);
+                        ++j;
+                    }
+                }
+            });
+        }
+        while (ready.load() != num_threads) std::this_thread::yield();
+
+        auto run_begin = chrono::high_resolution_clock::now();
+        start.store(true, std::memory_order_release);
+        for (auto &worker : workers) worker.join();
+        auto run_end = chrono::high_resolution_clock::now();
+
+        uint64_t run_ns = chrono::duration_cast<chrono::nanoseconds>(run_end - run_begin).count();
+        for (size_t t = 1; t < num_threads; ++t) {
+            insert_latency[0].Merge(insert_latency[t]);
+            lookup_latency[0].Merge(lookup_latency[t]);
+        }
+        cout << "index:Ours"
+             << " data_file:" << util::get_file_name(data_file)
+             << " threads:" << num_threads
+             << " throughput[Mops/s]:" << config.num_operations * 1000.0 / run_ns
+             << " ns/op:" << static_cast<double>(run_ns) / config.num_operations
+             << lookup_latency[0].Columns("lookup")
+             << insert_latency[0].Columns("insert")
+             << StatsColumns()
+             << endl;
+    }
+}
+
+
+typedef void (*BenchmarkRunner)(const string &data_file, const Config &config);
+
+// A variant of the index, picked by name as the last argument. It runs the read-only
+// workload with `read_only`, the cold start workload with `cold_start` and the other ones with
+// `read_write`, and a null runner means the variant does not apply to that workload.
+struct Variant {
+    const char *name;
+    const char *description;
+    BenchmarkRunner read_only;
+    BenchmarkRunner read_write;
+    BenchmarkRunner cold_start;
+};
+
+static const Variant kDefaultVariant = {
+        "", "",
+        [](const string &data_file, const Config &config) { ReadOnlyBenchmark<uint64_t, uint64_t>(data_file, config); },
+        [](const string &data_file, const Config &config) { ReadWriteBenchmark<uint64_t, uint64_t>(data_file, config); },
+        [](const string &data_file, const Config &config) { ColdStartBenchmark<uint64_t, uint64_t>(data_file, config); }};
+
+static const Variant kVariants[] = {
+        {"async", "thread-safe index, segments retrained on a background thread",
+         nullptr,
+         [](const string &data_file, const Config &config) { ReadWriteBenchmark<uint64_t, uint64_t, true>(data_file, config, true); },
+         nullptr},
+        {"ts", "thread-safe index, segments retrained on the inserting thread",
+         nullptr,
+         [](const string &data_file, const Config &config) { ReadWriteBenchmark<uint64_t, uint64_t, true>(data_file, config); },
+         nullptr},
+        {"array", "inserts buffered in sorted mini-arrays instead of move-to-front lists",
+         nullptr,
+         [](const string &data_file, const Config &config) { ReadWriteBenchmark<uint64_t, uint64_t, false, true>(data_file, config); },
+         nullptr},
+        {"learned", "learned directory instead of the ART",
+         [](const string &data_file, const Config &config) {
+             ReadOnlyBenchmark<uint64_t, uint64_t, wahl::SlotLayout::kSplit, wahl::LearnedDirectory>(data_file, config);
+         },
+         [](const string &data_file, const Config &config) {
+             ReadWriteBenchmark<uint64_t, uint64_t, false, false, wahl::LearnedDirectory>(data_file, config);
+         },
+         nullptr},
+        {"interleaved", "segment slots laid out interleaved",
+         [](const string &data_file, const Config &config) {
+             ReadOnlyBenchmark<uint64_t, uint64_t, wahl::SlotLayout::kInterleaved>(data_file, config);
+         },
+         nullptr, nullptr},
+        {"blocked", "segment slots laid out in blocks",
+         [](const string &data_file, const Config &config) {
+             ReadOnlyBenchmark<uint64_t, uint64_t, wahl::SlotLayout::kBlocked>(data_file, config);
+         },
+         nullptr, nullptr},
+        {"stream", "bulk loaded straight from the data file",
+         [](const string &data_file, const Config &config) {
+             ReadOnlyOptions options;
+             options.stream = true;
+             ReadOnlyBenchmark<uint64_t, uint64_t>(data_file, config, options);
+         },
+         nullptr, nullptr},
+        {"cache", "lookups routed through a segment cache first",
+         [](const string &data_file, const Config &config) {
+             ReadOnlyOptions options;
+             options.segment_cache_size = kSegmentCacheSize;
+             ReadOnlyBenchmark<uint64_t, uint64_t>(data_file, config, options);
+         },
+         nullptr, nullptr},
+        {"adaptive", "segment error bounds tuned to the lookups before measuring them",
+         [](const string &data_file, const Config &config) {
+             ReadOnlyOptions options;
+             options.adaptive_error = true;
+             ReadOnlyBenchmark<uint64_t, uint64_t>(data_file, config, options);
+         },
+         nullptr, nullptr},
+        {"tuned", "error bound picked for a memory budget instead of `MAX_ERROR`",
+         [](const string &data_file, const Config &config) {
+             ReadOnlyOptions options;
+             options.tune = true;
+             ReadOnlyBenchmark<uint64_t, uint64_t>(data_file, config, options);
+         },
+         nullptr, nullptr},
+};
+
+static void PrintUsage(const char *program) {
+    cerr << "usage: " << program << " <data_file> <workload> [<max_threads> | <variant>]" << endl
+         << "  <max_threads>: multi-threaded throughput of the thread-safe index with 1, 2, 4, ... threads" << endl;
+    for (const Variant &variant : kVariants) {
+        cerr << "  " << variant.name << ": " << variant.description << " ("
+             << (variant.read_only && variant.read_write ? "read-only and read-write" : variant.read_only ? "read-only" : "read-write")
+             << " workloads)" << endl;
+    }
+}
 
 int main(int argc, char** argv) {
-  if (argc != 3) {
-    cerr << "usage: " << argv[0] << " <data_file> " << argv[1] << " <workload>" << endl;
-    throw;
+  if (argc != 3 && argc != 4) {
+    PrintUsage(argv[0]);
+    return 1;
   }
   const string data_file = argv[1];
   const string workload_type = argv[2];
 
-  util::set_cpu_affinity(0);
-
   Config config = util::get_config(workload_type);
 
-  switch (config.workload_type) {
-      case WorkloadType::READ_ONLY: {
-          ReadOnlyBenchmark<uint64_t, uint64_t>(data_file, config);
-          break;
+  const Variant *variant = &kDefaultVariant;
+  if (argc == 4) {
+      const string name = argv[3];
+      variant = nullptr;
+      for (const Variant &v : kVariants)
+          if (name == v.name) variant = &v;
+      if (variant == nullptr) {
+          // With <max_threads>, measure multi-threaded throughput of the thread-safe index instead.
+          if (!name.empty() && name.size() < 10 && name.find_first_not_of("0123456789") == string::npos && stoul(name) > 0) {
+              ConcurrentBenchmark<uint64_t, uint64_t>(data_file, config, stoul(name));
+              return 0;
+          }
+          cerr << "unknown variant: " << name << endl;
+          PrintUsage(argv[0]);
+          return 1;
       }
-      case WorkloadType::READ_HEAVY: {
-          ReadWriteBenchmark<uint64_t, uint64_t>(data_file, config);
-          break;
-      }
-      case WorkloadType::SMALL_RANGE: {
-          ReadWriteBenchmark<uint64_t, uint64_t>(data_file, config);
+  }
+
+  util::set_cpu_affinity(0);
+
+  BenchmarkRunner run = nullptr;
+  switch (config.workload_type) {
+      case WorkloadType::READ_ONLY:
+          run = variant->read_only;
           break;
-      }
-      case WorkloadType::WRITE_ONLY: {
-          ReadWriteBenchmark<uint64_t, uint64_t>(data_file, config);
+      case WorkloadType::READ_HEAVY:
+      case WorkloadType::SMALL_RANGE:
+      case WorkloadType::WRITE_HEAVY:
+      case WorkloadType::WRITE_ONLY:
+      case WorkloadType::READ_RANGE_WRITE:
+      case WorkloadType::DELETE_HEAVY:
+          run = variant->read_write;
           break;
-      }
-      case WorkloadType::READ_RANGE_WRITE: {
-          ReadWriteBenchmark<uint64_t, uint64_t>(data_file, config);
+      case WorkloadType::COLD_START:
+          run = variant->cold_start;
           break;
-      }
   }
+  if (run == nullptr) util::fail(string("variant ") + variant->name + " does not apply to workload " + workload_type);
+  run(data_file, config);
   return 0;
 }
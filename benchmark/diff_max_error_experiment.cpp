@@ -11,19 +11,23 @@
 using namespace std;
 
 // First bulk load 200M key value pairs,
-// then perform 10M point lookup in `zipf` distribution
+// then perform 10M point lookup in `zipf` distribution.
+// `radix_bits` puts a jump table of that many key bits in front of the directory.
 template<typename KeyType, typename ValueType>
-void DiffMaxErrorExperiment(const string data_file, const int max_error, const Config &config) {
+void DiffMaxErrorExperiment(const string data_file, const int max_error, const unsigned radix_bits, const Config &config) {
     // Load data
-    vector<KeyType> origin_keys = util::load_data<KeyType>(data_file);
-    auto keys = vector<KeyType>(origin_keys.begin(), origin_keys.begin() + config.init_num_keys);
+    auto keys = util::map_data<KeyType>(data_file, config.init_num_keys);
     auto values = util::make_values<KeyType, ValueType>(keys);
+    // Copied out of the mapping before the build is timed.
+    vector<KeyType> build_keys(keys.begin(), keys.end());
 
     // Build
     auto build_begin = chrono::high_resolution_clock::now();
     wahl::WahlIndex<KeyType, ValueType> index(max_error);
-    index.BulkLoad(keys, values);
+    index.directory().set_radix_bits(radix_bits);
+    index.BulkLoad(build_keys, values);
     auto build_end = chrono::high_resolution_clock::now();
+    vector<KeyType>().swap(build_keys);
 
     // Point queries
     vector<KeyType> lookup_keys;
@@ -45,9 +49,24 @@ void DiffMaxErrorExperiment(const string data_file, const int max_error, const C
     }
     auto search_seg_end = chrono::high_resolution_clock::now();
 
+    // directory write time: keys spread over the data, which are not segment boundaries, are
+    // inserted into the directory and removed again, which is what a segment split or merge
+    // costs it (with the radix table kept up to date).
+    const size_t num_writes = min<size_t>(keys.size(), 1000000);
+    vector<KeyType> write_keys;
+    for (size_t i = 0; i < num_writes; ++i) {
+        const KeyType key = keys[i * keys.size() / num_writes] + 1;
+        if (index.directory().Lookup(key) == nullptr) write_keys.push_back(key);
+    }
+    auto write_begin = chrono::high_resolution_clock::now();
+    for (KeyType key : write_keys) index.directory().Insert(key, 1);
+    for (KeyType key : write_keys) index.directory().Remove(key);
+    auto write_end = chrono::high_resolution_clock::now();
+
     uint64_t build_ns = chrono::duration_cast<chrono::nanoseconds>(build_end - build_begin).count();
     uint64_t lookup_ns = chrono::duration_cast<chrono::nanoseconds>(lookup_end - lookup_begin).count();
     uint64_t search_seg_ns = chrono::duration_cast<chrono::nanoseconds>(search_seg_end - search_seg_begin).count();
+    uint64_t write_ns = chrono::duration_cast<chrono::nanoseconds>(write_end - write_begin).count();
 
     auto ns_per_lookup = lookup_ns / lookup_keys.size();
     auto ns_per_search_seg = search_seg_ns / lookup_keys.size();
@@ -55,28 +74,32 @@ void DiffMaxErrorExperiment(const string data_file, const int max_error, const C
     cout << "index:" + std::to_string(max_error)
          << " data_file:" << util::get_file_name(data_file)
          << " num-segs:" << index.num_seg()
+         << " radix_bits:" << index.directory().radix_bits()
+         << " directory_memory[MB]:" << (index.GetDirectorySizeInByte() / 1000.0) / 1000.0
          << " used_memory[MB]:" << (index.GetSizeInByte() / 1000.0) / 1000.0
          << " build_time[s]:" << (build_ns / 1000.0 / 1000.0) / 1000.0
          << " ns/lookup:" << ns_per_lookup
          << " ns/search-seg:" << ns_per_search_seg
+         << " ns/dir-write:" << (write_keys.empty() ? 0 : write_ns / (2 * write_keys.size()))
          << " ns/in-seg-search:" << ns_per_lookup - ns_per_search_seg
          << endl;
 }
 
 
 int main(int argc, char** argv) {
-    if (argc != 3) {
-        cerr <<  "usage: " << argv[0] << " <data_file> " << argv[1] << " <max_error> " << argv[2] << endl;
+    if (argc != 3 && argc != 4) {
+        cerr <<  "usage: " << argv[0] << " <data_file> <max_error> [radix_bits]" << endl;
         throw;
     }
     const string data_file = argv[1];
     const int max_error = stoi(argv[2]);
+    const unsigned radix_bits = argc > 3 ? stoi(argv[3]) : 0;
 
     util::set_cpu_affinity(0);
 
     Config config = util::get_config("ro");
 
-    DiffMaxErrorExperiment<uint64_t, uint64_t>(data_file, max_error, config);
+    DiffMaxErrorExperiment<uint64_t, uint64_t>(data_file, max_error, radix_bits, config);
     return 0;
 }
 
@@ -0,0 +1,127 @@
+#ifndef ARTS_LATENCY_HISTOGRAM_H
+#define ARTS_LATENCY_HISTOGRAM_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace util {
+
+    // Cheap timestamp for timing single operations: the time stamp counter where there is
+    // one, nanoseconds otherwise. Not serializing, which is fine for operations of a few
+    // hundred cycles and up.
+    static inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    // `read_cycles` ticks per nanosecond, measured once against the steady clock.
+    static double cycles_per_ns() {
+        static const double ratio = [] {
+#if defined(__x86_64__) || defined(__i386__)
+            auto clock_begin = std::chrono::steady_clock::now();
+            uint64_t cycles_begin = read_cycles();
+            while (std::chrono::steady_clock::now() - clock_begin < std::chrono::milliseconds(20));
+            uint64_t cycles = read_cycles() - cycles_begin;
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - clock_begin).count();
+            return static_cast<double>(cycles) / ns;
+#else
+            return 1.0;
+#endif
+        }();
+        return ratio;
+    }
+
+    // Log-bucketed histogram of `read_cycles` intervals, like HdrHistogram: values below
+    // 2 * `kSubBuckets` get a bucket each, every power of two above is split into
+    // `kSubBuckets` linear buckets, so percentiles are within 1 / `kSubBuckets` (3%). Recording
+    // is a few shifts and an increment, cheap enough to time every operation of a run.
+    class LatencyHistogram {
+        static const int kSubBucketBits = 5;
+        static const uint64_t kSubBuckets = 1 << kSubBucketBits;
+        static const size_t kNumBuckets = (65 - kSubBucketBits) * kSubBuckets;
+
+    public:
+        LatencyHistogram(): counts_(kNumBuckets, 0) {}
+
+        inline void Record(uint64_t cycles) {
+            ++counts_[BucketOf(cycles)];
+            ++count_;
+            max_ = std::max(max_, cycles);
+        }
+
+        void Merge(const LatencyHistogram &other) {
+            for (size_t i = 0; i < kNumBuckets; ++i) counts_[i] += other.counts_[i];
+            count_ += other.count_;
+            max_ = std::max(max_, other.max_);
+        }
+
+        size_t count() const { return count_; }
+
+        // The `p`-th percentile (0 < p <= 100) in nanoseconds: the largest value that shares a
+        // bucket with it. 0 for an empty histogram.
+        uint64_t Percentile(double p) const {
+            if (count_ == 0) return 0;
+            size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * count_));
+            rank = std::min(std::max<size_t>(rank, 1), count_);
+            size_t seen = 0;
+            for (size_t i = 0; i < kNumBuckets; ++i) {
+                seen += counts_[i];
+                if (seen >= rank) return ToNs(std::min(HighestInBucket(i), max_));
+            }
+            return ToNs(max_);
+        }
+
+        uint64_t Max() const { return ToNs(max_); }
+
+        // Output columns for `op`, e.g. " p50_ns/lookup:212 ... max_ns/lookup:48211". None if
+        // nothing was recorded, e.g. for ranges in a workload without any.
+        std::string Columns(const std::string &op) const {
+            if (count_ == 0) return "";
+            std::ostringstream out;
+            out << " p50_ns/" << op << ":" << Percentile(50)
+                << " p90_ns/" << op << ":" << Percentile(90)
+                << " p99_ns/" << op << ":" << Percentile(99)
+                << " p99.9_ns/" << op << ":" << Percentile(99.9)
+                << " max_ns/" << op << ":" << Max();
+            return out.str();
+        }
+
+    private:
+        static inline size_t BucketOf(uint64_t v) {
+            int bits = 64 - __builtin_clzll(v | 1);
+            if (bits <= kSubBucketBits + 1) return v;
+            int shift = bits - kSubBucketBits - 1;
+            return (static_cast<size_t>(shift) << kSubBucketBits) + (v >> shift);
+        }
+
+        static inline uint64_t HighestInBucket(size_t bucket) {
+            if (bucket < 2 * kSubBuckets) return bucket;
+            int shift = static_cast<int>(bucket >> kSubBucketBits) - 1;
+            uint64_t mantissa = bucket - (static_cast<uint64_t>(shift) << kSubBucketBits);
+            return ((mantissa + 1) << shift) - 1;
+        }
+
+        static inline uint64_t ToNs(uint64_t cycles) {
+            return static_cast<uint64_t>(cycles / cycles_per_ns());
+        }
+
+        std::vector<uint64_t> counts_;
+        size_t count_ = 0;
+        uint64_t max_ = 0;
+    };
+}
+
+#endif //ARTS_LATENCY_HISTOGRAM_H
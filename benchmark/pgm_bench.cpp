@@ -14,8 +14,7 @@ using namespace std;
 template<typename KeyType, typename ValueType>
 void ReadOnlyBenchmark(const string data_file, const Config &config) {
     // Load data
-    vector<KeyType> origin_keys = util::load_data<KeyType>(data_file);
-    auto keys = vector<KeyType>(origin_keys.begin(), origin_keys.begin() + config.init_num_keys);
+    auto keys = util::map_data<KeyType>(data_file, config.init_num_keys);
     auto values = util::make_key_value<KeyType, ValueType>(keys);
 
     // Build
@@ -28,20 +27,25 @@ void ReadOnlyBenchmark(const string data_file, const Config &config) {
     vector<KeyType> lookup_keys;
     util::generate_point_lookup<KeyType>(keys, lookup_keys, config.num_operations, config.lookup_distribution);
 
+    util::LatencyHistogram lookup_latency;
     auto lookup_begin = chrono::high_resolution_clock::now();
     for (size_t i = 0; i < lookup_keys.size(); ++i) {
+        uint64_t start_cycles = util::read_cycles();
         auto approx_range = pgm_.search(lookup_keys[i]);
         auto lo = approx_range.lo;
         auto hi = approx_range.hi;
         auto it = std::lower_bound(keys.begin()+lo, keys.begin()+hi, lookup_keys[i]);
+        lookup_latency.Record(util::read_cycles() - start_cycles);
     }
     auto lookup_end = chrono::high_resolution_clock::now();
 
     // Range queries
     vector<RangeLookup<KeyType>> range_lookup = util::generate_range_lookups<KeyType>(keys, keys.size(), config.num_operations, config.max_range, config.lookup_distribution);
 
+    util::LatencyHistogram range_latency;
     auto range_lookup_begin = chrono::high_resolution_clock::now();
     for (const RangeLookup<KeyType>& lookup_iter : range_lookup) {
+        uint64_t start_cycles = util::read_cycles();
         auto approx_range = pgm_.search(lookup_iter.start);
         auto lo = approx_range.lo;
         auto hi = approx_range.hi;
@@ -51,6 +55,7 @@ void ReadOnlyBenchmark(const string data_file, const Config &config) {
         for (; it != keys.end() && *it < lookup_iter.end; ++it) {
             kvs.push_back(values[it-keys.begin()]);
         }
+        range_latency.Record(util::read_cycles() - start_cycles);
     }
     auto range_lookup_end = chrono::high_resolution_clock::now();
 
@@ -63,7 +68,9 @@ void ReadOnlyBenchmark(const string data_file, const Config &config) {
          << " used_memory[MB]:" << (pgm_.size_in_bytes() / 1000.0) / 1000.0
          << " build_time[s]:" << (build_ns / 1000.0 / 1000.0) / 1000.0
          << " ns/lookup:" << lookup_ns / lookup_keys.size()
+         << lookup_latency.Columns("lookup")
          << " ns/range:" << range_lookup_ns / range_lookup.size()
+         << range_latency.Columns("range")
          << endl;
 }
 
@@ -83,6 +90,8 @@ int main(int argc, char** argv) {
             ReadOnlyBenchmark<uint64_t, uint64_t>(data_file, config);
             break;
         }
+        default:
+            util::fail("unsupported workload: " + workload_type);
     }
     return 0;
 }
@@ -7,16 +7,27 @@
 
 #include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <iostream>
 #include <functional>
 #include <fstream>
+#include <iterator>
+#include <memory>
 #include <thread>
 #include <vector>
 #include <cassert>
 #include <sstream>
 #include <unordered_map>
 #include <unordered_set>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "zipf.h"
+#include "latency_histogram.h"
 using std::vector;
 
 #define ROW_WIDTH 1
@@ -32,7 +43,9 @@ enum WorkloadType {
     SMALL_RANGE = 2,
     WRITE_HEAVY = 3,
     WRITE_ONLY = 4,
-    READ_RANGE_WRITE = 5
+    READ_RANGE_WRITE = 5,
+    DELETE_HEAVY = 6,
+    COLD_START = 7
 };
 
 
@@ -43,6 +56,7 @@ public:
     int max_range = 100;
     int batch_size = num_operations / 2;
     double insert_frac = 0.0;
+    double delete_frac = 0.0;
     double range_frac = 0.0;
     std::string lookup_distribution = "zipf";
     std::string insert_distribution = "uniform";
@@ -126,9 +140,101 @@ namespace util {
         return data;
     }
 
+    // How `map_data` maps a data file. By default the whole file is faulted in up front, so
+    // page faults don't land in the timed parts. `DATA_MAP` overrides it with a comma
+    // separated list of `lazy` (no `MAP_POPULATE`), `hugepage` and one of the `madvise`
+    // hints `sequential`, `random` and `willneed`.
+    struct MapOptions {
+        bool populate = true;
+        bool huge_pages = false;  // only taken if the kernel backs files with huge pages
+        int advice = MADV_NORMAL;
+
+        static MapOptions FromEnv() {
+            MapOptions options;
+            const char *env = getenv("DATA_MAP");
+            std::stringstream ss(env ? env : "");
+            std::string option;
+            while (std::getline(ss, option, ',')) {
+                if (option == "lazy") options.populate = false;
+                else if (option == "hugepage") options.huge_pages = true;
+                else if (option == "sequential") options.advice = MADV_SEQUENTIAL;
+                else if (option == "random") options.advice = MADV_RANDOM;
+                else if (option == "willneed") options.advice = MADV_WILLNEED;
+                else std::cerr << "ignoring unknown DATA_MAP option " << option << std::endl;
+            }
+            return options;
+        }
+    };
+
+    // Read-only view of the keys of a `load_data` file, see `map_data`. Copies and prefixes
+    // share the mapping, which goes away with the last of them.
+    template<typename T>
+    class Dataset {
+    public:
+        typedef T value_type;
+        typedef const T *iterator;
+        typedef const T *const_iterator;
+
+        Dataset() = default;
+
+        Dataset(std::shared_ptr<void> mapping, const T *data, size_t size)
+                : mapping_(std::move(mapping)), data_(data), size_(size) {}
+
+        const T *data() const { return data_; }
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        const T *begin() const { return data_; }
+        const T *end() const { return data_ + size_; }
+        const T &operator[](size_t i) const { return data_[i]; }
+        const T &front() const { return data_[0]; }
+        const T &back() const { return data_[size_ - 1]; }
+
+        // The first `n` keys, without copying.
+        Dataset Prefix(size_t n) const {
+            return Dataset(mapping_, data_, std::min(n, size_));
+        }
+
+    private:
+        std::shared_ptr<void> mapping_;
+        const T *data_ = nullptr;
+        size_t size_ = 0;
+    };
+
+    // `load_data` without reading the file: maps it instead, so the keys are shared with the
+    // page cache and only the pages touched are ever read. Only the first `max_keys` keys are
+    // mapped, `Dataset::Prefix` slices a mapping further.
+    template<typename T>
+    static Dataset<T> map_data(const std::string &filename, size_t max_keys = SIZE_MAX,
+                               MapOptions options = MapOptions::FromEnv()) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(uint64_t)) {
+            std::cerr << "unable to open " << filename << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        size_t length = st.st_size;
+        if (max_keys < (length - sizeof(uint64_t)) / sizeof(T)) length = sizeof(uint64_t) + max_keys * sizeof(T);
+        void *base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE | (options.populate ? MAP_POPULATE : 0), fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            std::cerr << "unable to map " << filename << std::endl;
+            exit(EXIT_FAILURE);
+        }
+#ifdef MADV_HUGEPAGE
+        if (options.huge_pages) madvise(base, length, MADV_HUGEPAGE);
+#endif
+        if (options.advice != MADV_NORMAL) madvise(base, length, options.advice);
+
+        std::shared_ptr<void> mapping(base, [length](void *p) { munmap(p, length); });
+        uint64_t size = *static_cast<const uint64_t *>(base);
+        size = std::min<uint64_t>(size, (length - sizeof(uint64_t)) / sizeof(T));
+        auto data = reinterpret_cast<const T *>(static_cast<const char *>(base) + sizeof(uint64_t));
+        return Dataset<T>(std::move(mapping), data, size);
+    }
+
     // Generates deterministic values for keys.
-    template<typename KeyType, typename ValueType>
-    static vector<std::pair<KeyType, ValueType>> make_key_value(const vector<KeyType> &keys) {
+    template<typename KeyType, typename ValueType, typename Keys = vector<KeyType>>
+    static vector<std::pair<KeyType, ValueType>> make_key_value(const Keys &keys) {
         vector<std::pair<KeyType, ValueType>> result;
         result.reserve(keys.size());
 
@@ -139,8 +245,8 @@ namespace util {
     }
 
     // Generates deterministic values for keys.
-    template<typename KeyType, typename ValueType>
-    static vector<ValueType> make_values(const vector<KeyType>& keys) {
+    template<typename KeyType, typename ValueType, typename Keys = vector<KeyType>>
+    static vector<ValueType> make_values(const Keys& keys) {
         vector<ValueType> result;
         result.reserve(keys.size());
 
@@ -150,6 +256,66 @@ namespace util {
         return result;
     }
 
+    // Input iterator over the first `max_keys` keys of a `load_data` file, paired with their
+    // position like `make_values`. Reads the file in blocks, so an index can be bulk loaded
+    // from it without holding the keys and values in vectors first. Default constructed, it
+    // is the end iterator.
+    template<typename KeyType, typename ValueType>
+    class DataFileIterator {
+        static const size_t kBlockKeys = 1 << 16;
+
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef std::pair<KeyType, ValueType> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type *pointer;
+        typedef const value_type &reference;
+
+        DataFileIterator() = default;
+
+        DataFileIterator(const std::string &filename, size_t max_keys)
+                : in_(std::make_shared<std::ifstream>(filename, std::ios::binary)) {
+            if (!in_->is_open()) {
+                std::cerr << "unable to open " << filename << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            uint64_t size;
+            in_->read(reinterpret_cast<char *>(&size), sizeof(uint64_t));
+            remaining_ = std::min<size_t>(size, max_keys);
+            ++*this;
+        }
+
+        reference operator*() const { return current_; }
+        pointer operator->() const { return &current_; }
+
+        DataFileIterator &operator++() {
+            if (remaining_ == 0) {
+                in_.reset();
+                return *this;
+            }
+            if (next_ == block_.size()) {
+                block_.resize(std::min(kBlockKeys, remaining_));
+                in_->read(reinterpret_cast<char *>(block_.data()), block_.size() * sizeof(KeyType));
+                next_ = 0;
+            }
+            current_ = {block_[next_++], position_++};
+            --remaining_;
+            return *this;
+        }
+
+        bool operator==(const DataFileIterator &other) const { return in_ == other.in_; }
+        bool operator!=(const DataFileIterator &other) const { return in_ != other.in_; }
+
+    private:
+        // Shared by copies, as for any input iterator. Null once exhausted.
+        std::shared_ptr<std::ifstream> in_;
+        std::vector<KeyType> block_;
+        size_t next_ = 0;
+        size_t remaining_ = 0;
+        ValueType position_ = 0;
+        value_type current_;
+    };
+
     static std::string get_file_name(const std::string &str) {
         std::stringstream ss(str);
         std::string tmp;
@@ -161,11 +327,42 @@ namespace util {
         return result.back();
     }
 
+    // Returns the number of threads OpenMP regions use, set with `OMP_NUM_THREADS`.
+    static int get_max_threads() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    // Returns the resident set size of this process in bytes, or 0 if it is unknown.
+    static size_t get_rss_bytes() {
+#ifdef __linux__
+        std::ifstream statm("/proc/self/statm");
+        size_t total_pages = 0, resident_pages = 0;
+        if (statm >> total_pages >> resident_pages) return resident_pages * sysconf(_SC_PAGESIZE);
+#endif
+        return 0;
+    }
+
+    // Highest resident set size of the process so far.
+    static size_t get_peak_rss_bytes() {
+#ifdef __linux__
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0) return std::stoull(line.substr(6)) * 1024;
+        }
+#endif
+        return 0;
+    }
+
     // Returns a duplicate-free copy.
     // Note that data has to be sorted.
-    template<typename T>
-    static std::vector<T> remove_duplicates(const std::vector<T>& data, size_t size) {
-        std::vector<T> result = data;
+    template<typename Keys>
+    static std::vector<typename Keys::value_type> remove_duplicates(const Keys& data, size_t size) {
+        std::vector<typename Keys::value_type> result(data.begin(), data.end());
         auto last = std::unique(result.begin(), result.begin()+size);
         result.erase(last, result.begin()+size);
         return result;
@@ -176,6 +373,10 @@ namespace util {
         if (workload_type == "ro") { // read only
             config.workload_type = WorkloadType::READ_ONLY;
             return config;
+        } else if (workload_type == "ru") { // read only, uniform lookups
+            config.workload_type = WorkloadType::READ_ONLY;
+            config.lookup_distribution = "uniform";
+            return config;
         } else if (workload_type == "rh") { // read heavy
             config.workload_type = WorkloadType::READ_HEAVY;
             config.insert_frac = 0.05;
@@ -198,6 +399,13 @@ namespace util {
             config.insert_frac = 0.4;
             config.range_frac = 0.5;
             return config;
+        } else if (workload_type == "dh") { // delete heavy
+            config.workload_type = WorkloadType::DELETE_HEAVY;
+            config.delete_frac = 0.5;
+            return config;
+        } else if (workload_type == "cs") { // cold start
+            config.workload_type = WorkloadType::COLD_START;
+            return config;
         } else {
             std::cerr << "workload type " << workload_type << " not supported" << std::endl;
             exit(EXIT_FAILURE);
@@ -239,8 +447,9 @@ namespace util {
     };
 
     // Generates `num_lookups` lookups that satisfies `zipf` distribution.
-    template<typename KeyType>
-    void generate_point_lookup(vector<KeyType>& keys, vector<KeyType>& lookup_keys,
+    // `keys` may be a `vector` or a `Dataset`, like in the generators below.
+    template<typename KeyType, typename Keys>
+    void generate_point_lookup(const Keys& keys, vector<KeyType>& lookup_keys,
                          const size_t num_lookups, const std::string lookup_distribution) {
 
 
@@ -270,8 +479,8 @@ namespace util {
 
     }
 
-    template<typename KeyType>
-    void generate_insert(vector<KeyType>& keys, vector<KeyType>& insert_keys,
+    template<typename KeyType, typename Keys>
+    void generate_insert(const Keys& keys, vector<KeyType>& insert_keys,
                                const size_t num_inserts, const std::string insert_distribution) {
 
         if (insert_distribution == "uniform") {
@@ -298,8 +507,8 @@ namespace util {
         }
     }
 
-    template<typename KeyType>
-    vector<RangeLookup<KeyType>> generate_range_lookups(const vector<KeyType>& keys, size_t size,
+    template<typename KeyType, typename Keys>
+    vector<RangeLookup<KeyType>> generate_range_lookups(const Keys& keys, size_t size,
                                                                    const size_t num_range, const size_t max_range,  std::string lookup_distribution) {
 
         vector<RangeLookup<KeyType>> lookups;
@@ -331,7 +540,7 @@ namespace util {
             KeyType start_key = unique_keys[start_offset], end_key = start_key;
 
             // Perform binary search on original keys.
-            auto it = lower_bound(keys.begin(), keys.begin()+size, start_key);
+            auto it = std::lower_bound(keys.begin(), keys.begin()+size, start_key);
             uint64_t ele_num = 0;
             for (; it != keys.begin()+size && ele_num < range_num; ++it) {
                 ++ele_num;
@@ -344,8 +553,8 @@ namespace util {
         return lookups;
     }
 
-    template<typename KeyType>
-    vector<RangeLookup<KeyType>> generate_range_lookups(const vector<KeyType>& keys, size_t size,
+    template<typename KeyType, typename Keys>
+    vector<RangeLookup<KeyType>> generate_range_lookups(const Keys& keys, size_t size,
                                                         const size_t num_range, const size_t max_range,  std::string lookup_distribution, int seed) {
 
         vector<RangeLookup<KeyType>> lookups;
@@ -377,7 +586,7 @@ namespace util {
             KeyType start_key = unique_keys[start_offset], end_key = start_key;
 
             // Perform binary search on original keys.
-            auto it = lower_bound(keys.begin(), keys.begin()+size, start_key);
+            auto it = std::lower_bound(keys.begin(), keys.begin()+size, start_key);
             uint64_t ele_num = 0;
             for (; it != keys.begin()+size && ele_num < range_num; ++it) {
                 ++ele_num;
@@ -390,11 +599,11 @@ namespace util {
         return lookups;
     }
 
-    template <class T>
-    T* get_search_keys(vector<T> &array, int num_keys, int num_searches) {
+    template <class Keys>
+    typename Keys::value_type* get_search_keys(const Keys &array, int num_keys, int num_searches) {
         std::mt19937_64 gen(42);
         std::uniform_int_distribution<int> dis(0, num_keys - 1);
-        auto* keys = new T[num_searches];
+        auto* keys = new typename Keys::value_type[num_searches];
         for (int i = 0; i < num_searches; i++) {
             int pos = dis(gen);
             keys[i] = array[pos];
@@ -402,11 +611,11 @@ namespace util {
         return keys;
     }
 
-    template <class T>
-    T* get_search_keys(vector<T> &array, int num_keys, int num_searches, int seed) {
+    template <class Keys>
+    typename Keys::value_type* get_search_keys(const Keys &array, int num_keys, int num_searches, int seed) {
         std::mt19937_64 gen(seed);
         std::uniform_int_distribution<int> dis(0, num_keys - 1);
-        auto* keys = new T[num_searches];
+        auto* keys = new typename Keys::value_type[num_searches];
         for (int i = 0; i < num_searches; i++) {
             int pos = dis(gen);
             keys[i] = array[pos];
@@ -414,9 +623,9 @@ namespace util {
         return keys;
     }
 
-    template <class T>
-    T* get_search_keys_zipf(vector<T> &array, int num_keys, int num_searches) {
-        auto* keys = new T[num_searches];
+    template <class Keys>
+    typename Keys::value_type* get_search_keys_zipf(const Keys &array, int num_keys, int num_searches) {
+        auto* keys = new typename Keys::value_type[num_searches];
         ScrambledZipfianGenerator zipf_gen(num_keys);
         for (int i = 0; i < num_searches; i++) {
             int pos = zipf_gen.nextValue();
@@ -425,9 +634,9 @@ namespace util {
         return keys;
     }
 
-    template <class T>
-    T* get_search_keys_zipf(vector<T> &array, int num_keys, int num_searches, int seed) {
-        auto* keys = new T[num_searches];
+    template <class Keys>
+    typename Keys::value_type* get_search_keys_zipf(const Keys &array, int num_keys, int num_searches, int seed) {
+        auto* keys = new typename Keys::value_type[num_searches];
         ScrambledZipfianGenerator zipf_gen(num_keys, seed);
         for (int i = 0; i < num_searches; i++) {
             int pos = zipf_gen.nextValue();
@@ -436,8 +645,8 @@ namespace util {
         return keys;
     }
 
-    template<typename KeyType>
-    void sample_keys(const vector<KeyType>& keys, size_t size, vector<KeyType>& sample, vector<KeyType>& remain,
+    template<typename KeyType, typename Keys>
+    void sample_keys(const Keys& keys, size_t size, vector<KeyType>& sample, vector<KeyType>& remain,
                      const size_t num_sample) {
         int gap = size / num_sample;
         for (int i = 0; i < size; i++) {
@@ -0,0 +1,291 @@
+#ifndef ARTS_ALLOCATOR_H
+#define ARTS_ALLOCATOR_H
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+#include "concurrency.h"
+
+namespace wahl {
+
+    // What the bytes handed out by a `SlabAllocator` are used for.
+    enum class MemoryTag : uint8_t {
+        kDirectory,  // ART inner nodes and leaves
+        kSegment,    // segment headers and tombstones
+        kData,       // segment key and value arrays
+        kBuffer,     // slot buffer tables, slot buffers and their list and tree nodes
+        kOverflow,   // nodes of the global overflow buffer
+        kNumTags
+    };
+
+    // Serves blocks up to `kMaxSmallSize` bytes from 16 byte size classes carved out of 1 MB
+    // chunks, with one free list per class, so blocks freed by a rebuild are reused by the next
+    // one. Blocks whose size is a multiple of 64 are cache line aligned, all others 16 byte
+    // aligned. Larger blocks come from `aligned_alloc`, cache line aligned, and are linked into
+    // a list. Everything is released at once when the allocator is destroyed, so owners may
+    // skip freeing individual blocks on teardown.
+    class SlabAllocator {
+        static const size_t kAlignment = 16;
+        static const size_t kCacheLine = 64;
+        static const size_t kMaxSmallSize = 4096;
+        static const size_t kNumClasses = kMaxSmallSize / kAlignment;
+        static const size_t kChunkSize = 1 << 20;
+
+        struct FreeBlock {
+            FreeBlock *next;
+        };
+
+        // Precedes every large block. Padded to a cache line, so the block starts on one.
+        struct alignas(kCacheLine) LargeBlock {
+            LargeBlock *prev;
+            LargeBlock *next;
+            size_t size;
+        };
+
+    public:
+        // `concurrent` guards every call with a latch, for indexes shared between threads.
+        explicit SlabAllocator(bool concurrent = false): concurrent_(concurrent) {
+            for (auto &bytes : allocated_bytes_) bytes.store(0, std::memory_order_relaxed);
+        }
+
+        ~SlabAllocator() {
+            for (void *chunk : chunks_) free(chunk);
+            for (LargeBlock *block = large_blocks_, *next; block; block = next) {
+                next = block->next;
+                free(block);
+            }
+        }
+
+        SlabAllocator(const SlabAllocator &) = delete;
+        SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+        void *Allocate(size_t size, MemoryTag tag) {
+            allocated_bytes_[static_cast<size_t>(tag)].fetch_add(size, std::memory_order_relaxed);
+            size = RoundUp(size == 0 ? 1 : size, kAlignment);
+            Lock();
+            void *p = size <= kMaxSmallSize ? AllocateSmall(size) : AllocateLarge(size);
+            Unlock();
+            return p;
+        }
+
+        // `size` must be the size the block was allocated with.
+        void Deallocate(void *p, size_t size, MemoryTag tag) {
+            if (p == nullptr) return;
+            allocated_bytes_[static_cast<size_t>(tag)].fetch_sub(size, std::memory_order_relaxed);
+            size = RoundUp(size == 0 ? 1 : size, kAlignment);
+            Lock();
+            if (size <= kMaxSmallSize) PushFree(p, size);
+            else FreeLarge(p);
+            Unlock();
+        }
+
+        template<typename T, typename... Args>
+        inline T *New(MemoryTag tag, Args &&... args) {
+            static_assert(alignof(T) <= kAlignment || sizeof(T) % kCacheLine == 0,
+                          "over-aligned types must fill whole cache lines");
+            return new (Allocate(sizeof(T), tag)) T{std::forward<Args>(args)...};
+        }
+
+        template<typename T>
+        inline void Delete(T *object, MemoryTag tag) {
+            if (object == nullptr) return;
+            object->~T();
+            Deallocate(object, sizeof(T), tag);
+        }
+
+        // True for the allocators of thread-safe indexes, whose readers may still hold blocks
+        // that their owner replaced.
+        inline bool concurrent() const { return concurrent_; }
+
+        // Bytes currently requested for `tag`, before rounding up to the size classes.
+        inline size_t allocated_bytes(MemoryTag tag) const {
+            return allocated_bytes_[static_cast<size_t>(tag)].load(std::memory_order_relaxed);
+        }
+
+        // Bytes currently obtained from the system, including free blocks.
+        inline size_t reserved_bytes() const {
+            return reserved_bytes_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        static inline size_t RoundUp(size_t size, size_t alignment) {
+            return (size + alignment - 1) / alignment * alignment;
+        }
+
+        inline void Lock() {
+            if (concurrent_) latch_.Lock();
+        }
+
+        inline void Unlock() {
+            if (concurrent_) latch_.Unlock();
+        }
+
+        inline void PushFree(void *p, size_t size) {
+            auto block = static_cast<FreeBlock *>(p);
+            auto &head = free_lists_[size / kAlignment - 1];
+            block->next = head;
+            head = block;
+        }
+
+        void *AllocateSmall(size_t size) {
+            auto &head = free_lists_[size / kAlignment - 1];
+            if (head) {
+                FreeBlock *block = head;
+                head = block->next;
+                return block;
+            }
+            size_t alignment = size % kCacheLine == 0 ? kCacheLine : kAlignment;
+            size_t offset = RoundUp(chunk_offset_, alignment);
+            if (chunks_.empty() || offset + size > kChunkSize) {
+                void *chunk = aligned_alloc(kCacheLine, kChunkSize);
+                if (chunk == nullptr) throw std::bad_alloc();
+                chunks_.push_back(chunk);
+                reserved_bytes_.fetch_add(kChunkSize, std::memory_order_relaxed);
+                chunk_offset_ = offset = 0;
+            } else if (offset != chunk_offset_) {
+                // Keep the padding in front of a cache line aligned block for smaller classes.
+                PushFree(static_cast<char *>(chunks_.back()) + chunk_offset_, offset - chunk_offset_);
+            }
+            chunk_offset_ = offset + size;
+            return static_cast<char *>(chunks_.back()) + offset;
+        }
+
+        void *AllocateLarge(size_t size) {
+            size = RoundUp(size, kCacheLine);
+            auto block = static_cast<LargeBlock *>(aligned_alloc(kCacheLine, sizeof(LargeBlock) + size));
+            if (block == nullptr) throw std::bad_alloc();
+            block->prev = nullptr;
+            block->next = large_blocks_;
+            block->size = size;
+            if (large_blocks_) large_blocks_->prev = block;
+            large_blocks_ = block;
+            reserved_bytes_.fetch_add(sizeof(LargeBlock) + size, std::memory_order_relaxed);
+            return block + 1;
+        }
+
+        void FreeLarge(void *p) {
+            LargeBlock *block = static_cast<LargeBlock *>(p) - 1;
+            if (block->prev) block->prev->next = block->next;
+            else large_blocks_ = block->next;
+            if (block->next) block->next->prev = block->prev;
+            reserved_bytes_.fetch_sub(sizeof(LargeBlock) + block->size, std::memory_order_relaxed);
+            free(block);
+        }
+
+        const bool concurrent_;
+        SpinLatch latch_;
+
+        FreeBlock *free_lists_[kNumClasses] = {};
+        std::vector<void *> chunks_;
+        size_t chunk_offset_ = 0;
+        LargeBlock *large_blocks_ = nullptr;
+
+        std::atomic<size_t> allocated_bytes_[static_cast<size_t>(MemoryTag::kNumTags)];
+        std::atomic<size_t> reserved_bytes_{0};
+    };
+
+    // The helpers below fall back to the global heap without an allocator, so the structures
+    // also work on their own.
+
+    static inline void *AllocateBytes(SlabAllocator *allocator, size_t size, MemoryTag tag) {
+        return allocator ? allocator->Allocate(size, tag) : ::operator new(size);
+    }
+
+    static inline void DeallocateBytes(SlabAllocator *allocator, void *p, size_t size, MemoryTag tag) {
+        if (allocator) allocator->Deallocate(p, size, tag);
+        else ::operator delete(p);
+    }
+
+    template<typename T>
+    static inline T *AllocateArray(SlabAllocator *allocator, size_t n, MemoryTag tag) {
+        return static_cast<T *>(AllocateBytes(allocator, n * sizeof(T), tag));
+    }
+
+    template<typename T>
+    static inline void DeallocateArray(SlabAllocator *allocator, T *array, size_t n, MemoryTag tag) {
+        DeallocateBytes(allocator, array, n * sizeof(T), tag);
+    }
+
+    template<typename T, typename... Args>
+    static inline T *CreateObject(SlabAllocator *allocator, MemoryTag tag, Args &&... args) {
+        if (allocator) return allocator->New<T>(tag, std::forward<Args>(args)...);
+        return new T{std::forward<Args>(args)...};
+    }
+
+    template<typename T>
+    static inline void DestroyObject(SlabAllocator *allocator, T *object, MemoryTag tag) {
+        if (allocator) allocator->Delete(object, tag);
+        else delete object;
+    }
+
+    // Deleter for `EpochManager::Retire`, with the allocator as context.
+    template<typename T, MemoryTag kTag>
+    static void DestroyRetired(void *object, void *allocator) {
+        DestroyObject(static_cast<SlabAllocator *>(allocator), static_cast<T *>(object), kTag);
+    }
+
+    // Standard allocator adapter, lets the stx B+ trees of the overflow buffers allocate their
+    // nodes from the index's `SlabAllocator`.
+    template<typename T>
+    class SlabStlAllocator {
+        template<typename U> friend class SlabStlAllocator;
+    public:
+        typedef T value_type;
+        typedef T *pointer;
+        typedef const T *const_pointer;
+        typedef T &reference;
+        typedef const T &const_reference;
+        typedef size_t size_type;
+        typedef ptrdiff_t difference_type;
+
+        template<typename U>
+        struct rebind {
+            typedef SlabStlAllocator<U> other;
+        };
+
+        SlabStlAllocator(SlabAllocator *allocator = nullptr, MemoryTag tag = MemoryTag::kBuffer)
+                : allocator_(allocator), tag_(tag) {}
+
+        template<typename U>
+        SlabStlAllocator(const SlabStlAllocator<U> &other): allocator_(other.allocator_), tag_(other.tag_) {}
+
+        inline T *allocate(size_t n) {
+            return AllocateArray<T>(allocator_, n, tag_);
+        }
+
+        inline void deallocate(T *p, size_t n) {
+            DeallocateArray(allocator_, p, n, tag_);
+        }
+
+        template<typename U, typename... Args>
+        inline void construct(U *p, Args &&... args) {
+            new (p) U(std::forward<Args>(args)...);
+        }
+
+        template<typename U>
+        inline void destroy(U *p) {
+            p->~U();
+        }
+
+        template<typename U>
+        inline bool operator==(const SlabStlAllocator<U> &other) const {
+            return allocator_ == other.allocator_;
+        }
+
+        template<typename U>
+        inline bool operator!=(const SlabStlAllocator<U> &other) const {
+            return allocator_ != other.allocator_;
+        }
+
+    private:
+        SlabAllocator *allocator_;
+        MemoryTag tag_;
+    };
+}
+
+#endif //ARTS_ALLOCATOR_H
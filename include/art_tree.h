@@ -14,6 +14,12 @@
 #include <map>
 #include <vector>
 #include <utility>
+#include <atomic>
+#include <limits>
+#include <type_traits>
+#include "allocator.h"
+#include "concurrency.h"
+#include "stats.h"
 
 namespace wahl {
 
@@ -25,22 +31,41 @@ namespace wahl {
     class ArtTree {
     public:
 
-        ArtTree() {
-            allocated_byte_count = 0;
-        }
+        ArtTree() = default;
 
-        ~ArtTree() { destructTree(tree_); }
+        ~ArtTree() {
+            if (!allocator_) {
+                destructTree(tree_);
+                if (radix_table_) destroyRadixTable(radix_table_, nullptr);
+            }
+        }
 
         ArtTree(const ArtTree &) = delete;
         ArtTree &operator=(ArtTree & tree) = delete;
 
-        ArtTree(ArtTree && t): tree_(t.tree_) {
+        ArtTree(ArtTree && t): tree_(t.tree_), epoch_manager_(t.epoch_manager_), allocator_(t.allocator_),
+                               radix_table_(t.radix_table_), radix_bits_(t.radix_bits_),
+                               inner_node_bytes_(t.inner_node_bytes_.load()), leaf_bytes_(t.leaf_bytes_.load()) {
             t.tree_ = nullptr;
+            t.radix_table_ = nullptr;
+            t.radix_bits_ = 0;
+            t.inner_node_bytes_ = 0;
+            t.leaf_bytes_ = 0;
         }
 
         ArtTree &operator=(ArtTree && t) {
             tree_ = t.tree_;
+            epoch_manager_ = t.epoch_manager_;
+            allocator_ = t.allocator_;
+            radix_table_ = t.radix_table_;
+            radix_bits_ = t.radix_bits_;
+            inner_node_bytes_ = t.inner_node_bytes_.load();
+            leaf_bytes_ = t.leaf_bytes_.load();
             t.tree_ = nullptr;
+            t.radix_table_ = nullptr;
+            t.radix_bits_ = 0;
+            t.inner_node_bytes_ = 0;
+            t.leaf_bytes_ = 0;
             return *this;
         }
 
@@ -48,7 +73,10 @@ namespace wahl {
         void Remove(KeyType key) {
             uint8_t reverse_key[KEY_SIZE];
             swapBytes(key, reverse_key);
+            lockRadix();
             erase(reverse_key);
+            refreshRadix(key, key);
+            unlockRadix();
         }
 
         void* LowerBound(KeyType key) const {
@@ -56,12 +84,142 @@ namespace wahl {
             swapBytes(key, reverse_key);
             // Lower bound lookup.
             Iterator it;
+            if (radix_table_) {
+                const RadixEntry *entry = radixBucket(radix_table_, key);
+                if (entry) {
+                    bool need_restart = false;
+                    void *result = radixBound<false>(*entry, reverse_key, it, need_restart);
+                    CountTreeLookup(it.depth);
+                    return result;
+                }
+            }
             const bool found = bound(tree_, reverse_key,  it);
+            CountTreeLookup(it.depth);
             if (found)
                 return reinterpret_cast<void*>(it.value->value);
             return nullptr;
         }
 
+        // Lower bound lookup that may run concurrently with one writer. Inner nodes are
+        // validated with their version locks and the lookup restarts on any conflict.
+        // The caller must be registered with the epoch manager passed to `set_epoch_manager`.
+        void* OptimisticLowerBound(KeyType key) const {
+            uint8_t reverse_key[KEY_SIZE];
+            swapBytes(key, reverse_key);
+            while (true) {
+                Iterator it;
+                bool need_restart = false;
+                // Writers hold the table lock across the tree change and the table patch, so an
+                // entry read under it matches the tree. The table is loaded under it as well, a
+                // rebuild swaps it.
+                const uint64_t version = radix_lock_.ReadLockOrRestart(need_restart);
+                const RadixTable *table = __atomic_load_n(&radix_table_, __ATOMIC_ACQUIRE);
+                const RadixEntry *entry = table ? radixBucket(table, key) : nullptr;
+                if (entry) {
+                    void *result = radixBound<true>(*entry, reverse_key, it, need_restart);
+                    if (!need_restart) radix_lock_.CheckOrRestart(version, need_restart);
+                    if (need_restart)
+                        continue;
+                    CountTreeLookup(it.depth);
+                    return result;
+                }
+                const bool found = bound<true>(__atomic_load_n(&tree_, __ATOMIC_ACQUIRE), reverse_key, it, need_restart);
+                if (need_restart)
+                    continue;
+                CountTreeLookup(it.depth);
+                if (found)
+                    return reinterpret_cast<void*>(__atomic_load_n(&it.value->value, __ATOMIC_ACQUIRE));
+                return nullptr;
+            }
+        }
+
+        // Lower bound lookups of up to `kMaxGroupSize` keys at once. The keys first descend their
+        // exact-match paths level by level, prefetching every child before any key of the group
+        // touches it, so that the cache misses of independent lookups overlap. The lower bound of
+        // each key is then resolved over the warm paths. With a radix table, keys start their
+        // descent at the subtree of their bucket.
+        void LowerBoundGroup(const KeyType *keys, size_t num_keys, void **results) {
+            assert(num_keys <= kMaxGroupSize);
+            uint8_t reverse_keys[kMaxGroupSize][KEY_SIZE];
+            Node *nodes[kMaxGroupSize];
+            unsigned depths[kMaxGroupSize];
+            const RadixEntry *entries[kMaxGroupSize];
+            for (size_t i = 0; i < num_keys; ++i) {
+                swapBytes(keys[i], reverse_keys[i]);
+                entries[i] = radix_table_ ? radixBucket(radix_table_, keys[i]) : nullptr;
+                if (entries[i]) __builtin_prefetch(entries[i]);
+            }
+            for (size_t i = 0; i < num_keys; ++i) {
+                nodes[i] = entries[i] ? entries[i]->subtree : tree_;
+                depths[i] = entries[i] ? entries[i]->depth : 0;
+                if (entries[i] && nodes[i] && !isLeaf(nodes[i])) __builtin_prefetch(nodes[i]);
+            }
+            for (unsigned level = 0; level < KEY_SIZE; ++level) {
+                bool descended = false;
+                for (size_t i = 0; i < num_keys; ++i) {
+                    Node *n = nodes[i];
+                    if (n == nullptr || isLeaf(n)) continue;
+                    unsigned depth = depths[i];
+                    if (prefixMismatch(n, reverse_keys[i], depth) != n->prefixLength) {
+                        // Off the exact-match path, `bound` takes it from here.
+                        nodes[i] = nullptr;
+                        continue;
+                    }
+                    depth += n->prefixLength;
+                    n = *findChild(n, reverse_keys[i][depth]);
+                    nodes[i] = n;
+                    depths[i] = depth + 1;
+                    if (n == nullptr) continue;
+                    __builtin_prefetch(isLeaf(n) ? reinterpret_cast<void *>(getLeafValue(n)) : n);
+                    descended = true;
+                }
+                if (!descended) break;
+            }
+            for (size_t i = 0; i < num_keys; ++i) {
+                Iterator it;
+                bool need_restart = false;
+                if (entries[i])
+                    results[i] = radixBound<false>(*entries[i], reverse_keys[i], it, need_restart);
+                else
+                    results[i] = bound(tree_, reverse_keys[i], it) ? reinterpret_cast<void*>(it.value->value) : nullptr;
+                CountTreeLookup(it.depth);
+            }
+        }
+
+        static constexpr size_t kMaxGroupSize = 32;
+
+        static constexpr unsigned kMaxRadixBits = 24;
+
+        // Nodes and leaves unlinked by `Insert`/`Remove` are retired through `epoch_manager`
+        // instead of being freed immediately, so that optimistic readers never touch freed memory.
+        void set_epoch_manager(EpochManager *epoch_manager) {
+            epoch_manager_ = epoch_manager;
+        }
+
+        // Allocates nodes and leaves from `allocator`. Must be set while the tree is empty. The
+        // tree then leaves its nodes to the allocator's bulk release on destruction.
+        void set_allocator(SlabAllocator *allocator) {
+            assert(tree_ == nullptr && radix_table_ == nullptr);
+            allocator_ = allocator;
+        }
+
+        // Puts a flat jump table of 2^`bits` buckets (at most `kMaxRadixBits`) in front of the
+        // tree, indexed by the key bits that follow the compressed path of the root. A bucket
+        // holds the deepest node above all of its keys, where lookups start instead of at the
+        // root, and the value of the first key past it, which answers lookups that find nothing
+        // in the bucket with a single load. `Insert`, `Remove` and `BulkBuild` keep it in sync.
+        // Takes 24 bytes per bucket, counted in `inner_node_bytes`. 0, the default, drops it.
+        // Not thread-safe.
+        void set_radix_bits(unsigned bits) {
+            radix_bits_ = std::min(bits, kMaxRadixBits);
+            if (radix_bits_) rebuildRadix();
+            else publishRadix(nullptr);
+        }
+
+        unsigned radix_bits() const {
+            return radix_bits_;
+        }
+
         uint64_t SumUp(KeyType lookup_key) {
             uint8_t reverse_key[KEY_SIZE];
             swapBytes(lookup_key, reverse_key);
@@ -110,22 +268,52 @@ namespace wahl {
         void Insert(KeyType key, uintptr_t value) {
             uint8_t reverse_key[KEY_SIZE];
             swapBytes(key, reverse_key);
-            insert(tree_, &tree_, reverse_key, 0, value);
+            lockRadix();
+            insert(tree_, &tree_, nullptr, reverse_key, 0, value);
+            refreshRadix(key, key);
+            unlockRadix();
+        }
+
+        // Inserts the sorted `keys` with their `values` (equal keys keep the last value). Key
+        // ranges that fall into empty slots, or an empty tree, are built bottom-up with every
+        // node at its final size, and published with a single store each. Only keys that meet
+        // a leaf or split a compressed path go through `Insert`. Same concurrency rules as
+        // `Insert`.
+        void BulkBuild(const std::vector<KeyType> &keys, const std::vector<uintptr_t> &values) {
+            assert(keys.size() == values.size());
+            assert(std::is_sorted(keys.begin(), keys.end()));
+            if (keys.empty()) return;
+            std::vector<KeyType> reverse_keys(keys.size());
+            for (size_t i = 0; i < keys.size(); ++i)
+                swapBytes(keys[i], reinterpret_cast<uint8_t *>(&reverse_keys[i]));
+            lockRadix();
+            bulkInsert(&tree_, nullptr, reverse_keys.data(), values.data(), 0, keys.size(), 0);
+            refreshRadix(keys.front(), keys.back());
+            unlockRadix();
         }
 
 
         std::size_t size() const {
-            return sizeof(*this) + allocated_byte_count;
+            return sizeof(*this) + inner_node_bytes() + leaf_bytes();
+        }
+
+        // Bytes of the nodes and leaves currently linked into this tree.
+        std::size_t inner_node_bytes() const {
+            return inner_node_bytes_.load(std::memory_order_relaxed);
+        }
+
+        std::size_t leaf_bytes() const {
+            return leaf_bytes_.load(std::memory_order_relaxed);
         }
 
         void print_node_msg() {
-            std::cout << "node4: " << node4_num << " node16: " << node16_num << " node48: " << node48_num <<  " node256: " << node256_num << std::endl;
+            uint64_t counts[5] = {};
+            countNodes(tree_, counts);
+            std::cout << "node4: " << counts[NodeType4] << " node16: " << counts[NodeType16] << " node48: " << counts[NodeType48] <<  " node256: " << counts[NodeType256] << " leaves: " << counts[4] << std::endl;
         }
 
 
     private:
-        static uint64_t allocated_byte_count; // track bytes allocated
-
         static const size_t KEY_SIZE = sizeof(KeyType);
 
         // Constants for the node types
@@ -146,29 +334,16 @@ namespace wahl {
             uint16_t count;
             // node type
             int8_t type;
-
-            Node(int8_t type) : count(0), type(type) {}
-
-            ~Node() {
-                switch (type) {
-                    case NodeType4: {
-                        allocated_byte_count -= sizeof(Node4);
-                        break;
-                    }
-                    case NodeType16: {
-                        allocated_byte_count -= sizeof(Node16);
-                        break;
-                    }
-                    case NodeType48: {
-                        allocated_byte_count -= sizeof(Node48);
-                        break;
-                    }
-                    case NodeType256: {
-                        allocated_byte_count -= sizeof(Node256);
-                        break;
-                    }
-                }
-            }
+            // length of the compressed path
+            uint8_t prefixLength;
+            // key bytes shared by all keys below this node, skipped on the way down. Keys are at
+            // most 8 bytes, so the whole prefix is always stored and never has to be recovered
+            // from a leaf.
+            uint8_t prefix[KEY_SIZE];
+            // bumped by every in-place modification, see `OptimisticLowerBound`
+            OptLock lock;
+
+            Node(int8_t type) : count(0), type(type), prefixLength(0) {}
         };
 
 
@@ -176,12 +351,6 @@ namespace wahl {
         struct LeafNode {
             uint8_t key[KEY_SIZE];
             uintptr_t value;
-            LeafNode() {
-                allocated_byte_count += sizeof(*this);
-            }
-            ~LeafNode() {
-                allocated_byte_count -= sizeof(*this);
-            }
         };
 
         // Node with up to 4 children
@@ -192,7 +361,6 @@ namespace wahl {
             Node4() : Node(NodeType4) {
                 memset(key, 0, sizeof(key));
                 memset(child, 0, sizeof(child));
-                allocated_byte_count += sizeof(*this);
 //                node4_num++;
             }
         };
@@ -205,7 +373,6 @@ namespace wahl {
             Node16() : Node(NodeType16) {
                 memset(key, 0, sizeof(key));
                 memset(child, 0, sizeof(child));
-                allocated_byte_count += sizeof(*this);
 //                node16_num++;
             }
         };
@@ -220,7 +387,6 @@ namespace wahl {
             Node48() : Node(NodeType48) {
                 memset(childIndex, emptyMarker, sizeof(childIndex));
                 memset(child, 0, sizeof(child));
-                allocated_byte_count += sizeof(*this);
 //                node48_num++;
             }
         };
@@ -231,14 +397,13 @@ namespace wahl {
 
             Node256() : Node(NodeType256) {
                 memset(child, 0, sizeof(child));
-                allocated_byte_count += sizeof(*this);
 //                node256_num++;
             }
         };
 
         inline Node *makeLeaf(uint8_t key[], uintptr_t value) {
             // Create a pseudo-leaf
-            LeafNode *leaf = new LeafNode;
+            LeafNode *leaf = allocNode<LeafNode>();
             memcpy(leaf->key, key, KEY_SIZE);
             leaf->value = value;
             return reinterpret_cast<Node *>((((uintptr_t)leaf) << 1) | 1);
@@ -254,11 +419,65 @@ namespace wahl {
             return reinterpret_cast<LeafNode*>(((uintptr_t)node) >> 1) ;
         }
 
+        // Returns how many bytes of the compressed path of `node` match `key` from `depth` on.
+        static inline unsigned prefixMismatch(const Node *node, const uint8_t key[], unsigned depth) {
+            unsigned i = 0;
+            for (; i < node->prefixLength; i++)
+                if (node->prefix[i] != key[depth + i])
+                    break;
+            return i;
+        }
+
+        static inline void setPrefix(Node *node, const uint8_t prefix[], unsigned length) {
+            memcpy(node->prefix, prefix, length);
+            node->prefixLength = length;
+        }
+
+        // Returns a copy of inner node `n` with the compressed path `prefix`. A reachable node
+        // is never re-prefixed in place: a reader that already validated its parent would apply
+        // the new prefix at the old depth.
+        Node *copyNode(Node *n, const uint8_t prefix[], unsigned length) {
+            Node *copy = nullptr;
+            switch (n->type) {
+                case NodeType4: {
+                    Node4 *node = static_cast<Node4 *>(n), *newNode = allocNode<Node4>();
+                    memcpy(newNode->key, node->key, sizeof(node->key));
+                    memcpy(newNode->child, node->child, sizeof(node->child));
+                    copy = newNode;
+                    break;
+                }
+                case NodeType16: {
+                    Node16 *node = static_cast<Node16 *>(n), *newNode = allocNode<Node16>();
+                    memcpy(newNode->key, node->key, sizeof(node->key));
+                    memcpy(newNode->child, node->child, sizeof(node->child));
+                    copy = newNode;
+                    break;
+                }
+                case NodeType48: {
+                    Node48 *node = static_cast<Node48 *>(n), *newNode = allocNode<Node48>();
+                    memcpy(newNode->childIndex, node->childIndex, sizeof(node->childIndex));
+                    memcpy(newNode->child, node->child, sizeof(node->child));
+                    copy = newNode;
+                    break;
+                }
+                case NodeType256: {
+                    Node256 *node = static_cast<Node256 *>(n), *newNode = allocNode<Node256>();
+                    memcpy(newNode->child, node->child, sizeof(node->child));
+                    copy = newNode;
+                    break;
+                }
+            }
+            copy->count = n->count;
+            setPrefix(copy, prefix, length);
+            return copy;
+        }
+
 
 
         struct IteratorEntry {
             Node *node;
             int pos;
+            uint64_t version;
         };
 
         struct Iterator {
@@ -322,14 +541,23 @@ namespace wahl {
             throw; // Unreachable
         }
 
-        bool iteratorNext(Iterator &iter) const{
+        bool iteratorNext(Iterator &iter) const {
+            bool need_restart = false;
+            return iteratorNext<false>(iter, need_restart);
+        }
+
+        // With `optimistic`, every child read from an inner node is validated against the
+        // version recorded when that node was pushed, and `need_restart` is set on conflict.
+        template<bool optimistic>
+        bool iteratorNext(Iterator &iter, bool &need_restart) const {
             // Skip leaf
             if ((iter.depth) && (isLeaf(iter.stack[iter.depth - 1].node)))
                 iter.depth--;
 
             // Look for next leaf
             while (iter.depth) {
-                Node *node = iter.stack[iter.depth - 1].node;
+                IteratorEntry &entry = iter.stack[iter.depth - 1];
+                Node *node = entry.node;
 
                 // Leaf found
                 if (isLeaf(node)) {
@@ -342,41 +570,52 @@ namespace wahl {
                 switch (node->type) {
                     case NodeType4: {
                         Node4 *n = static_cast<Node4 *>(node);
-                        if (iter.stack[iter.depth - 1].pos < node->count)
-                            next = n->child[iter.stack[iter.depth - 1].pos++];
+                        if (entry.pos < node->count)
+                            next = n->child[entry.pos++];
                         break;
                     }
                     case NodeType16: {
                         Node16 *n = static_cast<Node16 *>(node);
-                        if (iter.stack[iter.depth - 1].pos < node->count)
-                            next = n->child[iter.stack[iter.depth - 1].pos++];
+                        if (entry.pos < node->count)
+                            next = n->child[entry.pos++];
                         break;
                     }
                     case NodeType48: {
                         Node48 *n = static_cast<Node48 *>(node);
-                        unsigned depth = iter.depth - 1;
-                        for (; iter.stack[depth].pos < 256; iter.stack[depth].pos++)
-                            if (n->childIndex[iter.stack[depth].pos] != emptyMarker) {
-                                next = n->child[n->childIndex[iter.stack[depth].pos++]];
+                        for (; entry.pos < 256; entry.pos++) {
+                            uint8_t index = n->childIndex[entry.pos];
+                            if (index != emptyMarker) {
+                                next = n->child[index];
+                                entry.pos++;
                                 break;
                             }
+                        }
                         break;
                     }
                     case NodeType256: {
                         Node256 *n = static_cast<Node256 *>(node);
-                        unsigned depth = iter.depth - 1;
-                        for (; iter.stack[depth].pos < 256; iter.stack[depth].pos++)
-                            if (n->child[iter.stack[depth].pos]) {
-                                next = n->child[iter.stack[depth].pos++];
+                        for (; entry.pos < 256; entry.pos++)
+                            if (n->child[entry.pos]) {
+                                next = n->child[entry.pos++];
                                 break;
                             }
                         break;
                     }
                 }
 
+                if (optimistic) {
+                    node->lock.CheckOrRestart(entry.version, need_restart);
+                    if (need_restart) return false;
+                }
+
                 if (next) {
-                    iter.stack[iter.depth].pos = 0;
-                    iter.stack[iter.depth].node = next;
+                    IteratorEntry &child_entry = iter.stack[iter.depth];
+                    child_entry.pos = 0;
+                    child_entry.node = next;
+                    if (optimistic && !isLeaf(next)) {
+                        child_entry.version = next->lock.ReadLockOrRestart(need_restart);
+                        if (need_restart) return false;
+                    }
                     iter.depth++;
                 } else
                     iter.depth--;
@@ -394,7 +633,7 @@ namespace wahl {
         }
 
         static void getOriginKey(uint32_t &key, uint8_t* reverse_key) {
-            reinterpret_cast<uint32_t *>(&key)[0] = __builtin_bswap64(*(reinterpret_cast<uint32_t*>(reverse_key)));
+            reinterpret_cast<uint32_t *>(&key)[0] = __builtin_bswap32(*(reinterpret_cast<uint32_t*>(reverse_key)));
         }
 
         static void getOriginKey(uint64_t &key, uint8_t* reverse_key) {
@@ -428,15 +667,30 @@ namespace wahl {
         bool bound(Node *n,
                    uint8_t key[],
                    Iterator &iterator) const {
+            bool need_restart = false;
+            return bound<false>(n, key, iterator, need_restart);
+        }
+
+        // Lower bound of `key` below `n`, which sits after the first `depth` key bytes.
+        template<bool optimistic>
+        bool bound(Node *n,
+                   uint8_t key[],
+                   Iterator &iterator,
+                   bool &need_restart,
+                   unsigned depth = 0) const {
             iterator.depth = 0;
 
             if (!n)
                 return false;
 
-            unsigned depth = 0;
+            if (optimistic && !isLeaf(n)) {
+                iterator.stack[0].version = n->lock.ReadLockOrRestart(need_restart);
+                if (need_restart) return false;
+            }
             while (true) {
-                iterator.stack[iterator.depth].node = n;
-                int &pos = iterator.stack[iterator.depth].pos;
+                IteratorEntry &entry = iterator.stack[iterator.depth];
+                entry.node = n;
+                int &pos = entry.pos;
                 iterator.depth++;
 
                 if (isLeaf(n)) {
@@ -452,7 +706,7 @@ namespace wahl {
                             if (leafKey[i] < key[i]) {
                                 // Less
                                 iterator.depth--;
-                                return iteratorNext(iterator);
+                                return boundNext<optimistic>(iterator, need_restart);
                             }
                             // Greater
                             return true;
@@ -462,6 +716,28 @@ namespace wahl {
 
                 }
 
+                if (n->prefixLength) {
+                    // On a mismatch in the compressed path the whole subtree is either less or
+                    // greater than `key`.
+                    unsigned i = prefixMismatch(n, key, depth);
+                    if (i != n->prefixLength) {
+                        const bool less = n->prefix[i] < key[depth + i];
+                        if (optimistic) {
+                            n->lock.CheckOrRestart(entry.version, need_restart);
+                            if (need_restart) return false;
+                        }
+                        if (less) {
+                            // Less
+                            iterator.depth--;
+                        } else {
+                            // Greater, continue with the smallest leaf of the subtree
+                            pos = 0;
+                        }
+                        return boundNext<optimistic>(iterator, need_restart);
+                    }
+                    depth += n->prefixLength;
+                }
+
                 uint8_t keyByte = key[depth];
 
                 Node *next = nullptr;
@@ -510,8 +786,9 @@ namespace wahl {
                     case NodeType48: {
                         Node48 *node = static_cast<Node48 *>(n);
                         pos = keyByte;
-                        if (node->childIndex[keyByte] != emptyMarker) {
-                            next = node->child[node->childIndex[keyByte]];
+                        uint8_t index = node->childIndex[keyByte];
+                        if (index != emptyMarker) {
+                            next = node->child[index];
                             break;
                         }
                         break;
@@ -524,12 +801,333 @@ namespace wahl {
                     }
                 }
 
+                if (optimistic) {
+                    n->lock.CheckOrRestart(entry.version, need_restart);
+                    if (need_restart) return false;
+                }
+
                 if (!next)
-                    return iteratorNext(iterator);
+                    return boundNext<optimistic>(iterator, need_restart);
 
                 pos++;
                 n = next;
                 depth++;
+                if (optimistic && !isLeaf(n)) {
+                    iterator.stack[iterator.depth].version = n->lock.ReadLockOrRestart(need_restart);
+                    if (need_restart) return false;
+                }
+            }
+        }
+
+        // Moves a lower bound lookup that did not end on the search path on to the next leaf.
+        // A writer may meanwhile insert a key in front of that leaf into a node the lookup
+        // already left behind, which the hand-over-hand checks miss: with `optimistic`, every
+        // node passed on the way down and on the way to the leaf is checked again at the end.
+        template<bool optimistic>
+        bool boundNext(Iterator &iterator, bool &need_restart) const {
+            if (!optimistic)
+                return iteratorNext<false>(iterator, need_restart);
+            IteratorEntry path[sizeof(iterator.stack) / sizeof(IteratorEntry)];
+            const uint32_t path_depth = iterator.depth;
+            std::copy(iterator.stack, iterator.stack + path_depth, path);
+            const bool found = iteratorNext<true>(iterator, need_restart);
+            if (!need_restart)
+                checkPath(path, path_depth, need_restart);
+            if (!need_restart)
+                checkPath(iterator.stack, iterator.depth, need_restart);
+            return found;
+        }
+
+        inline void checkPath(const IteratorEntry *entries, uint32_t depth, bool &need_restart) const {
+            for (uint32_t i = 0; i < depth && !need_restart; i++)
+                if (!isLeaf(entries[i].node))
+                    entries[i].node->lock.CheckOrRestart(entries[i].version, need_restart);
+        }
+
+        // Bucket `i` of the radix table covers the keys from `base + (i << shift)` up to the
+        // next bucket. `base` holds the first `prefix_length` key bytes, the part of the root's
+        // compressed path that the table skips, so every key of the tree starts with them.
+        struct RadixEntry {
+            Node *subtree;    // deepest node (or the only leaf) above all keys of the bucket
+            uintptr_t next;   // value of the first key past the bucket, 0 if there is none;
+                              // unset without a subtree
+            uint32_t depth;   // key bytes consumed above `subtree`
+        };
+
+        struct RadixTable {
+            size_t bytes;
+            size_t num_buckets;
+            KeyType base;
+            unsigned prefix_length;
+            unsigned shift;
+            RadixEntry *entries;
+        };
+
+        // The bucket of `key`, or null if `key` does not start with the skipped bytes.
+        static inline const RadixEntry *radixBucket(const RadixTable *table, KeyType key) {
+            if (key < table->base) return nullptr;
+            const KeyType bucket = (key - table->base) >> table->shift;
+            return bucket < table->num_buckets ? table->entries + bucket : nullptr;
+        }
+
+        // The subtree of a bucket holds every key of the bucket that is in the tree, so the
+        // first key not less than `key` is either in it or the first key past the bucket. A
+        // bucket without a subtree holds no key and is looked up in the whole tree.
+        template<bool optimistic>
+        void *radixBound(const RadixEntry &entry, uint8_t key[], Iterator &it, bool &need_restart) const {
+            it.depth = 0;
+            if (entry.subtree == nullptr) {
+                Node *root = optimistic ? __atomic_load_n(&tree_, __ATOMIC_ACQUIRE) : tree_;
+                if (!bound<optimistic>(root, key, it, need_restart)) return nullptr;
+            } else if (!bound<optimistic>(entry.subtree, key, it, need_restart, entry.depth)) {
+                return reinterpret_cast<void *>(entry.next);
+            }
+            if (optimistic) return reinterpret_cast<void *>(__atomic_load_n(&it.value->value, __ATOMIC_ACQUIRE));
+            return reinterpret_cast<void *>(it.value->value);
+        }
+
+        inline void lockRadix() {
+            if (radix_bits_) radix_lock_.WriteLock();
+        }
+
+        inline void unlockRadix() {
+            if (radix_bits_) radix_lock_.WriteUnlock();
+        }
+
+        KeyType leafKey(LeafNode *leaf) const {
+            KeyType key;
+            getOriginKey(key, leaf->key);
+            return key;
+        }
+
+        bool lowerBoundLeaf(KeyType key, LeafNode *&leaf) const {
+            uint8_t reverse_key[KEY_SIZE];
+            swapBytes(key, reverse_key);
+            Iterator it;
+            if (!bound(tree_, reverse_key, it)) return false;
+            leaf = it.value;
+            return true;
+        }
+
+        // The child of inner node `n` with the largest key byte below `limit`, null if none.
+        Node *lastChildBelow(Node *n, unsigned limit) const {
+            switch (n->type) {
+                case NodeType4: {
+                    Node4 *node = static_cast<Node4 *>(n);
+                    for (unsigned i = node->count; i-- > 0;)
+                        if (node->key[i] < limit) return node->child[i];
+                    break;
+                }
+                case NodeType16: {
+                    Node16 *node = static_cast<Node16 *>(n);
+                    for (unsigned i = node->count; i-- > 0;)
+                        if (node->key[i] < limit) return node->child[i];
+                    break;
+                }
+                case NodeType48: {
+                    Node48 *node = static_cast<Node48 *>(n);
+                    for (unsigned b = limit; b-- > 0;)
+                        if (node->childIndex[b] != emptyMarker) return node->child[node->childIndex[b]];
+                    break;
+                }
+                case NodeType256: {
+                    Node256 *node = static_cast<Node256 *>(n);
+                    for (unsigned b = limit; b-- > 0;)
+                        if (node->child[b]) return node->child[b];
+                    break;
+                }
+            }
+            return nullptr;
+        }
+
+        // Finds the last leaf with a key less than `key`: the largest leaf of the last subtree
+        // that branches off below the search path.
+        bool lastLeafBefore(KeyType key, LeafNode *&leaf) {
+            uint8_t reverse_key[KEY_SIZE];
+            swapBytes(key, reverse_key);
+            Node *n = tree_, *less = nullptr;
+            unsigned depth = 0;
+            while (n && !isLeaf(n)) {
+                const unsigned i = prefixMismatch(n, reverse_key, depth);
+                if (i != n->prefixLength) {
+                    if (n->prefix[i] < reverse_key[depth + i]) less = n;
+                    n = nullptr;
+                    break;
+                }
+                depth += n->prefixLength;
+                if (Node *left = lastChildBelow(n, reverse_key[depth])) less = left;
+                n = *findChild(n, reverse_key[depth]);
+                depth++;
+            }
+            if (n && leafKey(getLeafValue(n)) < key) less = n;
+            if (less == nullptr) return false;
+            while (!isLeaf(less)) less = lastChildBelow(less, 256);
+            leaf = getLeafValue(less);
+            return true;
+        }
+
+        // Bytes of the root's compressed path the table skips, as many as leave room for the
+        // bucket bits.
+        unsigned radixPrefixLength() const {
+            if (tree_ == nullptr || isLeaf(tree_)) return 0;
+            return std::min<unsigned>(tree_->prefixLength, KEY_SIZE - (radix_bits_ + 7) / 8);
+        }
+
+        KeyType radixBase(unsigned prefix_length) const {
+            uint8_t bytes[KEY_SIZE] = {};
+            if (prefix_length) memcpy(bytes, tree_->prefix, prefix_length);
+            KeyType base;
+            getOriginKey(base, bytes);
+            return base;
+        }
+
+        static inline KeyType bucketStart(const RadixTable *table, size_t i) {
+            return table->base + (static_cast<KeyType>(i) << table->shift);
+        }
+
+        static inline size_t clampedBucket(const RadixTable *table, KeyType key) {
+            if (key < table->base) return 0;
+            return std::min<size_t>((key - table->base) >> table->shift, table->num_buckets - 1);
+        }
+
+        // Finds the subtree of bucket `i` in the current tree, `findRadixNext` fills in `next`.
+        // The descent stops at the first node whose next key byte is not fully given by the
+        // bucket bits. If the bucket bits end within a byte, that node is shared by an aligned
+        // group of 2^(bits % 8) buckets.
+        RadixEntry findRadixEntry(const RadixTable *table, size_t i) {
+            const KeyType start = bucketStart(table, i);
+            const unsigned bucket_bits = KEY_SIZE * 8 - table->shift;
+            uint8_t key[KEY_SIZE];
+            swapBytes(start, key);
+            RadixEntry entry{nullptr, 0, 0};
+            Node *n = tree_;
+            unsigned depth = 0;
+            while (n) {
+                if (isLeaf(n)) {
+                    // The only key below this slot, which need not be in the bucket.
+                    if (((leafKey(getLeafValue(n)) ^ start) >> table->shift) == 0) entry = {n, 0, depth};
+                    break;
+                }
+                bool mismatch = false;
+                for (unsigned j = 0; j < n->prefixLength && (depth + j) * 8 < bucket_bits && !mismatch; ++j) {
+                    const unsigned bits = std::min(8u, bucket_bits - (depth + j) * 8);
+                    mismatch = ((n->prefix[j] ^ key[depth + j]) >> (8 - bits)) != 0;
+                }
+                if (mismatch) break;
+                if ((depth + n->prefixLength + 1) * 8 > bucket_bits) {
+                    entry = {n, 0, depth};
+                    break;
+                }
+                depth += n->prefixLength;
+                n = *findChild(n, key[depth]);
+                depth++;
+            }
+            return entry;
+        }
+
+        // The first key past bucket `i` is the first key of bucket `i + 1`, whose entry must be
+        // up to date. No key of the tree is past the last bucket.
+        void findRadixNext(const RadixTable *table, size_t i, RadixEntry &entry) const {
+            if (entry.subtree == nullptr || i + 1 == table->num_buckets) return;
+            uint8_t next_key[KEY_SIZE];
+            swapBytes(bucketStart(table, i + 1), next_key);
+            Iterator it;
+            bool need_restart = false;
+            entry.next = reinterpret_cast<uintptr_t>(radixBound<false>(table->entries[i + 1], next_key, it, need_restart));
+        }
+
+        // Builds a table for the current root path and swaps it in.
+        void rebuildRadix() {
+            const unsigned prefix_length = radixPrefixLength();
+            const size_t num_buckets = size_t(1) << radix_bits_;
+            const size_t bytes = sizeof(RadixTable) + num_buckets * sizeof(RadixEntry);
+            auto table = static_cast<RadixTable *>(AllocateBytes(allocator_, bytes, MemoryTag::kDirectory));
+            table->bytes = bytes;
+            table->num_buckets = num_buckets;
+            table->base = radixBase(prefix_length);
+            table->prefix_length = prefix_length;
+            table->shift = (KEY_SIZE - prefix_length) * 8 - radix_bits_;
+            table->entries = reinterpret_cast<RadixEntry *>(table + 1);
+            findRadixEntries(table, 0, num_buckets - 1);
+            inner_node_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+            publishRadix(table);
+        }
+
+        void publishRadix(RadixTable *table) {
+            RadixTable *old = radix_table_;
+            __atomic_store_n(&radix_table_, table, __ATOMIC_RELEASE);
+            if (old == nullptr) return;
+            inner_node_bytes_.fetch_sub(old->bytes, std::memory_order_relaxed);
+            if (epoch_manager_) epoch_manager_->Retire(old, &destroyRadixTable, allocator_);
+            else destroyRadixTable(old, allocator_);
+        }
+
+        static void destroyRadixTable(void *table, void *allocator) {
+            DeallocateBytes(static_cast<SlabAllocator *>(allocator), table, static_cast<RadixTable *>(table)->bytes,
+                            MemoryTag::kDirectory);
+        }
+
+        // Looks up the buckets [first, last] again, back to front so that the entry following
+        // each one is already up to date.
+        void findRadixEntries(RadixTable *table, size_t first, size_t last) {
+            for (size_t i = last + 1; i-- > first;) {
+                RadixEntry entry = findRadixEntry(table, i);
+                findRadixNext(table, i, entry);
+                table->entries[i] = entry;
+            }
+        }
+
+        // Looks up the buckets [first, last] again like `findRadixEntries`. Nodes are copied,
+        // never changed in place, so when the subtree of a bucket changes, the node it shares
+        // with its group may be gone, and the whole group is looked up again before any entry
+        // of it is used.
+        void refreshBuckets(RadixTable *table, size_t first, size_t last) {
+            const size_t group = size_t(1) << (radix_bits_ % 8);
+            for (size_t i = last + 1; i-- > first;) {
+                RadixEntry entry = findRadixEntry(table, i);
+                if (group > 1 && entry.subtree != table->entries[i].subtree) {
+                    const size_t group_first = i & ~(group - 1);
+                    findRadixEntries(table, group_first, std::min(i | (group - 1), table->num_buckets - 1));
+                    i = group_first;
+                    continue;
+                }
+                findRadixNext(table, i, entry);
+                table->entries[i] = entry;
+            }
+        }
+
+        // Brings the table up to date after a write of the keys [lo, hi]. The write may copy
+        // the nodes above these keys, above their predecessor and above their successor, so
+        // the buckets of all of them are looked up again. It also changes the first key past
+        // every bucket from the one of the predecessor up to the one of `lo`, but only those
+        // in the group of either can have a subtree, the others hold no key and keep no `next`.
+        // A new root path needs a new table.
+        void refreshRadix(KeyType lo, KeyType hi) {
+            if (radix_bits_ == 0) return;
+            RadixTable *table = radix_table_;
+            const unsigned prefix_length = radixPrefixLength();
+            if (prefix_length != table->prefix_length || radixBase(prefix_length) != table->base) {
+                rebuildRadix();
+                return;
+            }
+            const size_t group = size_t(1) << (radix_bits_ % 8);
+            const size_t first = clampedBucket(table, lo), last = clampedBucket(table, hi);
+            LeafNode *leaf;
+            // Back to front, so that every bucket is looked up after the one following it.
+            if (hi != std::numeric_limits<KeyType>::max() && lowerBoundLeaf(hi + 1, leaf)) {
+                const size_t next = clampedBucket(table, leafKey(leaf));
+                if (next != last) refreshBuckets(table, next, next);
+            }
+            if (!lastLeafBefore(lo, leaf)) {
+                refreshBuckets(table, first & ~(group - 1), last);
+                return;
+            }
+            const size_t prev = clampedBucket(table, leafKey(leaf));
+            if ((prev | (group - 1)) + 1 >= (first & ~(group - 1))) {
+                refreshBuckets(table, prev, last);
+            } else {
+                refreshBuckets(table, first & ~(group - 1), last);
+                refreshBuckets(table, prev, prev | (group - 1));
             }
         }
 
@@ -544,6 +1142,9 @@ namespace wahl {
                     else return nullptr;
                 }
 
+                if (prefixMismatch(node, key, depth) != node->prefixLength)
+                    return nullptr;
+                depth += node->prefixLength;
                 node = *findChild(node, key[depth]);
                 depth++;
             }
@@ -551,10 +1152,62 @@ namespace wahl {
             return nullptr;
         }
 
-        void insertNode4(Node4 *node, Node **nodeRef, uint8_t keyByte, Node *child) {
+        // Publishes `child` in the slot `nodeRef` of `parent` (or as the root if `parent` is null).
+        inline void setChild(Node *parent, Node **nodeRef, Node *child) {
+            if (parent) parent->lock.WriteLock();
+            __atomic_store_n(nodeRef, child, __ATOMIC_RELEASE);
+            if (parent) parent->lock.WriteUnlock();
+        }
+
+        template<typename T>
+        inline std::atomic<size_t> &byteCount() {
+            return std::is_same<T, LeafNode>::value ? leaf_bytes_ : inner_node_bytes_;
+        }
+
+        template<typename T>
+        inline T *allocNode() {
+            byteCount<T>().fetch_add(sizeof(T), std::memory_order_relaxed);
+            return CreateObject<T>(allocator_, MemoryTag::kDirectory);
+        }
+
+        // Counted as freed once unlinked, even if an epoch delays the actual free.
+        template<typename T>
+        inline void reclaim(T *object) {
+            byteCount<T>().fetch_sub(sizeof(T), std::memory_order_relaxed);
+            if (epoch_manager_) epoch_manager_->Retire(object, &DestroyRetired<T, MemoryTag::kDirectory>, allocator_);
+            else DestroyObject(allocator_, object, MemoryTag::kDirectory);
+        }
+
+        // Frees an inner node that has already been replaced in its parent.
+        template<typename T>
+        inline void retireNode(T *node) {
+            node->lock.WriteLock();
+            node->lock.WriteUnlockObsolete();
+            reclaim(node);
+        }
+
+        void retireNode(Node *node) {
+            switch (node->type) {
+                case NodeType4:
+                    retireNode(static_cast<Node4 *>(node));
+                    break;
+                case NodeType16:
+                    retireNode(static_cast<Node16 *>(node));
+                    break;
+                case NodeType48:
+                    retireNode(static_cast<Node48 *>(node));
+                    break;
+                case NodeType256:
+                    retireNode(static_cast<Node256 *>(node));
+                    break;
+            }
+        }
+
+        void insertNode4(Node4 *node, Node **nodeRef, Node *parent, uint8_t keyByte, Node *child) {
             // Insert leaf into inner node
             if (node->count < 4) {
                 // Insert element
+                node->lock.WriteLock();
                 unsigned pos;
                 for (pos = 0; (pos < node->count) && (node->key[pos] < keyByte); pos++);
                 memmove(node->key + pos + 1, node->key + pos, node->count - pos);
@@ -564,24 +1217,28 @@ namespace wahl {
                 node->key[pos] = keyByte;
                 node->child[pos] = child;
                 node->count++;
+                node->lock.WriteUnlock();
             } else {
                 // Grow to Node16
-                Node16 *newNode = new Node16();
-                *nodeRef = newNode;
+                Node16 *newNode = allocNode<Node16>();
+                setPrefix(newNode, node->prefix, node->prefixLength);
                 newNode->count = node->count;
                 memcpy(newNode->key, node->key, node->count * sizeof(uint8_t));
                 memcpy(newNode->child, node->child, node->count * sizeof(uintptr_t));
-                delete node;
-                return insertNode16(newNode, nodeRef, keyByte, child);
+                insertNode16(newNode, nodeRef, parent, keyByte, child);
+                setChild(parent, nodeRef, newNode);
+                retireNode(node);
             }
         }
 
         void insertNode16(Node16 *node,
                           Node **nodeRef,
+                          Node *parent,
                           uint8_t keyByte,
                           Node *child) {
             // Insert leaf into inner node
             if (node->count < 16) {
+                node->lock.WriteLock();
 
                 // support x86-64 architectures
 #ifdef __x86_64__
@@ -621,127 +1278,273 @@ namespace wahl {
                 node->key[pos] = keyByte;
                 node->child[pos] = child;
                 node->count++;
+                node->lock.WriteUnlock();
             } else {
                 // Grow to Node48
-                Node48 *newNode = new Node48();
-                *nodeRef = newNode;
+                Node48 *newNode = allocNode<Node48>();
+                setPrefix(newNode, node->prefix, node->prefixLength);
                 memcpy(newNode->child, node->child, node->count * sizeof(uintptr_t));
                 for (unsigned i = 0; i < node->count; i++)
                     newNode->childIndex[node->key[i]] = i;
                 newNode->count = node->count;
-                delete node;
-                return insertNode48(newNode, nodeRef, keyByte, child);
+                insertNode48(newNode, nodeRef, parent, keyByte, child);
+                setChild(parent, nodeRef, newNode);
+                retireNode(node);
             }
         }
 
         void insertNode48(Node48 *node,
                           Node **nodeRef,
+                          Node *parent,
                           uint8_t keyByte,
                           Node *child) {
             // Insert leaf into inner node
             if (node->count < 48) {
                 // Insert element
+                node->lock.WriteLock();
                 unsigned pos = node->count;
                 if (node->child[pos])
                     for (pos = 0; node->child[pos] != nullptr; pos++);
                 node->child[pos] = child;
                 node->childIndex[keyByte] = pos;
                 node->count++;
+                node->lock.WriteUnlock();
             } else {
                 // Grow to Node256
-                Node256 *newNode = new Node256();
+                Node256 *newNode = allocNode<Node256>();
+                setPrefix(newNode, node->prefix, node->prefixLength);
                 for (unsigned i = 0; i < 256; i++)
                         if (node->childIndex[i] != emptyMarker)
                         newNode->child[i] = node->child[node->childIndex[i]];
                 newNode->count = node->count;
-                *nodeRef = newNode;
-                delete node;
-                return insertNode256(newNode, nodeRef, keyByte, child);
+                insertNode256(newNode, keyByte, child);
+                setChild(parent, nodeRef, newNode);
+                retireNode(node);
             }
         }
 
         void insertNode256(Node256 *node,
-                           Node **nodeRef,
                            uint8_t keyByte,
                            Node *child) {
             // Insert leaf into inner node
+            node->lock.WriteLock();
             node->count++;
             node->child[keyByte] = child;
+            node->lock.WriteUnlock();
         }
 
+        // Writers are expected to be serialized by the caller; concurrent readers are
+        // supported through the node version locks and `setChild`.
         void insert(Node *node,
                     Node **nodeRef,
+                    Node *parent,
                     uint8_t key[],
                     unsigned depth,
                     uintptr_t value) {
             // Insert the leaf value into the tree
 
             if (node == nullptr) {
-                *nodeRef = makeLeaf(key, value);
+                setChild(parent, nodeRef, makeLeaf(key, value));
                 return;
             }
 
             if (isLeaf(node)) {
                 // Replace leaf with Node4 and store both leaves in it
                 if (leafMatches(node, key, depth)) {
-                    getLeafValue(node)->value = value;
+                    if (epoch_manager_) {
+                        // A reader that validated the tree before the keys in front of this
+                        // one went in must keep seeing the old value in the leaf it reached:
+                        // swap in a new leaf, which also bumps the parent's version.
+                        setChild(parent, nodeRef, makeLeaf(key, value));
+                        reclaim(getLeafValue(node));
+                    } else {
+                        __atomic_store_n(&getLeafValue(node)->value, value, __ATOMIC_RELEASE);
+                    }
                     return;
                 }
 
                 LeafNode* existingLeaf = getLeafValue(node);
                 uint8_t* existingKey = loadKey(existingLeaf);
 
-                Node4 *topNode = new Node4();
-                *nodeRef = topNode;
-
-                for (; depth < KEY_SIZE && existingKey[depth] == key[depth]; ++depth) {
-                    Node4 *midNode = new Node4();
-                    insertNode4(topNode, nodeRef, key[depth], midNode);
-                    topNode = midNode;
-                }
+                // A single Node4 takes both leaves, the bytes they share become its prefix.
+                // It is built aside and published with a single store.
+                unsigned mismatch = depth;
+                while (existingKey[mismatch] == key[mismatch])
+                    mismatch++;
+                Node4 *newNode = allocNode<Node4>();
+                setPrefix(newNode, key + depth, mismatch - depth);
+                insertNode4(newNode, nodeRef, parent, existingKey[mismatch], node);
+                insertNode4(newNode,
+                            nodeRef,
+                            parent,
+                            key[mismatch],
+                            makeLeaf(key, value));
+                setChild(parent, nodeRef, newNode);
 
-                insertNode4(topNode, nodeRef, existingKey[depth], node);
-                insertNode4(topNode,
-                                nodeRef,
-                                key[depth],
-                                makeLeaf(key, value));
+                return;
+            }
 
+            unsigned mismatch = prefixMismatch(node, key, depth);
+            if (mismatch != node->prefixLength) {
+                // Split the compressed path: a new Node4 keeps the matching part, the node moves
+                // below it with the rest.
+                Node4 *newNode = allocNode<Node4>();
+                setPrefix(newNode, node->prefix, mismatch);
+                Node *lowerNode = copyNode(node, node->prefix + mismatch + 1, node->prefixLength - mismatch - 1);
+                insertNode4(newNode, nodeRef, parent, node->prefix[mismatch], lowerNode);
+                insertNode4(newNode,
+                            nodeRef,
+                            parent,
+                            key[depth + mismatch],
+                            makeLeaf(key, value));
+                setChild(parent, nodeRef, newNode);
+                retireNode(node);
                 return;
             }
+            depth += node->prefixLength;
 
             // Recurse
             Node **child = findChild(node, key[depth]);
             if (*child) {
-                insert(*child, child, key, depth + 1, value);
+                insert(*child, child, node, key, depth + 1, value);
                 return;
             }
 
             // Insert leaf into inner node
-            Node *newNode = reinterpret_cast<Node *>(makeLeaf(key, value));
+            insertChild(node, nodeRef, parent, key[depth], makeLeaf(key, value));
+        }
+
+        void insertChild(Node *node, Node **nodeRef, Node *parent, uint8_t keyByte, Node *child) {
             switch (node->type) {
                 case NodeType4:
-                    insertNode4(static_cast<Node4 *>(node),
-                                nodeRef,
-                                key[depth],
-                                newNode);
+                    insertNode4(static_cast<Node4 *>(node), nodeRef, parent, keyByte, child);
                     break;
                 case NodeType16:
-                    insertNode16(static_cast<Node16 *>(node),
-                                 nodeRef,
-                                 key[depth],
-                                 newNode);
+                    insertNode16(static_cast<Node16 *>(node), nodeRef, parent, keyByte, child);
                     break;
                 case NodeType48:
-                    insertNode48(static_cast<Node48 *>(node),
-                                 nodeRef,
-                                 key[depth],
-                                 newNode);
+                    insertNode48(static_cast<Node48 *>(node), nodeRef, parent, keyByte, child);
                     break;
                 case NodeType256:
-                    insertNode256(static_cast<Node256 *>(node),
-                                  nodeRef,
-                                  key[depth],
-                                  newNode);
+                    insertNode256(static_cast<Node256 *>(node), keyByte, child);
+                    break;
+            }
+        }
+
+        static inline const uint8_t *keyBytes(const KeyType *reverse_keys, size_t i) {
+            return reinterpret_cast<const uint8_t *>(reverse_keys + i);
+        }
+
+        // Builds the subtree of the byte-swapped keys `[begin, end)`, which agree on their first
+        // `depth` bytes. The bytes shared by the whole range become the node's compressed path,
+        // and the number of distinct bytes after it picks the node type, so no node ever grows.
+        Node *buildSubtree(const KeyType *reverse_keys, const uintptr_t *values,
+                           size_t begin, size_t end, unsigned depth) {
+            const uint8_t *first = keyBytes(reverse_keys, begin), *last = keyBytes(reverse_keys, end - 1);
+            unsigned mismatch = depth;
+            while (mismatch < KEY_SIZE && first[mismatch] == last[mismatch])
+                mismatch++;
+            if (mismatch == KEY_SIZE)
+                return makeLeaf(const_cast<uint8_t *>(last), values[end - 1]);
+
+            unsigned count = 1;
+            for (size_t i = begin + 1; i < end; ++i)
+                count += keyBytes(reverse_keys, i)[mismatch] != keyBytes(reverse_keys, i - 1)[mismatch];
+
+            Node *node;
+            if (count <= 4) node = allocNode<Node4>();
+            else if (count <= 16) node = allocNode<Node16>();
+            else if (count <= 48) node = allocNode<Node48>();
+            else node = allocNode<Node256>();
+            setPrefix(node, first + depth, mismatch - depth);
+            node->count = count;
+
+            unsigned pos = 0;
+            for (size_t i = begin; i < end; ++pos) {
+                uint8_t keyByte = keyBytes(reverse_keys, i)[mismatch];
+                size_t j = i + 1;
+                while (j < end && keyBytes(reverse_keys, j)[mismatch] == keyByte) j++;
+                Node *child = buildSubtree(reverse_keys, values, i, j, mismatch + 1);
+                switch (node->type) {
+                    case NodeType4:
+                        static_cast<Node4 *>(node)->key[pos] = keyByte;
+                        static_cast<Node4 *>(node)->child[pos] = child;
+                        break;
+                    case NodeType16:
+                        static_cast<Node16 *>(node)->key[pos] = keyByte;
+                        static_cast<Node16 *>(node)->child[pos] = child;
+                        break;
+                    case NodeType48:
+                        static_cast<Node48 *>(node)->childIndex[keyByte] = pos;
+                        static_cast<Node48 *>(node)->child[pos] = child;
+                        break;
+                    case NodeType256:
+                        static_cast<Node256 *>(node)->child[keyByte] = child;
+                        break;
+                }
+                i = j;
+            }
+            return node;
+        }
+
+        // Inserts the byte-swapped keys `[begin, end)`, which agree on their first `depth` bytes,
+        // below the slot `nodeRef` of `parent`. Empty slots receive a subtree from `buildSubtree`.
+        void bulkInsert(Node **nodeRef, Node *parent, const KeyType *reverse_keys, const uintptr_t *values,
+                        size_t begin, size_t end, unsigned depth) {
+            Node *node = *nodeRef;
+            if (node == nullptr) {
+                setChild(parent, nodeRef, buildSubtree(reverse_keys, values, begin, end, depth));
+                return;
+            }
+            const uint8_t *first = keyBytes(reverse_keys, begin), *last = keyBytes(reverse_keys, end - 1);
+            if (isLeaf(node) || prefixMismatch(node, first, depth) != node->prefixLength ||
+                prefixMismatch(node, last, depth) != node->prefixLength) {
+                // A leaf or a path split: rare enough for one key at a time.
+                for (size_t i = begin; i < end; ++i) {
+                    uint8_t key[KEY_SIZE];
+                    memcpy(key, keyBytes(reverse_keys, i), KEY_SIZE);
+                    insert(*nodeRef, nodeRef, parent, key, depth, values[i]);
+                }
+                return;
+            }
+            depth += node->prefixLength;
+            for (size_t i = begin; i < end; ) {
+                uint8_t keyByte = keyBytes(reverse_keys, i)[depth];
+                size_t j = i + 1;
+                while (j < end && keyBytes(reverse_keys, j)[depth] == keyByte) j++;
+                // Growing a full node replaces it in its slot.
+                node = *nodeRef;
+                Node **child = findChild(node, keyByte);
+                if (*child) bulkInsert(child, node, reverse_keys, values, i, j, depth + 1);
+                else insertChild(node, nodeRef, parent, keyByte, buildSubtree(reverse_keys, values, i, j, depth + 1));
+                i = j;
+            }
+        }
+
+        // Adds the inner nodes below `node` to `counts` by type, and the leaves to `counts[4]`.
+        void countNodes(Node *node, uint64_t counts[5]) {
+            if (node == nullptr) return;
+            if (isLeaf(node)) {
+                counts[4]++;
+                return;
+            }
+            counts[node->type]++;
+            switch (node->type) {
+                case NodeType4:
+                    for (unsigned i = 0; i < node->count; i++)
+                        countNodes(static_cast<Node4 *>(node)->child[i], counts);
+                    break;
+                case NodeType16:
+                    for (unsigned i = 0; i < node->count; i++)
+                        countNodes(static_cast<Node16 *>(node)->child[i], counts);
+                    break;
+                case NodeType48:
+                    for (unsigned i = 0; i < 48; i++)
+                        countNodes(static_cast<Node48 *>(node)->child[i], counts);
+                    break;
+                case NodeType256:
+                    for (unsigned i = 0; i < 256; i++)
+                        countNodes(static_cast<Node256 *>(node)->child[i], counts);
                     break;
             }
         }
@@ -761,8 +1564,9 @@ namespace wahl {
             if (isLeaf(tree_)) {
                 // Make sure we have the right leaf
                 if (leafMatches(tree_, key, 0)) {
-                    delete getLeafValue(tree_);
-                    tree_ = nullptr;
+                    LeafNode *leaf = getLeafValue(tree_);
+                    setChild(nullptr, &tree_, nullptr);
+                    reclaim(leaf);
                 }
                 return;
             }
@@ -774,11 +1578,16 @@ namespace wahl {
             Node *node = tree_, **nodeRef = &tree_;
 
             while (node) {
+                if (prefixMismatch(node, key, depth) != node->prefixLength)
+                    return;
+                depth += node->prefixLength;
                 stack[sp] = {node, nodeRef};
+                Node *parent = sp ? stack[sp - 1].node : nullptr;
                 Node **child = findChild(node, key[depth]);
-                if (isLeaf(*child)
-                    && leafMatches(*child, key, depth)) {
-                    delete getLeafValue(*child);
+                if (isLeaf(*child)) {
+                    if (!leafMatches(*child, key, depth))
+                        return;
+                    LeafNode *leaf = getLeafValue(*child);
                     // Leaf found, delete it in inner node
                     switch (node->type) {
                         case NodeType4:
@@ -787,19 +1596,23 @@ namespace wahl {
                         case NodeType16:
                             eraseNode16(static_cast<Node16 *>(node),
                                         nodeRef,
+                                        parent,
                                         child);
                             break;
                         case NodeType48:
                             eraseNode48(static_cast<Node48 *>(node),
                                         nodeRef,
+                                        parent,
                                         key[depth]);
                             break;
                         case NodeType256:
                             eraseNode256(static_cast<Node256 *>(node),
                                          nodeRef,
+                                         parent,
                                          key[depth]);
                             break;
                     }
+                    reclaim(leaf);
                     break;
                 } else {
                     //Recurse
@@ -815,92 +1628,111 @@ namespace wahl {
         void eraseNode4(Context *stack, unsigned sp, Node **leafPlace) {
             Node4 *node = reinterpret_cast<Node4*>(stack[sp].node);
             Node **nodeRef = stack[sp].nodeRef;
-            // Delete leaf from inner node
             unsigned pos = leafPlace - node->child;
+            if (node->count == 2) {
+                // Get rid of the one-way node: the remaining child moves up and takes over the
+                // node's prefix and key byte in its own compressed path. Leaves can sit at any
+                // depth.
+                Node *parent = sp ? stack[sp - 1].node : nullptr;
+                Node *child = node->child[1 - pos];
+                if (isLeaf(child)) {
+                    setChild(parent, nodeRef, child);
+                } else {
+                    uint8_t prefix[KEY_SIZE];
+                    unsigned length = node->prefixLength;
+                    memcpy(prefix, node->prefix, length);
+                    prefix[length++] = node->key[1 - pos];
+                    memcpy(prefix + length, child->prefix, child->prefixLength);
+                    length += child->prefixLength;
+                    setChild(parent, nodeRef, copyNode(child, prefix, length));
+                    retireNode(child);
+                }
+                retireNode(node);
+                return;
+            }
+            // Delete leaf from inner node
+            node->lock.WriteLock();
             memmove(node->key + pos, node->key + pos + 1, node->count - pos - 1);
             memmove(node->child + pos,
                     node->child + pos + 1,
                     (node->count - pos - 1) * sizeof(uintptr_t));
             node->count--;
+            node->lock.WriteUnlock();
+
+        }
 
-//            if (node->count == 1) {
-//                // Get rid of one-way node
-//                Node *child = node->child[0];
-//                if (isLeaf(child)) {
-//                    while (node->count == 1) {
-//                        delete node;
-//                        if (sp == 0)
-//                            break;
-//                        sp -= 1;
-//                        node = reinterpret_cast<Node4*>(stack[sp].node);
-//                        nodeRef = stack[sp].nodeRef;
-//                    }
-//                    *nodeRef = child;
-//                }
-//            }
-
-        }
-
-        void eraseNode16(Node16 *node, Node **nodeRef, Node **leafPlace) {
+        void eraseNode16(Node16 *node, Node **nodeRef, Node *parent, Node **leafPlace) {
             // Delete leaf from inner node
+            if (node->count == 4) {
+                // Shrink to Node4
+                Node4 *newNode = allocNode<Node4>();
+                setPrefix(newNode, node->prefix, node->prefixLength);
+                unsigned pos = leafPlace - node->child;
+                for (unsigned i = 0; i < node->count; i++) {
+                    if (i == pos) continue;
+                    newNode->key[newNode->count] = node->key[i];
+                    newNode->child[newNode->count] = node->child[i];
+                    newNode->count++;
+                }
+                setChild(parent, nodeRef, newNode);
+                retireNode(node);
+                return;
+            }
+            node->lock.WriteLock();
             unsigned pos = leafPlace - node->child;
             memmove(node->key + pos, node->key + pos + 1, node->count - pos - 1);
             memmove(node->child + pos,
                     node->child + pos + 1,
                     (node->count - pos - 1) * sizeof(uintptr_t));
             node->count--;
-
-            if (node->count == 3) {
-                // Shrink to Node4
-                Node4 *newNode = new Node4();
-                newNode->count = node->count;
-                for (unsigned i = 0; i < node->count; i++)
-                    newNode->key[i] = node->key[i];
-                memcpy(newNode->child, node->child, sizeof(uintptr_t) * node->count);
-                *nodeRef = newNode;
-                delete node;
-            }
+            node->lock.WriteUnlock();
         }
 
-        void eraseNode48(Node48 *node, Node **nodeRef, uint8_t keyByte) {
+        void eraseNode48(Node48 *node, Node **nodeRef, Node *parent, uint8_t keyByte) {
             // Delete leaf from inner node
-            node->child[node->childIndex[keyByte]] = nullptr;
-            node->childIndex[keyByte] = emptyMarker;
-            node->count--;
-
-            if (node->count == 12) {
+            if (node->count == 13) {
                 // Shrink to Node16
-                Node16 *newNode = new Node16();
-                *nodeRef = newNode;
+                Node16 *newNode = allocNode<Node16>();
+                setPrefix(newNode, node->prefix, node->prefixLength);
                 for (unsigned b = 0; b < 256; b++) {
-                    if (node->childIndex[b] != emptyMarker) {
+                    if (node->childIndex[b] != emptyMarker && b != keyByte) {
                         newNode->key[newNode->count] = b;
                         newNode->child[newNode->count] = node->child[node->childIndex[b]];
                         newNode->count++;
                     }
                 }
-                delete node;
+                setChild(parent, nodeRef, newNode);
+                retireNode(node);
+                return;
             }
+            node->lock.WriteLock();
+            node->child[node->childIndex[keyByte]] = nullptr;
+            node->childIndex[keyByte] = emptyMarker;
+            node->count--;
+            node->lock.WriteUnlock();
         }
 
-        void eraseNode256(Node256 *node, Node **nodeRef, uint8_t keyByte) {
+        void eraseNode256(Node256 *node, Node **nodeRef, Node *parent, uint8_t keyByte) {
             // Delete leaf from inner node
-            node->child[keyByte] = nullptr;
-            node->count--;
-
-            if (node->count == 37) {
+            if (node->count == 38) {
                 // Shrink to Node48
-                Node48 *newNode = new Node48();
-                *nodeRef = newNode;
+                Node48 *newNode = allocNode<Node48>();
+                setPrefix(newNode, node->prefix, node->prefixLength);
                 for (unsigned b = 0; b < 256; b++) {
-                    if (node->child[b]) {
+                    if (node->child[b] && b != keyByte) {
                         newNode->childIndex[b] = newNode->count;
                         newNode->child[newNode->count] = node->child[b];
                         newNode->count++;
                     }
                 }
-                delete node;
+                setChild(parent, nodeRef, newNode);
+                retireNode(node);
+                return;
             }
+            node->lock.WriteLock();
+            node->child[keyByte] = nullptr;
+            node->count--;
+            node->lock.WriteUnlock();
         }
 
         void destructTree(Node *node) {
@@ -956,8 +1788,21 @@ namespace wahl {
         }
 
         Node *tree_ = nullptr;
+
+        EpochManager *epoch_manager_ = nullptr;
+
+        SlabAllocator *allocator_ = nullptr;
+
+        // See `set_radix_bits`. Readers of the table validate against `radix_lock_`.
+        RadixTable *radix_table_ = nullptr;
+        unsigned radix_bits_ = 0;
+        OptLock radix_lock_;
+
+        // Written only by the (serialized) writers, read by `size()` from any thread.
+        std::atomic<size_t> inner_node_bytes_{0};
+        std::atomic<size_t> leaf_bytes_{0};
     };
 
 }
 
-#endif //ART_TREE_H
\ No newline at end of file
+#endif //ART_TREE_H
\ No newline at end of file
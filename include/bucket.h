@@ -9,7 +9,14 @@
 #include <forward_list>
 #include <map>
 #include <algorithm>
+#include <cstring>
+#include <type_traits>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "stx/btree_multimap.h"
+#include "allocator.h"
+#include "stats.h"
 
 namespace wahl {
 
@@ -26,11 +33,14 @@ namespace wahl {
             typedef ListNode *data_iterator;
         public:
 
+            explicit MFList(SlabAllocator *allocator = nullptr, MemoryTag tag = MemoryTag::kBuffer)
+                    : allocator_(allocator), tag_(tag) {}
+
             ~MFList() {
                 ListNode *cur = dummy_.next, *next = nullptr;
                 while (cur) {
                     next = cur->next;
-                    delete cur;
+                    DestroyObject(allocator_, cur, tag_);
                     cur = next;
                 }
             }
@@ -77,7 +87,7 @@ namespace wahl {
 
             inline void Insert(KeyType key, ValueType value) {
                 window_sz_ += 1;
-                tail_->next = new ListNode{key, value, nullptr};
+                tail_->next = CreateObject<ListNode>(allocator_, tag_, key, value, tail_->next);
                 tail_ = tail_->next;
             }
 
@@ -87,19 +97,25 @@ namespace wahl {
                     tail_->next->key = key;
                     tail_->next->value = value;
                 } else {
-                    tail_->next = new ListNode{key, value, nullptr};
+                    tail_->next = CreateObject<ListNode>(allocator_, tag_, key, value, nullptr);
                 }
                 tail_ = tail_->next;
             }
 
-            inline bool Find(KeyType key, ValueType &value) {
+            // `move_front` must be false when readers run concurrently with each other.
+            inline bool Find(KeyType key, ValueType &value, bool move_front = true) {
                 int dis = 0;
-                for (ListNode *cur = dummy_.next, *pre = &dummy_; cur != tail_->next; pre = cur, cur = cur->next) {
+                const ListNode *end = tail_->next;
+                CountStat(StatCounter::kListFinds);
+                for (ListNode *cur = dummy_.next, *pre = &dummy_; cur != end && cur != nullptr; pre = cur, cur = cur->next) {
                     if (cur->key == key) {
+                        CountStat(StatCounter::kListProbes, dis + 1);
                         value = cur->value;
+                        if (!move_front) return true;
                         window_sz_ = alpha * window_sz_ + (1 - alpha) * dis;
                         if (dis > window_sz_) {
                             // return after do this, so has no problem.
+                            CountStat(StatCounter::kListMoveFronts);
                             MoveFrontAfter(pre);
                         }
 //                        std::cout << dis << " -- " <<  window_sz_ << std::endl;
@@ -107,6 +123,7 @@ namespace wahl {
                     }
                     ++dis;
                 }
+                CountStat(StatCounter::kListProbes, dis);
                 return false;
             }
 
@@ -115,6 +132,28 @@ namespace wahl {
                 tail_ = &dummy_;
             }
 
+            inline bool Update(KeyType key, ValueType value) {
+                for (ListNode *cur = dummy_.next; cur != tail_->next; cur = cur->next) {
+                    if (cur->key == key) {
+                        cur->value = value;
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // The erased node is parked behind `tail_` for reuse rather than freed, so that a
+            // concurrent reader standing on it never follows a dangling pointer.
+            inline bool Erase(KeyType key) {
+                for (auto pre_it = before_begin(), it = begin(); it != end(); pre_it = it, ++it) {
+                    if ((*it).key == key) {
+                        EraseAfter(pre_it);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
             inline void EraseAfter(iterator &pre_it) {
                 // erase
                 ListNode *target = (*pre_it).next;
@@ -139,6 +178,7 @@ namespace wahl {
             inline void MoveFrontAfter(ListNode *pre) {
                 // erase
                 ListNode *target = pre->next;
+                if (target == tail_) tail_ = pre;
                 pre->next = target->next;
                 // move to front
                 ListNode *next_node = dummy_.next;
@@ -150,13 +190,23 @@ namespace wahl {
             ListNode dummy_;
             ListNode *tail_ = &dummy_;
             size_t window_sz_ = 0;
+            SlabAllocator *allocator_;
+            MemoryTag tag_;
         };
 
         template<typename KeyType, typename ValueType>
         class OverflowBuffer {
             typedef std::pair<KeyType, ValueType> Entry;
+            typedef stx::btree_multimap<KeyType,
+                    ValueType,
+                    std::less<KeyType>,
+                    stx::btree_default_map_traits<KeyType, ValueType>,
+                    SlabStlAllocator<Entry>> OrderedBuffer;
         public:
 
+            explicit OverflowBuffer(SlabAllocator *allocator = nullptr, MemoryTag tag = MemoryTag::kBuffer)
+                    : unordered_buffer_(allocator, tag), ordered_buffer_(SlabStlAllocator<Entry>(allocator, tag)) {}
+
             inline void Insert(KeyType key, ValueType value) {
                 unordered_buffer_.Insert(key, value);
             }
@@ -165,7 +215,8 @@ namespace wahl {
                 unordered_buffer_.ReuseInsert(key, value);
             }
 
-            inline bool Find(KeyType key, ValueType &value) {
+            inline bool Find(KeyType key, ValueType &value, bool move_front = true) {
+                CountStat(StatCounter::kBufferFinds);
                 if (!ordered_buffer_.empty()) {
                     auto it = ordered_buffer_.find(key);
                     if (it != ordered_buffer_.end()) {
@@ -173,10 +224,10 @@ namespace wahl {
                         return true;
                     }
                 }
-                return unordered_buffer_.Find(key, value);
+                return unordered_buffer_.Find(key, value, move_front);
             }
 
-            inline void Range(KeyType start_key, KeyType end_key, std::vector<Entry> &kvs, uint32_t &sorted_keys_num_) {
+            inline void Range(KeyType start_key, KeyType end_key, std::vector<Entry> &kvs) {
                 auto pre_it = unordered_buffer_.before_begin();
                 KeyType key;
                 ValueType value;
@@ -190,7 +241,6 @@ namespace wahl {
 //                        ordered_buffer_.insert(key, value);
                         ++it;
 //                        unordered_buffer_.EraseAfter(pre_it);
-//                        sorted_keys_num_ += 1;
                     } else {
                         pre_it = it;
                         ++it;
@@ -204,12 +254,42 @@ namespace wahl {
 //                }
             }
 
+            inline bool Update(KeyType key, ValueType value) {
+                if (!ordered_buffer_.empty()) {
+                    auto it = ordered_buffer_.find(key);
+                    if (it != ordered_buffer_.end()) {
+                        it.data() = value;
+                        return true;
+                    }
+                }
+                return unordered_buffer_.Update(key, value);
+            }
+
+            inline bool Erase(KeyType key) {
+                if (!ordered_buffer_.empty() && ordered_buffer_.erase_one(key)) return true;
+                return unordered_buffer_.Erase(key);
+            }
+
+            // Appends all entries in key order. Leaves the buffer untouched so that it can still
+            // serve readers while a rebuild drains it.
             inline void ToSortedData(std::vector<KeyType> &keys, std::vector<ValueType> &values) {
+                std::vector<Entry> unordered;
                 for (auto it = unordered_buffer_.begin(); it != unordered_buffer_.end(); ++it) {
-                    ordered_buffer_.insert((*it).key, (*it).value);
+                    unordered.emplace_back((*it).key, (*it).value);
                 }
-
-                for (auto it = ordered_buffer_.begin(); it != ordered_buffer_.end(); ++it) {
+                std::stable_sort(unordered.begin(), unordered.end(),
+                                 [](const Entry &a, const Entry &b) { return a.first < b.first; });
+
+                auto it = ordered_buffer_.begin();
+                for (const Entry &e : unordered) {
+                    for (; it != ordered_buffer_.end() && !(e.first < it->first); ++it) {
+                        keys.push_back(it->first);
+                        values.push_back(it->second);
+                    }
+                    keys.push_back(e.first);
+                    values.push_back(e.second);
+                }
+                for (; it != ordered_buffer_.end(); ++it) {
                     keys.push_back(it->first);
                     values.push_back(it->second);
                 }
@@ -230,10 +310,174 @@ namespace wahl {
 
         private:
             MFList<KeyType, ValueType> unordered_buffer_;
-            stx::btree_multimap<KeyType,
+            OrderedBuffer ordered_buffer_;
+        };
+
+
+        // Alternative to `OverflowBuffer` for the slots of a segment, see `Segment`. Keeps up to
+        // one cache line of keys sorted in place and searches them with SIMD compares, so a slot
+        // costs one allocation instead of one list node per key. A slot that outgrows the line
+        // moves all of its entries to a B+ tree. Entries are shifted in place, so readers must
+        // not run concurrently with writers.
+        template<typename KeyType, typename ValueType>
+        class SortedArrayBuffer {
+            typedef std::pair<KeyType, ValueType> Entry;
+            typedef stx::btree_multimap<KeyType,
                     ValueType,
                     std::less<KeyType>,
-                    stx::btree_default_map_traits<KeyType, ValueType>> ordered_buffer_;
+                    stx::btree_default_map_traits<KeyType, ValueType>,
+                    SlabStlAllocator<Entry>> SpillTree;
+            static constexpr uint32_t kCapacity = sizeof(KeyType) < 64 ? 64 / sizeof(KeyType) : 1;
+        public:
+
+            explicit SortedArrayBuffer(SlabAllocator *allocator = nullptr): allocator_(allocator) {}
+            SortedArrayBuffer(const SortedArrayBuffer &) = delete;
+            SortedArrayBuffer &operator=(const SortedArrayBuffer &) = delete;
+
+            ~SortedArrayBuffer() {
+                DestroyObject(allocator_, spill_, MemoryTag::kBuffer);
+            }
+
+            inline void Insert(KeyType key, ValueType value) {
+                if (__glibc_unlikely(spill_ == nullptr && size_ == kCapacity)) Spill();
+                if (__glibc_unlikely(spill_ != nullptr)) {
+                    spill_->insert(key, value);
+                    return;
+                }
+                // Equal keys stay in insertion order, as in `MFList`.
+                uint32_t pos = std::upper_bound(keys_, keys_ + size_, key) - keys_;
+                std::copy_backward(keys_ + pos, keys_ + size_, keys_ + size_ + 1);
+                std::copy_backward(values_ + pos, values_ + size_, values_ + size_ + 1);
+                keys_[pos] = key;
+                values_[pos] = value;
+                size_ += 1;
+            }
+
+            inline void ReuseInsert(KeyType key, ValueType value) {
+                Insert(key, value);
+            }
+
+            // `move_front` is accepted for interface compatibility with `OverflowBuffer`.
+            inline bool Find(KeyType key, ValueType &value, bool move_front = true) {
+                CountStat(StatCounter::kBufferFinds);
+                if (__glibc_unlikely(spill_ != nullptr)) {
+                    auto it = spill_->find(key);
+                    if (it == spill_->end()) return false;
+                    value = it->second;
+                    return true;
+                }
+                int pos = IndexOf(key);
+                if (pos < 0) return false;
+                value = values_[pos];
+                return true;
+            }
+
+            inline void Range(KeyType start_key, KeyType end_key, std::vector<Entry> &kvs) {
+                if (__glibc_unlikely(spill_ != nullptr)) {
+                    for (auto it = spill_->lower_bound(start_key); it != spill_->end() && it->first < end_key; ++it) {
+                        kvs.emplace_back(it->first, it->second);
+                    }
+                    return;
+                }
+                for (uint32_t i = std::lower_bound(keys_, keys_ + size_, start_key) - keys_;
+                     i < size_ && keys_[i] < end_key; ++i) {
+                    kvs.emplace_back(keys_[i], values_[i]);
+                }
+            }
+
+            inline bool Update(KeyType key, ValueType value) {
+                if (__glibc_unlikely(spill_ != nullptr)) {
+                    auto it = spill_->find(key);
+                    if (it == spill_->end()) return false;
+                    it.data() = value;
+                    return true;
+                }
+                int pos = IndexOf(key);
+                if (pos < 0) return false;
+                values_[pos] = value;
+                return true;
+            }
+
+            inline bool Erase(KeyType key) {
+                if (__glibc_unlikely(spill_ != nullptr)) return spill_->erase_one(key);
+                int pos = IndexOf(key);
+                if (pos < 0) return false;
+                std::copy(keys_ + pos + 1, keys_ + size_, keys_ + pos);
+                std::copy(values_ + pos + 1, values_ + size_, values_ + pos);
+                size_ -= 1;
+                return true;
+            }
+
+            // Appends all entries in key order.
+            inline void ToSortedData(std::vector<KeyType> &keys, std::vector<ValueType> &values) {
+                if (__glibc_unlikely(spill_ != nullptr)) {
+                    for (auto it = spill_->begin(); it != spill_->end(); ++it) {
+                        keys.push_back(it->first);
+                        values.push_back(it->second);
+                    }
+                    return;
+                }
+                keys.insert(keys.end(), keys_, keys_ + size_);
+                values.insert(values.end(), values_, values_ + size_);
+            }
+
+            inline bool Empty() {
+                return spill_ ? spill_->empty() : size_ == 0;
+            }
+
+            inline void Clear() {
+                DestroyObject(allocator_, spill_, MemoryTag::kBuffer);
+                spill_ = nullptr;
+                size_ = 0;
+            }
+
+        private:
+
+            // Returns the position of the first entry with `key`, or -1.
+            inline int IndexOf(KeyType key) const {
+#ifdef __AVX2__
+                if constexpr (std::is_integral<KeyType>::value && sizeof(KeyType) == 8) {
+                    const __m256i needle = _mm256_set1_epi64x(static_cast<long long>(key));
+                    uint32_t mask = 0;
+                    for (uint32_t i = 0; i < kCapacity; i += 4) {
+                        __m256i block = _mm256_load_si256(reinterpret_cast<const __m256i *>(keys_ + i));
+                        __m256i eq = _mm256_cmpeq_epi64(block, needle);
+                        mask |= static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(eq))) << i;
+                    }
+                    // Slots past `size_` hold stale keys.
+                    mask &= (1u << size_) - 1;
+                    return mask ? __builtin_ctz(mask) : -1;
+                } else if constexpr (std::is_integral<KeyType>::value && sizeof(KeyType) == 4) {
+                    const __m256i needle = _mm256_set1_epi32(static_cast<int>(key));
+                    uint32_t mask = 0;
+                    for (uint32_t i = 0; i < kCapacity; i += 8) {
+                        __m256i block = _mm256_load_si256(reinterpret_cast<const __m256i *>(keys_ + i));
+                        __m256i eq = _mm256_cmpeq_epi32(block, needle);
+                        mask |= static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(eq))) << i;
+                    }
+                    mask &= (1u << size_) - 1;
+                    return mask ? __builtin_ctz(mask) : -1;
+                }
+#endif
+                for (uint32_t i = 0; i < size_; ++i) {
+                    if (keys_[i] == key) return i;
+                }
+                return -1;
+            }
+
+            inline void Spill() {
+                spill_ = CreateObject<SpillTree>(allocator_, MemoryTag::kBuffer, SlabStlAllocator<Entry>(allocator_));
+                for (uint32_t i = 0; i < size_; ++i) {
+                    spill_->insert(keys_[i], values_[i]);
+                }
+                size_ = 0;
+            }
+
+            alignas(64) KeyType keys_[kCapacity] = {};
+            ValueType values_[kCapacity];
+            SpillTree *spill_ = nullptr;
+            SlabAllocator *allocator_;
+            uint32_t size_ = 0;
         };
 
     }
@@ -25,7 +25,14 @@ namespace wahl {
                   curr_num_distinct_keys_(0),
                   prev_key_(min_key),
                   prev_position_(0),
-                  start_(true) {
+                  start_(true),
+                  bounded_(true) {
+        }
+
+        // For keys streamed in, whose range is only known once the last one was added.
+        explicit Builder(size_t max_error)
+                : Builder(std::numeric_limits<KeyType>::min(), std::numeric_limits<KeyType>::max(), max_error) {
+            bounded_ = false;
         }
 
         // Adds a key. Assumes that keys are stored in a dense array.
@@ -41,7 +48,7 @@ namespace wahl {
         // Finalizes the construction.
         void Finalize() {
             // Last key needs to be equal to `max_key_`.
-            assert(curr_num_keys_ == 0 || prev_key_ == max_key_);
+            assert(curr_num_keys_ == 0 || !bounded_ || prev_key_ == max_key_);
 
             // Ensure that `prev_key_` (== `max_key_`) is last key on spline.
             if (curr_num_keys_ > 0 && (segments_message_.empty() || segments_message_.back().key != prev_key_)) {
@@ -207,6 +214,8 @@ namespace wahl {
         Coord<KeyType> spline_start_point_;
 
         bool start_;
+        // False if `max_key_` is only an upper bound.
+        bool bounded_;
 
     };
 
@@ -24,21 +24,47 @@ namespace wahl {
         size_t offset;
         uint32_t size;
         float slope;
+        // Largest and mean distance between the model's estimate and the position of a key,
+        // see `Segment::MeasureError`. Left 0 by the `Builder`.
+        uint32_t error;
+        uint32_t mean_error;
+        // Error bound the segment was built with, which caps its search window.
+        uint32_t max_error;
 //        bool full; // if could add more point in the end
     };
 
-    struct SearchBound {
-        size_t begin;
-        size_t end; // Exclusive.
+    template<typename KeyType, typename ValueType>
+    struct KeyValue {
+        KeyType key;
+        ValueType value;
     };
 
+    // A write that reached a segment while a background rebuild held a snapshot of it.
     template<typename KeyType, typename ValueType>
-    struct KeyValue {
+    struct LoggedWrite {
+        enum Op : uint8_t { INSERT, UPDATE, ERASE };
         KeyType key;
         ValueType value;
+        Op op;
     };
 
+    // Bytes currently used by one index, see `WahlIndex::GetMemoryStats`.
+    struct MemoryStats {
+        size_t index_bytes;           // the `WahlIndex` object itself
+        size_t inner_node_bytes;      // ART inner nodes (radix table of a `LearnedDirectory`)
+        size_t leaf_bytes;            // ART leaves (boundary arrays of a `LearnedDirectory`)
+        size_t segment_bytes;         // segment headers and tombstones
+        size_t segment_array_bytes;   // segment key and value arrays, mapped ones included
+        size_t slot_buffer_bytes;     // slot buffer tables and slot buffers of the segments
+        size_t overflow_buffer_bytes; // global overflow buffer
+        size_t mapped_bytes;          // rest of the file mapped by `WahlIndex::Load`
+        size_t reserved_bytes;        // obtained from the system, including allocator slack
 
+        size_t Total() const {
+            return index_bytes + inner_node_bytes + leaf_bytes + segment_bytes + segment_array_bytes +
+                   slot_buffer_bytes + overflow_buffer_bytes + mapped_bytes;
+        }
+    };
 
 } // namespace wahl
 
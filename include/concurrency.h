@@ -0,0 +1,216 @@
+#ifndef ARTS_CONCURRENCY_H
+#define ARTS_CONCURRENCY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <emmintrin.h> // _mm_pause
+
+namespace wahl {
+
+    static inline void CpuRelax(uint32_t &spins) {
+        if (++spins < 64) _mm_pause();
+        else std::this_thread::yield();
+    }
+
+    // Optimistic version lock (optimistic lock coupling, Leis et al. [DaMoN'16]).
+    // Bit 0 marks the protected object obsolete, bit 1 is the write lock and the remaining
+    // bits are a version that is bumped on every write unlock.
+    // Readers take a snapshot with `ReadLockOrRestart`, read without writing shared memory
+    // and validate the snapshot with `ReadUnlockOrRestart` before trusting what they read.
+    class OptLock {
+    public:
+        OptLock(): version_(0b100) {}
+
+        inline uint64_t ReadLockOrRestart(bool &need_restart) const {
+            uint64_t version = AwaitNodeUnlocked();
+            if (IsObsolete(version)) need_restart = true;
+            return version;
+        }
+
+        inline void ReadUnlockOrRestart(uint64_t start_read, bool &need_restart) const {
+            if (start_read != version_.load()) need_restart = true;
+        }
+
+        inline void CheckOrRestart(uint64_t start_read, bool &need_restart) const {
+            ReadUnlockOrRestart(start_read, need_restart);
+        }
+
+        inline void WriteLock() {
+            uint32_t spins = 0;
+            while (true) {
+                uint64_t version = version_.load();
+                if (!IsLocked(version) && version_.compare_exchange_weak(version, version + 0b10))
+                    return;
+                CpuRelax(spins);
+            }
+        }
+
+        inline void WriteUnlock() {
+            version_.fetch_add(0b10);
+        }
+
+        inline void WriteUnlockObsolete() {
+            version_.fetch_add(0b11);
+        }
+
+        inline bool IsObsolete() const {
+            return IsObsolete(version_.load());
+        }
+
+    private:
+        static inline bool IsLocked(uint64_t version) { return (version & 0b10) == 0b10; }
+        static inline bool IsObsolete(uint64_t version) { return (version & 1) == 1; }
+
+        inline uint64_t AwaitNodeUnlocked() const {
+            uint32_t spins = 0;
+            uint64_t version = version_.load();
+            while (IsLocked(version)) {
+                CpuRelax(spins);
+                version = version_.load();
+            }
+            return version;
+        }
+
+        std::atomic<uint64_t> version_;
+    };
+
+    // Test-and-test-and-set latch for writers. It never blocks readers, which use `OptLock`.
+    class SpinLatch {
+    public:
+        inline void Lock() {
+            uint32_t spins = 0;
+            while (latched_.load(std::memory_order_relaxed) || latched_.exchange(true, std::memory_order_acquire))
+                CpuRelax(spins);
+        }
+
+        inline void Unlock() {
+            latched_.store(false, std::memory_order_release);
+        }
+
+    private:
+        std::atomic<bool> latched_{false};
+    };
+
+    // Hands out dense thread ids in [0, kMaxThreads), recycled when a thread exits.
+    class ThreadRegistry {
+    public:
+        static const uint32_t kMaxThreads = 256;
+
+        static uint32_t ThreadId() {
+            thread_local Slot slot;
+            return slot.id;
+        }
+
+    private:
+        struct Slot {
+            uint32_t id;
+            Slot() {
+                std::lock_guard<std::mutex> guard(mutex());
+                auto &used = used_ids();
+                for (id = 0; id < kMaxThreads && used[id]; ++id);
+                assert(id < kMaxThreads && "too many threads registered with ThreadRegistry");
+                used[id] = true;
+            }
+            ~Slot() {
+                std::lock_guard<std::mutex> guard(mutex());
+                used_ids()[id] = false;
+            }
+        };
+
+        static std::mutex &mutex() {
+            static std::mutex m;
+            return m;
+        }
+
+        static std::vector<bool> &used_ids() {
+            static std::vector<bool> used(kMaxThreads, false);
+            return used;
+        }
+    };
+
+    // Epoch based memory reclamation. Readers announce the global epoch while they may hold
+    // pointers to shared objects; unlinked objects are retired with the epoch at which they
+    // became unreachable and freed once every active reader has moved past that epoch.
+    class EpochManager {
+        static const uint64_t kInactive = std::numeric_limits<uint64_t>::max();
+        static const size_t kReclaimBatch = 64;
+
+        struct alignas(64) LocalEpoch {
+            std::atomic<uint64_t> epoch{kInactive};
+        };
+
+        struct Retired {
+            void *object;
+            void (*deleter)(void *, void *);
+            void *context;
+            uint64_t epoch;
+        };
+
+    public:
+        EpochManager(): global_epoch_(1) {}
+
+        ~EpochManager() {
+            for (auto &r : retired_) r.deleter(r.object, r.context);
+        }
+
+        EpochManager(const EpochManager &) = delete;
+        EpochManager &operator=(const EpochManager &) = delete;
+
+        inline void Enter() {
+            local_epochs_[ThreadRegistry::ThreadId()].epoch.store(global_epoch_.load());
+        }
+
+        inline void Exit() {
+            local_epochs_[ThreadRegistry::ThreadId()].epoch.store(kInactive, std::memory_order_release);
+        }
+
+        // `object` must already be unreachable for readers that enter after this call. It is
+        // freed with `deleter(object, context)`.
+        void Retire(void *object, void (*deleter)(void *, void *), void *context = nullptr) {
+            std::lock_guard<std::mutex> guard(retired_mutex_);
+            retired_.push_back({object, deleter, context, global_epoch_.fetch_add(1)});
+            if (retired_.size() >= kReclaimBatch) Reclaim();
+        }
+
+    private:
+        void Reclaim() {
+            uint64_t min_epoch = kInactive;
+            for (auto &local : local_epochs_) {
+                min_epoch = std::min(min_epoch, local.epoch.load());
+            }
+            size_t kept = 0;
+            for (auto &r : retired_) {
+                if (r.epoch < min_epoch) r.deleter(r.object, r.context);
+                else retired_[kept++] = r;
+            }
+            retired_.resize(kept);
+        }
+
+        std::atomic<uint64_t> global_epoch_;
+        LocalEpoch local_epochs_[ThreadRegistry::kMaxThreads];
+        std::mutex retired_mutex_;
+        std::vector<Retired> retired_;
+    };
+
+    // Scoped reader registration with an `EpochManager`.
+    class EpochGuard {
+    public:
+        explicit EpochGuard(EpochManager &manager): manager_(manager) { manager_.Enter(); }
+        ~EpochGuard() { manager_.Exit(); }
+
+        EpochGuard(const EpochGuard &) = delete;
+        EpochGuard &operator=(const EpochGuard &) = delete;
+
+    private:
+        EpochManager &manager_;
+    };
+
+}
+
+#endif //ARTS_CONCURRENCY_H
@@ -0,0 +1,329 @@
+#ifndef ARTS_LEARNED_DIRECTORY_H
+#define ARTS_LEARNED_DIRECTORY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+#include "allocator.h"
+#include "concurrency.h"
+#include "search.h"
+
+namespace wahl {
+
+    // Segment directory for read-mostly indexes, an alternative to `ArtTree` for the
+    // `Directory` policy of `WahlIndex`. The boundary keys and their segments are kept in sorted
+    // arrays, and a radix table over the top bits of `key - min_key` (a piecewise constant
+    // model of their CDF) maps a key to the few boundaries that share its bucket, which are
+    // searched like a segment window. A lookup touches one table entry and one or two lines of
+    // keys instead of up to `sizeof(KeyType)` nodes.
+    //
+    // The arrays and the table form one immutable snapshot. Every change builds the next one:
+    // the boundaries outside the changed key range are block copied, and only the table entries
+    // of the changed buckets are recomputed, the later ones are shifted. Readers load the
+    // snapshot pointer, so they may run concurrently with one writer, and replaced snapshots are
+    // retired through the epoch manager, like the nodes of `ArtTree`.
+    template<class KeyType>
+    class LearnedDirectory {
+        static_assert(std::is_unsigned<KeyType>::value, "the radix table needs unsigned keys");
+
+        struct Snapshot {
+            size_t bytes;          // of the whole block
+            size_t num_keys;
+            KeyType min_key;       // base of the radix table
+            uint32_t shift;        // bucket of `key` is `(key - min_key) >> shift`
+            uint32_t table_size;   // number of buckets
+            KeyType *keys;
+            uintptr_t *values;
+            // `table[b]` is the first boundary in bucket `b` or later, `table[table_size]` is
+            // `num_keys`.
+            uint32_t *table;
+
+            // Bucket of `key`, `table_size` if past every boundary of the table.
+            inline size_t Bucket(KeyType key) const {
+                if (key < min_key) return 0;
+                KeyType bucket = (key - min_key) >> shift;
+                return bucket < table_size ? static_cast<size_t>(bucket) : table_size;
+            }
+
+            inline bool Covers(KeyType key) const {
+                return key >= min_key && static_cast<KeyType>((key - min_key) >> shift) < table_size;
+            }
+
+            inline size_t LowerBound(KeyType key) const {
+                size_t bucket = Bucket(key);
+                if (bucket == table_size) return num_keys;
+                return LowerBoundInWindow<const KeyType *>(keys, table[bucket], table[bucket + 1], key);
+            }
+        };
+
+        // Largest radix table, 64 MB of entries.
+        static constexpr uint32_t kMaxRadixBits = 24;
+
+    public:
+        static constexpr size_t kMaxGroupSize = 32;
+
+        LearnedDirectory() = default;
+
+        ~LearnedDirectory() {
+            if (!allocator_) FreeSnapshot(snapshot_.load(), nullptr);
+        }
+
+        LearnedDirectory(const LearnedDirectory &) = delete;
+        LearnedDirectory &operator=(const LearnedDirectory &) = delete;
+
+        // Snapshots replaced by a change are retired through `epoch_manager` instead of being
+        // freed immediately, so that concurrent readers never touch freed memory.
+        void set_epoch_manager(EpochManager *epoch_manager) {
+            epoch_manager_ = epoch_manager;
+        }
+
+        // Allocates the snapshots from `allocator`. Must be set while the directory is empty.
+        void set_allocator(SlabAllocator *allocator) {
+            assert(snapshot_.load() == nullptr);
+            allocator_ = allocator;
+        }
+
+        // First boundary not less than `key`, or null.
+        void* LowerBound(KeyType key) const {
+            return Resolve(snapshot_.load(std::memory_order_relaxed), key);
+        }
+
+        // Same as `LowerBound`, for readers that run concurrently with one writer. The caller must
+        // be registered with the epoch manager passed to `set_epoch_manager`.
+        void* OptimisticLowerBound(KeyType key) const {
+            return Resolve(snapshot_.load(std::memory_order_acquire), key);
+        }
+
+        // Lower bound lookups of up to `kMaxGroupSize` keys at once. The table entries of all
+        // keys are prefetched first, then their boundary keys, so the misses overlap.
+        void LowerBoundGroup(const KeyType *keys, size_t num_keys, void **results) {
+            assert(num_keys <= kMaxGroupSize);
+            const Snapshot *s = snapshot_.load(std::memory_order_relaxed);
+            if (s == nullptr) {
+                std::fill(results, results + num_keys, nullptr);
+                return;
+            }
+            size_t buckets[kMaxGroupSize];
+            for (size_t i = 0; i < num_keys; ++i) {
+                buckets[i] = s->Bucket(keys[i]);
+                __builtin_prefetch(s->table + buckets[i]);
+            }
+            for (size_t i = 0; i < num_keys; ++i) {
+                if (buckets[i] < s->table_size) __builtin_prefetch(s->keys + s->table[buckets[i]]);
+            }
+            for (size_t i = 0; i < num_keys; ++i) {
+                size_t pos = buckets[i] == s->table_size ? s->num_keys :
+                             LowerBoundInWindow<const KeyType *>(s->keys, s->table[buckets[i]], s->table[buckets[i] + 1], keys[i]);
+                results[i] = pos < s->num_keys ? reinterpret_cast<void *>(s->values[pos]) : nullptr;
+            }
+        }
+
+        // Exact match lookup, null if `key` is no boundary.
+        void* Lookup(KeyType key) {
+            const Snapshot *s = snapshot_.load(std::memory_order_relaxed);
+            if (s == nullptr) return nullptr;
+            size_t pos = s->LowerBound(key);
+            return pos < s->num_keys && s->keys[pos] == key ? reinterpret_cast<void *>(s->values[pos]) : nullptr;
+        }
+
+        // Inserts the sorted `keys` with their `values` (equal keys keep the last value).
+        void BulkBuild(const std::vector<KeyType> &keys, const std::vector<uintptr_t> &values) {
+            assert(keys.size() == values.size());
+            assert(std::is_sorted(keys.begin(), keys.end()));
+            if (keys.empty()) return;
+            const Snapshot *old = snapshot_.load(std::memory_order_relaxed);
+            size_t old_num_keys = old ? old->num_keys : 0;
+            // Old boundaries `[begin, end)` fall into the range of `keys` and are merged with them.
+            size_t begin = old ? std::lower_bound(old->keys, old->keys + old_num_keys, keys.front()) - old->keys : 0;
+            size_t end = old ? std::upper_bound(old->keys + begin, old->keys + old_num_keys, keys.back()) - old->keys : 0;
+
+            std::vector<KeyType> merged_keys;
+            std::vector<uintptr_t> merged_values;
+            merged_keys.reserve(end - begin + keys.size());
+            merged_values.reserve(end - begin + keys.size());
+            for (size_t i = begin, j = 0; i < end || j < keys.size();) {
+                if (j == keys.size() || (i < end && old->keys[i] < keys[j])) {
+                    merged_keys.push_back(old->keys[i]);
+                    merged_values.push_back(old->values[i++]);
+                } else {
+                    if (i < end && old->keys[i] == keys[j]) ++i;
+                    if (!merged_keys.empty() && merged_keys.back() == keys[j]) merged_values.back() = values[j++];
+                    else {
+                        merged_keys.push_back(keys[j]);
+                        merged_values.push_back(values[j++]);
+                    }
+                }
+            }
+            Replace(old, begin, end, merged_keys.data(), merged_values.data(), merged_keys.size());
+        }
+
+        void Remove(KeyType key) {
+            const Snapshot *old = snapshot_.load(std::memory_order_relaxed);
+            if (old == nullptr) return;
+            size_t pos = old->LowerBound(key);
+            if (pos == old->num_keys || old->keys[pos] != key) return;
+            Replace(old, pos, pos + 1, nullptr, nullptr, 0);
+        }
+
+        std::size_t size() const {
+            return sizeof(*this) + inner_node_bytes() + leaf_bytes();
+        }
+
+        // Bytes of the radix table, the counterpart of the inner nodes of `ArtTree`.
+        std::size_t inner_node_bytes() const {
+            return table_bytes_.load(std::memory_order_relaxed);
+        }
+
+        // Bytes of the boundary arrays and the snapshot header.
+        std::size_t leaf_bytes() const {
+            return array_bytes_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        static inline void *Resolve(const Snapshot *s, KeyType key) {
+            if (s == nullptr) return nullptr;
+            size_t pos = s->LowerBound(key);
+            return pos < s->num_keys ? reinterpret_cast<void *>(s->values[pos]) : nullptr;
+        }
+
+        static inline size_t AlignUp(size_t offset, size_t alignment) {
+            return (offset + alignment - 1) / alignment * alignment;
+        }
+
+        Snapshot *CreateSnapshot(size_t num_keys, uint32_t table_size) {
+            size_t keys_offset = AlignUp(sizeof(Snapshot), 64);
+            size_t values_offset = AlignUp(keys_offset + num_keys * sizeof(KeyType), alignof(uintptr_t));
+            size_t table_offset = AlignUp(values_offset + num_keys * sizeof(uintptr_t), alignof(uint32_t));
+            size_t bytes = table_offset + (table_size + 1) * sizeof(uint32_t);
+            char *block = static_cast<char *>(AllocateBytes(allocator_, bytes, MemoryTag::kDirectory));
+            Snapshot *s = reinterpret_cast<Snapshot *>(block);
+            s->bytes = bytes;
+            s->num_keys = num_keys;
+            s->table_size = table_size;
+            s->keys = reinterpret_cast<KeyType *>(block + keys_offset);
+            s->values = reinterpret_cast<uintptr_t *>(block + values_offset);
+            s->table = reinterpret_cast<uint32_t *>(block + table_offset);
+            return s;
+        }
+
+        static void FreeSnapshot(void *snapshot, void *allocator) {
+            if (snapshot == nullptr) return;
+            DeallocateBytes(static_cast<SlabAllocator *>(allocator), snapshot,
+                            static_cast<Snapshot *>(snapshot)->bytes, MemoryTag::kDirectory);
+        }
+
+        // Radix table for boundaries from `first_key` to `last_key`: about two buckets per
+        // boundary over that range.
+        static inline void ChooseRadix(KeyType first_key, KeyType last_key, size_t num_keys,
+                                       uint32_t &bits, uint32_t &shift) {
+            bits = std::min<uint32_t>(kMaxRadixBits, 64 - __builtin_clzll(num_keys | 1));
+            uint64_t range = static_cast<uint64_t>(last_key - first_key);
+            uint32_t range_bits = range ? 64 - __builtin_clzll(range) : 0;
+            shift = range_bits > bits ? range_bits - bits : 0;
+        }
+
+        // Publishes the boundaries of `old` with `[begin, end)` replaced by the `num_changed`
+        // sorted boundaries `changed_keys`.
+        void Replace(const Snapshot *old, size_t begin, size_t end,
+                     const KeyType *changed_keys, const uintptr_t *changed_values, size_t num_changed) {
+            size_t old_num_keys = old ? old->num_keys : 0;
+            size_t num_keys = old_num_keys - (end - begin) + num_changed;
+            if (num_keys == 0) {
+                Publish(nullptr);
+                return;
+            }
+            // The table is patched rather than recomputed if it still fits the boundaries: same
+            // order of magnitude, and the changed keys land inside its buckets.
+            bool patch = old != nullptr && num_keys <= 2 * old->table_size && 4 * num_keys >= old->table_size &&
+                         (num_changed == 0 || (old->Covers(changed_keys[0]) && old->Covers(changed_keys[num_changed - 1])));
+            Snapshot *s;
+            if (patch) {
+                s = CreateSnapshot(num_keys, old->table_size);
+                s->min_key = old->min_key;
+                s->shift = old->shift;
+            } else {
+                KeyType first_key = begin > 0 ? old->keys[0] : num_changed ? changed_keys[0] : old->keys[end];
+                KeyType last_key = end < old_num_keys ? old->keys[old_num_keys - 1] :
+                                   num_changed ? changed_keys[num_changed - 1] : old->keys[begin - 1];
+                uint32_t bits, shift;
+                ChooseRadix(first_key, last_key, num_keys, bits, shift);
+                s = CreateSnapshot(num_keys, uint32_t(1) << bits);
+                s->min_key = first_key;
+                s->shift = shift;
+            }
+            Copy(old, begin, end, changed_keys, changed_values, num_changed, s);
+            if (patch) {
+                // Buckets up to the first changed key keep their entries, buckets after the last
+                // one are shifted by the change in size.
+                size_t first_bucket = s->table_size, last_bucket = 0;
+                if (begin < end) {
+                    first_bucket = old->Bucket(old->keys[begin]);
+                    last_bucket = old->Bucket(old->keys[end - 1]);
+                }
+                if (num_changed) {
+                    first_bucket = std::min(first_bucket, old->Bucket(changed_keys[0]));
+                    last_bucket = std::max(last_bucket, old->Bucket(changed_keys[num_changed - 1]));
+                }
+                memcpy(s->table, old->table, (first_bucket + 1) * sizeof(uint32_t));
+                FillTable(s, first_bucket + 1, last_bucket + 1);
+                for (size_t b = last_bucket + 1; b <= s->table_size; ++b) {
+                    s->table[b] = static_cast<uint32_t>(old->table[b] + num_keys - old_num_keys);
+                }
+            } else {
+                s->table[0] = 0;
+                FillTable(s, 1, s->table_size + 1);
+            }
+            Publish(s);
+        }
+
+        static void Copy(const Snapshot *old, size_t begin, size_t end,
+                         const KeyType *changed_keys, const uintptr_t *changed_values, size_t num_changed,
+                         Snapshot *s) {
+            size_t old_num_keys = old ? old->num_keys : 0;
+            if (begin) {
+                memcpy(s->keys, old->keys, begin * sizeof(KeyType));
+                memcpy(s->values, old->values, begin * sizeof(uintptr_t));
+            }
+            if (num_changed) {
+                memcpy(s->keys + begin, changed_keys, num_changed * sizeof(KeyType));
+                memcpy(s->values + begin, changed_values, num_changed * sizeof(uintptr_t));
+            }
+            if (old_num_keys > end) {
+                memcpy(s->keys + begin + num_changed, old->keys + end, (old_num_keys - end) * sizeof(KeyType));
+                memcpy(s->values + begin + num_changed, old->values + end, (old_num_keys - end) * sizeof(uintptr_t));
+            }
+        }
+
+        // Computes `table[first, last)` from the keys, `table[first - 1]` must be set.
+        static void FillTable(Snapshot *s, size_t first, size_t last) {
+            size_t pos = s->table[first - 1];
+            for (size_t b = first; b < last; ++b) {
+                while (pos < s->num_keys && s->Bucket(s->keys[pos]) < b) ++pos;
+                s->table[b] = static_cast<uint32_t>(pos);
+            }
+        }
+
+        void Publish(Snapshot *s) {
+            Snapshot *old = snapshot_.load(std::memory_order_relaxed);
+            table_bytes_.store(s ? (s->table_size + 1) * sizeof(uint32_t) : 0, std::memory_order_relaxed);
+            array_bytes_.store(s ? s->bytes - (s->table_size + 1) * sizeof(uint32_t) : 0, std::memory_order_relaxed);
+            snapshot_.store(s, std::memory_order_release);
+            if (old == nullptr) return;
+            if (epoch_manager_) epoch_manager_->Retire(old, &FreeSnapshot, allocator_);
+            else FreeSnapshot(old, allocator_);
+        }
+
+        std::atomic<Snapshot *> snapshot_{nullptr};
+        EpochManager *epoch_manager_ = nullptr;
+        SlabAllocator *allocator_ = nullptr;
+        std::atomic<size_t> table_bytes_{0};
+        std::atomic<size_t> array_bytes_{0};
+    };
+}
+
+#endif //ARTS_LEARNED_DIRECTORY_H
@@ -0,0 +1,137 @@
+#ifndef ARTS_SEARCH_H
+#define ARTS_SEARCH_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+namespace wahl {
+
+    // Windows up to this many keys (two cache lines of 64 bit keys) are scanned linearly.
+    // Larger ones are first narrowed down to it by a branchless binary search.
+    static const size_t kLinearSearchKeys = 16;
+
+    // Returns how many of the sorted `keys[0, n)` are less than `key`. Compares whole vectors
+    // of 32 or 64 bit unsigned keys at a time and stops at the first vector that reaches `key`.
+    template<typename KeyType>
+    static inline size_t LinearLowerBound(const KeyType *keys, size_t n, KeyType key) {
+#if defined(__AVX512F__)
+        if constexpr (std::is_unsigned<KeyType>::value && sizeof(KeyType) == 8) {
+            const __m512i needle = _mm512_set1_epi64(static_cast<long long>(key));
+            size_t count = 0;
+            for (size_t i = 0; i < n; i += 8) {
+                // The masked load never touches keys past `n`.
+                __mmask8 valid = n - i >= 8 ? 0xFF : static_cast<__mmask8>((1u << (n - i)) - 1);
+                __m512i block = _mm512_maskz_loadu_epi64(valid, keys + i);
+                __mmask8 less = _mm512_mask_cmplt_epu64_mask(valid, block, needle);
+                count += __builtin_popcount(less);
+                if (less != valid) break;
+            }
+            return count;
+        } else if constexpr (std::is_unsigned<KeyType>::value && sizeof(KeyType) == 4) {
+            const __m512i needle = _mm512_set1_epi32(static_cast<int>(key));
+            size_t count = 0;
+            for (size_t i = 0; i < n; i += 16) {
+                __mmask16 valid = n - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (n - i)) - 1);
+                __m512i block = _mm512_maskz_loadu_epi32(valid, keys + i);
+                __mmask16 less = _mm512_mask_cmplt_epu32_mask(valid, block, needle);
+                count += __builtin_popcount(less);
+                if (less != valid) break;
+            }
+            return count;
+        }
+#elif defined(__AVX2__)
+        // AVX2 only compares signed integers: flipping the sign bit of both sides keeps the
+        // unsigned order.
+        if constexpr (std::is_unsigned<KeyType>::value && sizeof(KeyType) == 8) {
+            const __m256i sign = _mm256_set1_epi64x(static_cast<long long>(1ULL << 63));
+            const __m256i needle = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<long long>(key)), sign);
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4) {
+                __m256i block = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)), sign);
+                uint32_t less = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(needle, block)));
+                if (less != 0xF) return i + __builtin_popcount(less);
+            }
+            for (; i < n && keys[i] < key; ++i);
+            return i;
+        } else if constexpr (std::is_unsigned<KeyType>::value && sizeof(KeyType) == 4) {
+            const __m256i sign = _mm256_set1_epi32(static_cast<int>(1U << 31));
+            const __m256i needle = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(key)), sign);
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) {
+                __m256i block = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)), sign);
+                uint32_t less = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(needle, block)));
+                if (less != 0xFF) return i + __builtin_popcount(less);
+            }
+            for (; i < n && keys[i] < key; ++i);
+            return i;
+        }
+#endif
+        size_t i = 0;
+        for (; i < n && keys[i] < key; ++i);
+        return i;
+    }
+
+    // The searches below take either a plain key array or a key view of a segment slot layout
+    // (see slot_array.h): a class with `operator[]`, `Address(i)` and its own
+    // `LinearLowerBound(begin, n, key)`.
+    template<typename Keys, typename KeyType>
+    static inline size_t LinearLowerBound(const Keys &keys, size_t begin, size_t n, KeyType key) {
+        if constexpr (std::is_pointer<Keys>::value) return LinearLowerBound<KeyType>(keys + begin, n, key);
+        else return keys.LinearLowerBound(begin, n, key);
+    }
+
+    template<typename Keys>
+    static inline const void *KeyAddress(const Keys &keys, size_t i) {
+        if constexpr (std::is_pointer<Keys>::value) return keys + i;
+        else return keys.Address(i);
+    }
+
+    // Position of the first key in the sorted `keys[begin, end)` that is not less than `key`,
+    // or `end`, like `std::lower_bound`. `[base, base + n]` always holds the answer. The binary
+    // search compiles to conditional moves, so nothing runs ahead speculatively: both possible
+    // next probes are prefetched instead, which pays off once the window spans many lines.
+    template<typename Keys, typename KeyType>
+    static inline size_t LowerBoundInWindow(const Keys &keys, size_t begin, size_t end, KeyType key) {
+        size_t base = begin;
+        size_t n = end - begin;
+        while (n > kLinearSearchKeys) {
+            size_t half = n / 2;
+            __builtin_prefetch(KeyAddress(keys, base + half / 2));
+            __builtin_prefetch(KeyAddress(keys, base + half + half / 2));
+            base = keys[base + half] < key ? base + half : base;
+            n -= half;
+        }
+        return base + LinearLowerBound(keys, base, n, key);
+    }
+
+    // Like `LowerBoundInWindow` for windows that start right after the estimated position:
+    // gallops up from `begin` with doubling steps, so the cost grows with the distance to the
+    // answer rather than with the window.
+    template<typename Keys, typename KeyType>
+    static inline size_t GallopUp(const Keys &keys, size_t begin, size_t end, KeyType key) {
+        size_t step = kLinearSearchKeys;
+        while (end - begin > step && keys[begin + step - 1] < key) {
+            begin += step;
+            step *= 2;
+        }
+        return LowerBoundInWindow(keys, begin, std::min(end, begin + step), key);
+    }
+
+    // Counterpart of `GallopUp` for windows that end at the estimated position.
+    template<typename Keys, typename KeyType>
+    static inline size_t GallopDown(const Keys &keys, size_t begin, size_t end, KeyType key) {
+        size_t step = kLinearSearchKeys;
+        while (end - begin > step && keys[end - step] >= key) {
+            end -= step;
+            step *= 2;
+        }
+        return LowerBoundInWindow(keys, end - begin > step ? end - step + 1 : begin, end, key);
+    }
+}
+
+#endif //ARTS_SEARCH_H
@@ -5,112 +5,238 @@
 #ifndef ART_TEST_SEGMENT_H
 #define ART_TEST_SEGMENT_H
 
+#include <cassert>
 #include <cstdint>
 #include <cmath>
 #include <vector>
 #include <cstring>
+#include <atomic>
 #include "common.h"
+#include "allocator.h"
 #include "bucket.h"
+#include "concurrency.h"
+#include "search.h"
+#include "slot_array.h"
 #include <iostream>
 
 namespace wahl {
 
-    template<typename KeyType, typename ValueType>
+    // With `kArrayBuffer`, keys that miss the array go to `SortedArrayBuffer` slots instead of
+    // `OverflowBuffer` slots. Only the latter supports concurrent readers.
+    // Arrays, buffers and tombstones come from `allocator`, or the global heap without one.
+    // `kLayout` picks how the array slots are laid out, see `SlotLayout`.
+    template<typename KeyType, typename ValueType, bool kArrayBuffer = false, SlotLayout kLayout = SlotLayout::kSplit>
     class Segment {
 
     public:
 
-        typedef OverflowBuffer<KeyType, ValueType>* OverflowBufferPtr;
+        typedef typename std::conditional<kArrayBuffer, SortedArrayBuffer<KeyType, ValueType>,
+                OverflowBuffer<KeyType, ValueType>>::type BufferType;
+        typedef BufferType* OverflowBufferPtr;
+        typedef std::vector<LoggedWrite<KeyType, ValueType>> WriteLog;
+        typedef SlotArray<KeyType, ValueType, kLayout> Slots;
 
-        Segment(): keys_(nullptr), values_(nullptr), buffers_(nullptr), /*full_(false),*/
-                   num_array_keys_(0), slope_(0.0), num_buffers_keys_(0), num_buffer_sorted_keys_(0), alpha_(32), pre_(nullptr), next_(nullptr) {
-            segment_allocated_byte += sizeof(*this);
+        explicit Segment(SlabAllocator *allocator = nullptr): /*full_(false),*/
+                   num_array_keys_(0), slope_(0.0), model_error_(0), mean_error_(0), max_error_(0), num_buffers_keys_(0), alpha_(32), pre_(nullptr), next_(nullptr),
+                   retrain_pending_(false), retrain_log_(nullptr), tombstones_(nullptr), num_tombstones_(0), allocator_(allocator),
+                   owns_arrays_(true) {
         }
 
         ~Segment() {
-            segment_allocated_byte -= sizeof(*this);
-            if (keys_) {
-                if (buffers_) {
-                    for (uint32_t i = 0; i < num_array_keys_; i++) {
-                        if (buffers_[i]) delete buffers_[i];
-                    }
-                    delete []buffers_;
-                }
-                delete []keys_;
-                delete []values_;
-            }
-            if (pre_) {
-                pre_->set_next_segment(next_);
+            buffers_.ForEach([this](OverflowBufferPtr buffer) { DestroyObject(allocator_, buffer, MemoryTag::kBuffer); });
+            buffers_.Clear(allocator_, num_array_keys_);
+            if (slots_.allocated() && owns_arrays_) slots_.Deallocate(allocator_, num_array_keys_);
+            if (tombstones_) {
+                DeallocateArray(allocator_, tombstones_, TombstoneWords(), MemoryTag::kSegment);
             }
+            // Unlinking from `pre_`/`next_` is the caller's job: a retired segment may outlive
+            // its neighbours, and rewriting their links here would undo a newer splice.
         }
 
         inline void AddKV(const SegmentMessage<KeyType> &seg_msg, const std::vector<KeyType> &keys, const std::vector<ValueType> &values) {
-            num_array_keys_ = seg_msg.size;
-            keys_ = reinterpret_cast<KeyType*>(malloc(num_array_keys_ * sizeof(KeyType)));
-            values_ = reinterpret_cast<ValueType*>(malloc(num_array_keys_ * sizeof(ValueType)));
-            buffers_ = reinterpret_cast<OverflowBufferPtr*>(malloc(num_array_keys_ * sizeof(OverflowBufferPtr)));
+            AllocateArrays(seg_msg.size);
+            CopyKV(seg_msg, keys, values);
+        }
+
+        // `AddKV` in two steps: only `AllocateArrays` touches the allocator, so `CopyKV` may
+        // run for many segments in parallel.
+        inline void AllocateArrays(uint32_t size) {
+            num_array_keys_ = size;
+            slots_.Allocate(allocator_, num_array_keys_);
+        }
+
+        inline void CopyKV(const SegmentMessage<KeyType> &seg_msg, const std::vector<KeyType> &keys, const std::vector<ValueType> &values) {
+            assert(seg_msg.size == num_array_keys_);
+            slots_.Assign(keys.data() + seg_msg.offset, values.data() + seg_msg.offset, num_array_keys_);
+            model_error_ = seg_msg.error;
+            mean_error_ = seg_msg.mean_error;
+            max_error_ = seg_msg.max_error;
+        }
 
-            memcpy(keys_, keys.data() + seg_msg.offset, num_array_keys_ * sizeof(KeyType));
-            memcpy(values_, values.data() + seg_msg.offset, num_array_keys_ * sizeof(ValueType));
-//            for (int i = 0; i < num_array_keys_; i++) buffers_[i] = new OverflowBuffer<KeyType, ValueType>;
-            memset(buffers_, 0, num_array_keys_ * sizeof(OverflowBufferPtr));
+        // Serves the slots `seg_msg` describes straight from `keys` and `values`, which the
+        // caller owns and keeps alive, see `WahlIndex::Load`. Only the split layout matches the
+        // arrays: the others copy their slots out of them.
+        inline void MapKV(const SegmentMessage<KeyType> &seg_msg, KeyType *keys, ValueType *values) {
+            num_array_keys_ = seg_msg.size;
+            if constexpr (kLayout == SlotLayout::kSplit) {
+                slots_.Map(keys + seg_msg.offset, values + seg_msg.offset);
+                owns_arrays_ = false;
+            } else {
+                slots_.Allocate(allocator_, num_array_keys_);
+                slots_.Assign(keys + seg_msg.offset, values + seg_msg.offset, num_array_keys_);
+            }
+            model_error_ = seg_msg.error;
+            mean_error_ = seg_msg.mean_error;
+            max_error_ = seg_msg.max_error;
+        }
 
+        // Fills in the largest and the mean distance between the estimate
+        // `slope * (key - keys[0])` and the position of the first occurrence of `key`, over the
+        // `seg_msg.size` sorted `keys`. Since the estimate grows with the key, a key between two
+        // array keys lands at most one slot further from its estimate, which the search window
+        // of `SearchArray` already covers.
+        static void MeasureError(const KeyType *keys, SegmentMessage<KeyType> &seg_msg) {
+            size_t error = 0, total = 0;
+            for (uint32_t i = 0, first = 0; i < seg_msg.size; ++i) {
+                if (keys[i] != keys[first]) first = i;
+                size_t estimate = seg_msg.slope * (keys[i] - keys[0]);
+                size_t distance = estimate > first ? estimate - first : first - estimate;
+                error = std::max(error, distance);
+                total += distance;
+            }
+            seg_msg.error = error;
+            seg_msg.mean_error = seg_msg.size ? total / seg_msg.size : 0;
         }
 
-        inline void Insert(KeyType key, ValueType value, size_t max_error) {
-            SearchBound bound = GetSearchBound(key, max_error);
-            auto it = std::lower_bound(keys_ + bound.begin, keys_ + bound.end, key);
-            size_t pos = it - keys_;
-            auto& buffer = buffers_[pos];
-            if (buffer == nullptr) buffer = new OverflowBuffer<KeyType, ValueType>;
+        inline void Insert(KeyType key, ValueType value) {
+            size_t pos = SearchArray(key);
+            if (__glibc_unlikely(slots_.key(pos) == key && IsTombstone(pos))) {
+                // Revive the deleted slot.
+                slots_.value(pos) = value;
+                ClearTombstone(pos);
+                return;
+            }
+            OverflowBufferPtr buffer = buffers_.Find(pos);
+            if (buffer == nullptr) {
+                buffer = CreateObject<BufferType>(allocator_, MemoryTag::kBuffer, allocator_);
+                buffers_.Insert(allocator_, pos, buffer, num_array_keys_);
+            }
 
             buffer->Insert(key, value);
             num_buffers_keys_ += 1;
         }
 
 
-        inline bool Find(KeyType key, size_t max_error, ValueType& value) {
-            SearchBound bound = GetSearchBound(key, max_error);
-            auto it = std::lower_bound(keys_ + bound.begin, keys_ + bound.end, key);
-            size_t pos = it - keys_;
-            if (keys_[pos] == key) {
-                value = values_[pos];
+        // `move_front` must be false when readers run concurrently, see `MFList::Find`.
+        inline bool Find(KeyType key, ValueType& value, bool move_front = true) {
+            size_t pos;
+            CountStat(StatCounter::kSegmentFinds);
+            if (FindInArray(key, value, pos)) {
+                CountStat(StatCounter::kArrayHits);
+                return true;
+            }
+            OverflowBufferPtr buffer = buffers_.Find(pos);
+            return buffer != nullptr && buffer->Find(key, value, move_front);
+        }
+
+        // Searches the array keys only. On a miss, `pos` is the slot whose buffer may hold `key`.
+        inline bool FindInArray(KeyType key, ValueType& value, size_t& pos) {
+            pos = SearchArray(key);
+            if (slots_.key(pos) == key && !IsTombstone(pos)) {
+                value = slots_.value(pos);
+                return true;
+            }
+            return false;
+        }
+
+        inline bool Update(KeyType key, ValueType value) {
+            size_t pos = SearchArray(key);
+            if (slots_.key(pos) == key && !IsTombstone(pos)) {
+                slots_.value(pos) = value;
+                return true;
+            }
+            OverflowBufferPtr buffer = buffers_.Find(pos);
+            return buffer != nullptr && buffer->Update(key, value);
+        }
+
+        // Array keys are only marked deleted: they still bound the search windows of the model,
+        // and the next `Retrain` drops them.
+        inline bool Erase(KeyType key) {
+            size_t pos = SearchArray(key);
+            if (slots_.key(pos) == key && !IsTombstone(pos)) {
+                SetTombstone(pos);
                 return true;
             }
-            return buffers_[pos] != nullptr && buffers_[pos]->Find(key, value);
+            OverflowBufferPtr buffer = buffers_.Find(pos);
+            if (buffer != nullptr && buffer->Erase(key)) {
+                num_buffers_keys_ -= 1;
+                return true;
+            }
+            return false;
+        }
+
+        // Prefetch steps of a batched lookup, see `WahlIndex::FindBatch`. Each step only reads
+        // memory that the previous one prefetched.
+        inline void PrefetchFirstKey() const {
+            slots_.PrefetchKey(0);
+        }
+
+        inline void PrefetchSlot(KeyType key) const {
+            if (key < slots_.key(0)) return;
+            size_t estimate = std::min<size_t>(slope_ * (key - slots_.key(0)), num_array_keys_ - 1);
+            slots_.PrefetchSlot(estimate);
         }
 
-        inline void Range(KeyType start_key, KeyType end_key, size_t max_error, std::vector<std::pair<KeyType, ValueType>> &kvs, bool& early_stop) {
-            SearchBound bound = GetSearchBound(start_key, max_error);
-            auto it = std::lower_bound(keys_ + bound.begin, keys_ + bound.end, start_key);
-            size_t pos = it - keys_;
-            for ( ; pos != num_array_keys_ && keys_[pos] < end_key; ++pos) {
-                if (__glibc_unlikely(buffers_[pos] != nullptr)) {
-                    buffers_[pos]->Range(start_key, end_key, kvs, num_buffer_sorted_keys_);
+        inline void Range(KeyType start_key, KeyType end_key, std::vector<std::pair<KeyType, ValueType>> &kvs, bool& early_stop) {
+            size_t pos = SearchArray(start_key);
+            for ( ; pos != num_array_keys_ && slots_.key(pos) < end_key; ++pos) {
+                OverflowBufferPtr buffer = buffers_.Find(pos);
+                if (__glibc_unlikely(buffer != nullptr)) {
+                    buffer->Range(start_key, end_key, kvs);
+                }
+                if (__glibc_unlikely(IsTombstone(pos))) continue;
+                kvs.emplace_back(slots_.key(pos), slots_.value(pos));
+            }
+            if (__glibc_likely(pos < num_array_keys_)) {
+                // Keys buffered in front of the first key past the range may still be in it.
+                OverflowBufferPtr buffer = buffers_.Find(pos);
+                if (__glibc_unlikely(buffer != nullptr)) {
+                    buffer->Range(start_key, end_key, kvs);
                 }
-                kvs.emplace_back(keys_[pos], values_[pos]);
+                early_stop = true;
             }
-            if (__glibc_likely(pos < num_array_keys_)) early_stop = true;
         }
 
         inline void ToSortedData(std::vector<KeyType>& keys, std::vector<ValueType>& values) {
             for (size_t i = 0; i < num_array_keys_; ++i) {
-                if (buffers_[i]) {
-                    buffers_[i]->ToSortedData(keys, values);
+                OverflowBufferPtr buffer = buffers_.Find(i);
+                if (buffer) {
+                    buffer->ToSortedData(keys, values);
                 }
-                keys.push_back(keys_[i]);
-                values.push_back(values_[i]);
+                if (IsTombstone(i)) continue;
+                keys.push_back(slots_.key(i));
+                values.push_back(slots_.value(i));
             }
         }
 
         inline void set_slope(float slope) { slope_ = slope; }
-
-        inline void set_pre_segment(Segment<KeyType, ValueType> *pre) {
-            pre_ = pre;
+        inline float slope() { return slope_; }
+        inline uint32_t model_error() { return model_error_; }
+        inline uint32_t mean_error() { return mean_error_; }
+        inline uint32_t max_error() { return max_error_; }
+
+        // Lookups sampled by an index in adaptive error mode, see
+        // `WahlIndex::EnableAdaptiveError`. Relaxed: the counts only steer rebuilds.
+        inline uint64_t accesses() { return accesses_.load(std::memory_order_relaxed); }
+        inline void AddAccesses(uint64_t n) { accesses_.fetch_add(n, std::memory_order_relaxed); }
+        inline void set_accesses(uint64_t n) { accesses_.store(n, std::memory_order_relaxed); }
+
+        inline void set_pre_segment(Segment<KeyType, ValueType, kArrayBuffer, kLayout> *pre) {
+            pre_.store(pre, std::memory_order_release);
         }
 
-        inline void set_next_segment(Segment<KeyType, ValueType> *next) {
-            next_ = next;
+        inline void set_next_segment(Segment<KeyType, ValueType, kArrayBuffer, kLayout> *next) {
+            next_.store(next, std::memory_order_release);
         }
 
 //        void set_full(bool full) { full_ = full; }
@@ -118,26 +244,58 @@ namespace wahl {
 //        bool full() { return full_; }
 
 
-        inline Segment<KeyType, ValueType> * pre_segment() {
-            return pre_;
+        inline Segment<KeyType, ValueType, kArrayBuffer, kLayout> * pre_segment() {
+            return pre_.load(std::memory_order_acquire);
         }
 
-        inline Segment<KeyType, ValueType> * next_segment() {
-            return next_;
+        inline Segment<KeyType, ValueType, kArrayBuffer, kLayout> * next_segment() {
+            return next_.load(std::memory_order_acquire);
         }
 
-        inline KeyType* keys() { return keys_; }
-        inline ValueType* values() { return values_; };
-        inline OverflowBufferPtr* buffers() { return buffers_; }
+        // Readers validate against `version_lock_`; writers serialize on `latch_` and only take
+        // the version lock around the actual mutation, so a rebuild that holds the latch for a
+        // long time never stalls readers of the old segment.
+        inline OptLock& version_lock() { return version_lock_; }
+        inline SpinLatch& latch() { return latch_; }
+
+        // Background retraining, see `WahlIndex::StartBackgroundRetrain`. Both are only touched
+        // under `latch_`: `retrain_pending_` keeps the segment from being queued twice and
+        // `retrain_log_` collects the inserts that arrive after the rebuild took its snapshot.
+        inline bool retrain_pending() { return retrain_pending_; }
+        inline void set_retrain_pending(bool pending) { retrain_pending_ = pending; }
+        inline WriteLog* retrain_log() { return retrain_log_; }
+        inline void set_retrain_log(WriteLog *log) { retrain_log_ = log; }
+
+        inline OverflowBufferPtr buffer(size_t pos) const { return buffers_.Find(pos); }
+        inline const SlotBuffers<BufferType>& buffers() const { return buffers_; }
+        inline void ExportKV(KeyType *keys, ValueType *values) { slots_.Export(keys, values, num_array_keys_); }
         inline uint32_t array_size() { return num_array_keys_; }
         inline uint32_t GetTotalKvNum() {
             return num_array_keys_ + num_buffers_keys_;
         }
 
+        inline uint32_t num_tombstones() { return num_tombstones_; }
+
+        inline uint32_t GetLiveKvNum() {
+            return GetTotalKvNum() - num_tombstones_;
+        }
+
+        // Whether the array holds exactly the live keys: nothing buffered, nothing deleted.
+        inline bool IsCompact() {
+            return num_buffers_keys_ == 0 && num_tombstones_ == 0;
+        }
+
+        // Deleted array slots past this share make the segment worth compacting.
+        inline bool IsSparse() {
+            return num_tombstones_ * 2 > num_array_keys_;
+        }
+
         inline bool IsRetain(size_t avg_num_seg_keys) {
-            // lazy retrain
-            // Retrain when the number of sorted keys in buffer reaches a certain threshold to reduce sorting overhead.
-            if (GetTotalKvNum() > avg_num_seg_keys * alpha_ && num_buffer_sorted_keys_ * 1.0 / num_buffers_keys_ > 0.6) {
+            // Once the slot buffers hold more keys than the array, most lookups miss the array.
+            if (num_buffers_keys_ > num_array_keys_) return true;
+            // lazy retrain: a segment is also rebuilt once it holds `alpha_` times the average
+            // number of keys per segment, and `alpha_` doubles every time.
+            if (GetTotalKvNum() > avg_num_seg_keys * alpha_) {
 //                std::cout << alpha_ * avg_num_seg_keys << std::endl;
                 alpha_ = alpha_  * 2;
                 return true;
@@ -145,48 +303,93 @@ namespace wahl {
             return false;
         }
 
-        inline KeyType back() {
-            return keys_[num_array_keys_ - 1];
+        inline KeyType front() {
+            return slots_.key(0);
         }
 
-        static uint64_t segment_allocated_byte;
+        inline KeyType back() {
+            return slots_.key(num_array_keys_ - 1);
+        }
 
     private:
 
-        // Returns a search bound [begin, end) around the estimated position.
-        inline SearchBound GetSearchBound(const KeyType key, size_t max_error)  {
-            size_t estimate = 0;
-            if (key >= keys_[0])
-                estimate = slope_ * (key - keys_[0]);
-            else return {0, 0};
+        inline size_t TombstoneWords() const {
+            return (num_array_keys_ + 63) / 64;
+        }
 
-            size_t begin = 0, end = 0;
-            // `end` is exclusive.
-            if (keys_[estimate] < key) {
-                begin = (estimate + 1 > num_array_keys_) ? num_array_keys_ : estimate + 1;
-                end = (estimate + max_error + 1 > num_array_keys_) ? num_array_keys_ : (estimate + max_error + 1);
-            } else {
-                begin = (estimate < max_error) ? 0 : estimate - max_error;
-                end = estimate;
+        inline bool IsTombstone(size_t pos) const {
+            return tombstones_ != nullptr && (tombstones_[pos / 64] >> (pos % 64) & 1);
+        }
+
+        inline void SetTombstone(size_t pos) {
+            if (tombstones_ == nullptr) {
+                // Allocated on the first delete, read-only segments never pay for it.
+                tombstones_ = AllocateArray<uint64_t>(allocator_, TombstoneWords(), MemoryTag::kSegment);
+                memset(tombstones_, 0, TombstoneWords() * sizeof(uint64_t));
             }
+            tombstones_[pos / 64] |= uint64_t(1) << (pos % 64);
+            num_tombstones_ += 1;
+        }
+
+        inline void ClearTombstone(size_t pos) {
+            tombstones_[pos / 64] &= ~(uint64_t(1) << (pos % 64));
+            num_tombstones_ -= 1;
+        }
 
-            return SearchBound{begin, end};
+        // Returns the position of the first array key not less than `key`. The window on the
+        // side of the estimated position that holds the key spans the measured error of the
+        // model, at most `max_error_`. Keys usually sit about half the window away from their
+        // estimate, where a binary search over the window is fastest. Only segments whose
+        // keys are much closer on average, and a few outliers stretch the window, gallop
+        // outward from the estimate instead.
+        inline size_t SearchArray(const KeyType key) {
+            if (key < slots_.key(0)) return 0;
+            size_t estimate = slope_ * (key - slots_.key(0));
+            size_t error = std::min(max_error_, model_error_);
+            bool gallop = mean_error_ * kGallopErrorRatio < error;
+
+            // `end` is exclusive.
+            if (slots_.key(estimate) < key) {
+                size_t begin = (estimate + 1 > num_array_keys_) ? num_array_keys_ : estimate + 1;
+                size_t end = (estimate + error + 1 > num_array_keys_) ? num_array_keys_ : (estimate + error + 1);
+                return gallop ? GallopUp(slots_.keys(), begin, end, key) : LowerBoundInWindow(slots_.keys(), begin, end, key);
+            }
+            size_t begin = (estimate < error) ? 0 : estimate - error;
+            return gallop ? GallopDown(slots_.keys(), begin, estimate, key) : LowerBoundInWindow(slots_.keys(), begin, estimate, key);
         }
 
-        KeyType *keys_;
-        ValueType *values_;
-        OverflowBufferPtr  *buffers_;
+        static const uint32_t kGallopErrorRatio = 16;
+
+        Slots slots_;
+        SlotBuffers<BufferType> buffers_;
 
-        Segment<KeyType, ValueType> *pre_;
-        Segment<KeyType, ValueType> *next_;
+        std::atomic<Segment<KeyType, ValueType, kArrayBuffer, kLayout> *> pre_;
+        std::atomic<Segment<KeyType, ValueType, kArrayBuffer, kLayout> *> next_;
+
+        OptLock version_lock_;
+        SpinLatch latch_;
+
+        bool retrain_pending_;
+        WriteLog *retrain_log_;
+
+        // One bit per array slot, set for deleted keys.
+        uint64_t *tombstones_;
+        uint32_t num_tombstones_;
 
 //        bool full_;
         float slope_;
         uint32_t  num_array_keys_;
+        uint32_t model_error_;
+        uint32_t mean_error_;
+        uint32_t max_error_;
+        std::atomic<uint64_t> accesses_{0};
 
         uint32_t num_buffers_keys_;
-        uint32_t num_buffer_sorted_keys_;
         uint32_t alpha_;
+
+        SlabAllocator *allocator_;
+        // False for arrays mapped by `MapKV`.
+        bool owns_arrays_;
     };
 }
 
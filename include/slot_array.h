@@ -0,0 +1,364 @@
+#ifndef ARTS_SLOT_ARRAY_H
+#define ARTS_SLOT_ARRAY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "allocator.h"
+#include "search.h"
+
+namespace wahl {
+
+    // How a segment lays out the keys and values of its array slots.
+    enum class SlotLayout : uint8_t {
+        // One array each. Searches and scans only touch keys, and `WahlIndex::Load` maps the
+        // arrays straight from the file. Best for range scans.
+        kSplit,
+        // One array of {key, value} slots: a point lookup finds the value on the line of the
+        // key it lands on.
+        kInterleaved,
+        // Cache line blocks of a few keys followed by their values. Keeps the value on the
+        // line of its key while linear scans stay vectorized per block.
+        kBlocked
+    };
+
+    // The array slots of a segment in one of the layouts above. Every layout offers the same
+    // members, `keys()` returns what the searches in search.h take. Without `Map`, the slots
+    // are allocated from and freed to the index's allocator.
+    template<typename KeyType, typename ValueType, SlotLayout kLayout>
+    class SlotArray;
+
+    template<typename KeyType, typename ValueType>
+    class SlotArray<KeyType, ValueType, SlotLayout::kSplit> {
+    public:
+        inline void Allocate(SlabAllocator *allocator, uint32_t size) {
+            keys_ = AllocateArray<KeyType>(allocator, size, MemoryTag::kData);
+            values_ = AllocateArray<ValueType>(allocator, size, MemoryTag::kData);
+        }
+
+        inline void Deallocate(SlabAllocator *allocator, uint32_t size) {
+            DeallocateArray(allocator, keys_, size, MemoryTag::kData);
+            DeallocateArray(allocator, values_, size, MemoryTag::kData);
+        }
+
+        // Serves the slots from arrays owned by the caller.
+        inline void Map(KeyType *keys, ValueType *values) {
+            keys_ = keys;
+            values_ = values;
+        }
+
+        inline void Assign(const KeyType *keys, const ValueType *values, uint32_t size) {
+            memcpy(keys_, keys, size * sizeof(KeyType));
+            memcpy(values_, values, size * sizeof(ValueType));
+        }
+
+        inline void Export(KeyType *keys, ValueType *values, uint32_t size) const {
+            memcpy(keys, keys_, size * sizeof(KeyType));
+            memcpy(values, values_, size * sizeof(ValueType));
+        }
+
+        inline bool allocated() const { return keys_ != nullptr; }
+
+        inline const KeyType *keys() const { return keys_; }
+
+        inline KeyType key(size_t i) const { return keys_[i]; }
+
+        inline ValueType &value(size_t i) { return values_[i]; }
+
+        inline void PrefetchKey(size_t i) const { __builtin_prefetch(keys_ + i); }
+
+        inline void PrefetchSlot(size_t i) const {
+            __builtin_prefetch(keys_ + i);
+            __builtin_prefetch(values_ + i);
+        }
+
+    private:
+        KeyType *keys_ = nullptr;
+        ValueType *values_ = nullptr;
+    };
+
+    template<typename KeyType, typename ValueType>
+    class SlotArray<KeyType, ValueType, SlotLayout::kInterleaved> {
+        struct Slot {
+            KeyType key;
+            ValueType value;
+        };
+
+    public:
+        class Keys {
+        public:
+            explicit Keys(const Slot *slots): slots_(slots) {}
+
+            inline const KeyType &operator[](size_t i) const { return slots_[i].key; }
+
+            inline const void *Address(size_t i) const { return &slots_[i].key; }
+
+            // The keys are strided, so this is the scalar scan.
+            inline size_t LinearLowerBound(size_t begin, size_t n, KeyType key) const {
+                size_t i = 0;
+                for (; i < n && slots_[begin + i].key < key; ++i);
+                return i;
+            }
+
+        private:
+            const Slot *slots_;
+        };
+
+        inline void Allocate(SlabAllocator *allocator, uint32_t size) {
+            slots_ = AllocateArray<Slot>(allocator, size, MemoryTag::kData);
+        }
+
+        inline void Deallocate(SlabAllocator *allocator, uint32_t size) {
+            DeallocateArray(allocator, slots_, size, MemoryTag::kData);
+        }
+
+        inline void Assign(const KeyType *keys, const ValueType *values, uint32_t size) {
+            for (uint32_t i = 0; i < size; ++i) slots_[i] = Slot{keys[i], values[i]};
+        }
+
+        inline void Export(KeyType *keys, ValueType *values, uint32_t size) const {
+            for (uint32_t i = 0; i < size; ++i) {
+                keys[i] = slots_[i].key;
+                values[i] = slots_[i].value;
+            }
+        }
+
+        inline bool allocated() const { return slots_ != nullptr; }
+
+        inline Keys keys() const { return Keys(slots_); }
+
+        inline KeyType key(size_t i) const { return slots_[i].key; }
+
+        inline ValueType &value(size_t i) { return slots_[i].value; }
+
+        inline void PrefetchKey(size_t i) const { __builtin_prefetch(slots_ + i); }
+
+        // A slot may straddle two lines.
+        inline void PrefetchSlot(size_t i) const {
+            __builtin_prefetch(slots_ + i);
+            __builtin_prefetch(reinterpret_cast<const char *>(slots_ + i + 1) - 1);
+        }
+
+    private:
+        Slot *slots_ = nullptr;
+    };
+
+    template<typename KeyType, typename ValueType>
+    class SlotArray<KeyType, ValueType, SlotLayout::kBlocked> {
+        static const size_t kCacheLine = 64;
+        static const size_t kBlockKeys = std::max<size_t>(1, kCacheLine / (sizeof(KeyType) + sizeof(ValueType)));
+
+        struct alignas(kCacheLine) Block {
+            KeyType keys[kBlockKeys];
+            ValueType values[kBlockKeys];
+        };
+
+        static inline size_t NumBlocks(uint32_t size) {
+            return (size + kBlockKeys - 1) / kBlockKeys;
+        }
+
+    public:
+        class Keys {
+        public:
+            explicit Keys(const Block *blocks): blocks_(blocks) {}
+
+            inline const KeyType &operator[](size_t i) const { return blocks_[i / kBlockKeys].keys[i % kBlockKeys]; }
+
+            inline const void *Address(size_t i) const { return &(*this)[i]; }
+
+            // Runs the vector scan on the keys of each block in turn.
+            inline size_t LinearLowerBound(size_t begin, size_t n, KeyType key) const {
+                size_t count = 0;
+                while (count < n) {
+                    size_t i = begin + count, offset = i % kBlockKeys;
+                    size_t m = std::min(kBlockKeys - offset, n - count);
+                    size_t less = wahl::LinearLowerBound(blocks_[i / kBlockKeys].keys + offset, m, key);
+                    count += less;
+                    if (less < m) break;
+                }
+                return count;
+            }
+
+        private:
+            const Block *blocks_;
+        };
+
+        inline void Allocate(SlabAllocator *allocator, uint32_t size) {
+            blocks_ = AllocateArray<Block>(allocator, NumBlocks(size), MemoryTag::kData);
+        }
+
+        inline void Deallocate(SlabAllocator *allocator, uint32_t size) {
+            DeallocateArray(allocator, blocks_, NumBlocks(size), MemoryTag::kData);
+        }
+
+        inline void Assign(const KeyType *keys, const ValueType *values, uint32_t size) {
+            for (uint32_t i = 0; i < size; ++i) {
+                blocks_[i / kBlockKeys].keys[i % kBlockKeys] = keys[i];
+                blocks_[i / kBlockKeys].values[i % kBlockKeys] = values[i];
+            }
+        }
+
+        inline void Export(KeyType *keys, ValueType *values, uint32_t size) const {
+            for (uint32_t i = 0; i < size; ++i) {
+                keys[i] = blocks_[i / kBlockKeys].keys[i % kBlockKeys];
+                values[i] = blocks_[i / kBlockKeys].values[i % kBlockKeys];
+            }
+        }
+
+        inline bool allocated() const { return blocks_ != nullptr; }
+
+        inline Keys keys() const { return Keys(blocks_); }
+
+        inline KeyType key(size_t i) const { return blocks_[i / kBlockKeys].keys[i % kBlockKeys]; }
+
+        inline ValueType &value(size_t i) { return blocks_[i / kBlockKeys].values[i % kBlockKeys]; }
+
+        inline void PrefetchKey(size_t i) const { __builtin_prefetch(blocks_ + i / kBlockKeys); }
+
+        inline void PrefetchSlot(size_t i) const { __builtin_prefetch(blocks_ + i / kBlockKeys); }
+
+    private:
+        Block *blocks_ = nullptr;
+    };
+
+    // The buffers of the slots of a segment: a bit per slot tells whether the slot has one,
+    // and an open addressing table maps the slots that do to their buffer. Read-only segments
+    // allocate neither, and the rest pay for the buffers they have rather than a pointer per
+    // slot. Buffers are only ever added, and are freed with the table.
+    //
+    // Readers of a thread-safe index run concurrently with `Insert` and validate afterwards, so
+    // they must never follow a dangling pointer: an entry is complete before its bit is set,
+    // and with a concurrent allocator, tables outgrown by `Insert` are kept until `Clear`.
+    template<typename Buffer>
+    class SlotBuffers {
+        struct Entry {
+            uint32_t slot;
+            Buffer *buffer;  // null for free entries
+        };
+
+        struct Table {
+            Table *outgrown;
+            uint32_t capacity;  // a power of two
+            uint32_t size;
+
+            inline Entry *entries() { return reinterpret_cast<Entry *>(this + 1); }
+        };
+
+        static const uint32_t kMinCapacity = 8;
+
+    public:
+        inline Buffer *Find(size_t slot) const {
+            if (__glibc_likely(!Has(slot))) return nullptr;
+            Table *table = table_;
+            Entry *entries = table->entries();
+            for (uint32_t i = Hash(slot, table->capacity); entries[i].buffer; i = (i + 1) & (table->capacity - 1)) {
+                if (entries[i].slot == slot) return entries[i].buffer;
+            }
+            return nullptr;
+        }
+
+        // Step of a batched lookup: `PrefetchBit`, then `PrefetchEntry`, then `Find`.
+        inline void PrefetchBit(size_t slot) const {
+            if (bits_) __builtin_prefetch(bits_ + slot / 64);
+        }
+
+        inline void PrefetchEntry(size_t slot) const {
+            if (Has(slot)) __builtin_prefetch(table_->entries() + Hash(slot, table_->capacity));
+        }
+
+        // `slot`, out of `num_slots`, must not have a buffer yet.
+        void Insert(SlabAllocator *allocator, size_t slot, Buffer *buffer, size_t num_slots) {
+            if (bits_ == nullptr) {
+                bits_ = AllocateArray<uint64_t>(allocator, Words(num_slots), MemoryTag::kBuffer);
+                memset(bits_, 0, Words(num_slots) * sizeof(uint64_t));
+            }
+            // Grow at three quarters full.
+            if (table_ == nullptr || (table_->size + 1) * 4 > table_->capacity * 3) Grow(allocator);
+            Entry *entries = table_->entries();
+            uint32_t i = Hash(slot, table_->capacity);
+            while (entries[i].buffer) i = (i + 1) & (table_->capacity - 1);
+            entries[i].slot = slot;
+            std::atomic_thread_fence(std::memory_order_release);
+            entries[i].buffer = buffer;
+            table_->size += 1;
+            std::atomic_thread_fence(std::memory_order_release);
+            bits_[slot / 64] |= uint64_t(1) << (slot % 64);
+        }
+
+        // Calls `f(buffer)` for every buffer, in no particular order.
+        template<typename F>
+        inline void ForEach(F f) const {
+            if (table_ == nullptr) return;
+            Entry *entries = table_->entries();
+            for (uint32_t i = 0; i < table_->capacity; ++i) {
+                if (entries[i].buffer) f(entries[i].buffer);
+            }
+        }
+
+        // Number of slots with a buffer.
+        inline size_t size() const { return table_ ? table_->size : 0; }
+
+        // Frees the bits and tables, not the buffers.
+        void Clear(SlabAllocator *allocator, size_t num_slots) {
+            if (bits_) DeallocateArray(allocator, bits_, Words(num_slots), MemoryTag::kBuffer);
+            for (Table *table = table_, *next; table; table = next) {
+                next = table->outgrown;
+                DeallocateBytes(allocator, table, TableBytes(table->capacity), MemoryTag::kBuffer);
+            }
+            bits_ = nullptr;
+            table_ = nullptr;
+        }
+
+    private:
+        static inline size_t Words(size_t num_slots) {
+            return (num_slots + 63) / 64;
+        }
+
+        static inline size_t TableBytes(uint32_t capacity) {
+            return sizeof(Table) + capacity * sizeof(Entry);
+        }
+
+        // Fibonacci hashing: neighbouring slots, which fill up together, spread out.
+        static inline uint32_t Hash(size_t slot, uint32_t capacity) {
+            return static_cast<uint32_t>((slot * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+        }
+
+        inline bool Has(size_t slot) const {
+            return bits_ != nullptr && (bits_[slot / 64] >> (slot % 64) & 1);
+        }
+
+        void Grow(SlabAllocator *allocator) {
+            uint32_t capacity = table_ ? table_->capacity * 2 : kMinCapacity;
+            auto table = static_cast<Table *>(AllocateBytes(allocator, TableBytes(capacity), MemoryTag::kBuffer));
+            table->outgrown = nullptr;
+            table->capacity = capacity;
+            table->size = 0;
+            Entry *entries = table->entries();
+            memset(entries, 0, capacity * sizeof(Entry));
+            if (table_) {
+                Entry *old_entries = table_->entries();
+                for (uint32_t j = 0; j < table_->capacity; ++j) {
+                    if (old_entries[j].buffer == nullptr) continue;
+                    uint32_t i = Hash(old_entries[j].slot, capacity);
+                    while (entries[i].buffer) i = (i + 1) & (capacity - 1);
+                    entries[i] = old_entries[j];
+                    table->size += 1;
+                }
+                if (allocator && allocator->concurrent()) {
+                    table->outgrown = table_;
+                } else {
+                    DeallocateBytes(allocator, table_, TableBytes(table_->capacity), MemoryTag::kBuffer);
+                }
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            table_ = table;
+        }
+
+        uint64_t *bits_ = nullptr;
+        Table *table_ = nullptr;
+    };
+}
+
+#endif //ARTS_SLOT_ARRAY_H
@@ -0,0 +1,199 @@
+#ifndef ARTS_STATS_H
+#define ARTS_STATS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#ifdef WAHL_STATS
+#include <atomic>
+#include <mutex>
+#include "concurrency.h"
+#endif
+
+namespace wahl {
+
+    // Internal events of the index, counted only when built with `WAHL_STATS` (the cmake
+    // option of the same name). Otherwise every `CountStat` compiles to nothing.
+    enum class StatCounter : uint8_t {
+        kRetrains,              // segment runs rebuilt by `Retrain` or the background worker
+        kRetrainKeys,           // keys those rebuilds sorted and copied
+        kOverflowTransforms,    // global overflow buffers turned into segments
+        kOverflowTransformKeys, // keys those transforms sorted and copied
+        kSegmentsBuilt,         // segments created by loads, rebuilds and transforms
+        kBuildBytes,            // key and value bytes copied into their arrays
+        kSegmentFinds,          // `Segment::Find` calls
+        kArrayHits,             // of which found the key in the array
+        kBufferFinds,           // slot and overflow buffer lookups
+        kListFinds,             // `MFList::Find` calls
+        kListProbes,            // list nodes they compared
+        kListMoveFronts,        // hits moved to the front of their list
+        kTreeLookups,           // ART lower bound lookups
+        kTreeDepth,             // nodes on the paths of those lookups
+        kSegmentCacheHits,      // `Find`s routed by the thread's segment cache
+        kSegmentCacheMisses,    // `Find`s that fell back to the directory
+        kNumCounters
+    };
+
+#ifdef WAHL_STATS
+    static constexpr bool kStatsEnabled = true;
+#else
+    static constexpr bool kStatsEnabled = false;
+#endif
+
+    // Counts of values by power of two: bucket 0 holds 0, bucket `i` holds [2^(i-1), 2^i).
+    class Log2Histogram {
+    public:
+        inline void Add(uint64_t value) {
+            ++counts_[value == 0 ? 0 : 64 - __builtin_clzll(value)];
+        }
+
+        // Non-empty buckets by lower bound, e.g. " 0:12 1:3 8:40 16:97".
+        std::string ToString() const {
+            std::ostringstream out;
+            for (int i = 0; i <= 64; ++i) {
+                if (counts_[i]) out << " " << (i == 0 ? 0 : uint64_t(1) << (i - 1)) << ":" << counts_[i];
+            }
+            return out.str();
+        }
+
+    private:
+        uint64_t counts_[65] = {};
+    };
+
+    // Totals of the `StatCounter`s over all threads and indexes, see `GetStats`.
+    struct StatsSnapshot {
+        static constexpr size_t kMaxTreeDepth = 16;
+
+        uint64_t counters[static_cast<size_t>(StatCounter::kNumCounters)] = {};
+        // ART lookups by the number of nodes on their path, the last entry collects the rest.
+        uint64_t tree_depths[kMaxTreeDepth + 1] = {};
+
+        inline uint64_t operator[](StatCounter counter) const {
+            return counters[static_cast<size_t>(counter)];
+        }
+
+        StatsSnapshot &operator-=(const StatsSnapshot &other) {
+            for (size_t i = 0; i < static_cast<size_t>(StatCounter::kNumCounters); ++i) counters[i] -= other.counters[i];
+            for (size_t i = 0; i <= kMaxTreeDepth; ++i) tree_depths[i] -= other.tree_depths[i];
+            return *this;
+        }
+
+        // Benchmark output columns, e.g. " retrains:12 ... avg_tree_depth:4.2 tree_depths:3:10,4:90".
+        std::string ToString() const {
+            static const char *const kNames[] = {
+                    "retrains", "retrain_keys", "overflow_transforms", "overflow_transform_keys",
+                    "segments_built", "build_bytes", "segment_finds", "array_hits", "buffer_finds",
+                    "list_finds", "list_probes", "list_move_fronts", "tree_lookups", "tree_depth",
+                    "segment_cache_hits", "segment_cache_misses"};
+            static_assert(sizeof(kNames) / sizeof(kNames[0]) == static_cast<size_t>(StatCounter::kNumCounters),
+                          "a name per counter");
+            std::ostringstream out;
+            for (size_t i = 0; i < static_cast<size_t>(StatCounter::kNumCounters); ++i) {
+                out << " " << kNames[i] << ":" << counters[i];
+            }
+            out << " avg_list_probes:" << Ratio(StatCounter::kListProbes, StatCounter::kListFinds)
+                << " avg_tree_depth:" << Ratio(StatCounter::kTreeDepth, StatCounter::kTreeLookups)
+                << " tree_depths:";
+            const char *separator = "";
+            for (size_t i = 0; i <= kMaxTreeDepth; ++i) {
+                if (tree_depths[i] == 0) continue;
+                out << separator << i << ":" << tree_depths[i];
+                separator = ",";
+            }
+            return out.str();
+        }
+
+    private:
+        inline double Ratio(StatCounter num, StatCounter den) const {
+            return (*this)[den] ? static_cast<double>((*this)[num]) / (*this)[den] : 0.0;
+        }
+    };
+
+#ifdef WAHL_STATS
+    namespace stats_internal {
+
+        // The counters of one thread. Only the thread owning the `ThreadRegistry` id adds to
+        // them, so a relaxed load and store suffice, and readers see torn-free values.
+        struct alignas(64) Block {
+            std::atomic<uint64_t> counters[static_cast<size_t>(StatCounter::kNumCounters)];
+            std::atomic<uint64_t> tree_depths[StatsSnapshot::kMaxTreeDepth + 1];
+        };
+
+        // Never cleared: a thread that reuses the id of a finished one keeps adding to its
+        // counts, so the totals survive the threads.
+        inline Block *blocks() {
+            static Block blocks[ThreadRegistry::kMaxThreads];
+            return blocks;
+        }
+
+        inline std::mutex &baseline_mutex() {
+            static std::mutex m;
+            return m;
+        }
+
+        inline StatsSnapshot &baseline() {
+            static StatsSnapshot snapshot;
+            return snapshot;
+        }
+
+        static inline void Add(std::atomic<uint64_t> &counter, uint64_t n) {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        static StatsSnapshot Sum() {
+            StatsSnapshot sum;
+            for (uint32_t t = 0; t < ThreadRegistry::kMaxThreads; ++t) {
+                const Block &block = blocks()[t];
+                for (size_t i = 0; i < static_cast<size_t>(StatCounter::kNumCounters); ++i) {
+                    sum.counters[i] += block.counters[i].load(std::memory_order_relaxed);
+                }
+                for (size_t i = 0; i <= StatsSnapshot::kMaxTreeDepth; ++i) {
+                    sum.tree_depths[i] += block.tree_depths[i].load(std::memory_order_relaxed);
+                }
+            }
+            return sum;
+        }
+    }
+#endif
+
+    static inline void CountStat([[maybe_unused]] StatCounter counter, [[maybe_unused]] uint64_t n = 1) {
+#ifdef WAHL_STATS
+        stats_internal::Add(stats_internal::blocks()[ThreadRegistry::ThreadId()].counters[static_cast<size_t>(counter)], n);
+#endif
+    }
+
+    // An ART lookup whose path had `depth` nodes.
+    static inline void CountTreeLookup([[maybe_unused]] size_t depth) {
+#ifdef WAHL_STATS
+        stats_internal::Block &block = stats_internal::blocks()[ThreadRegistry::ThreadId()];
+        stats_internal::Add(block.counters[static_cast<size_t>(StatCounter::kTreeLookups)], 1);
+        stats_internal::Add(block.counters[static_cast<size_t>(StatCounter::kTreeDepth)], depth);
+        stats_internal::Add(block.tree_depths[std::min(depth, StatsSnapshot::kMaxTreeDepth)], 1);
+#endif
+    }
+
+    // Counts since the last `ResetStats`, all zero without `WAHL_STATS`. Counts are process
+    // wide, every index adds to the same totals. Counts of threads still running may lag.
+    static inline StatsSnapshot GetStats() {
+        StatsSnapshot snapshot;
+#ifdef WAHL_STATS
+        snapshot = stats_internal::Sum();
+        std::lock_guard<std::mutex> guard(stats_internal::baseline_mutex());
+        snapshot -= stats_internal::baseline();
+#endif
+        return snapshot;
+    }
+
+    // Starts the counts of `GetStats` over, e.g. once the index is loaded.
+    static inline void ResetStats() {
+#ifdef WAHL_STATS
+        StatsSnapshot sum = stats_internal::Sum();
+        std::lock_guard<std::mutex> guard(stats_internal::baseline_mutex());
+        stats_internal::baseline() = sum;
+#endif
+    }
+}
+
+#endif //ARTS_STATS_H
@@ -0,0 +1,234 @@
+#ifndef ARTS_TUNER_H
+#define ARTS_TUNER_H
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "allocator.h"
+#include "builder.h"
+#include "common.h"
+#include "search.h"
+
+namespace wahl {
+
+    // What `ParameterTuner` optimizes for. With neither field set, the candidate with the
+    // lowest estimated lookup time wins.
+    struct TuningGoal {
+        // Bytes the segment headers and the directory may take, as counted by
+        // `WahlIndex::GetSizeInByte`. 0 for no limit.
+        size_t memory_budget = 0;
+        // Mean lookup time to reach, in the units of the estimates: they leave out what every
+        // candidate pays alike (segment header, model, value), so they run below a measured
+        // `Find`. The smallest candidate that reaches it wins, which takes precedence over
+        // `memory_budget`. 0 for none.
+        double lookup_ns = 0;
+    };
+
+    // The parameters picked by `ParameterTuner`, with the estimates they were picked by.
+    struct TuningResult {
+        size_t max_error;
+        size_t overflow_threshold;
+        size_t num_seg;
+        size_t memory_bytes;
+        double lookup_ns;
+        // True if no candidate met the goal, the closest one was taken.
+        bool goal_missed;
+    };
+
+    // Picks the `max_error` (and `overflow_threshold`) of a `WahlIndex` for a sorted key set
+    // before it is bulk loaded, instead of sweeping the error offline.
+    //
+    // For every candidate error, the `Builder` runs on a sample of the keys: up to
+    // `kSampleBlocks` blocks spread evenly over all of them, each of `kBlockKeys` keys taken at a
+    // stride that grows with the error, with the error scaled down by the stride. That keeps every sample the same size
+    // and its corridors about as long, relative to the block, as the full ones. The sample
+    // gives the number of segments and their measured errors, which bound the search windows.
+    //
+    // The cost model is calibrated on the running machine and the actual keys: a lookup costs a
+    // directory lookup among that many segments, timed on a `DirectoryType` of the same size
+    // (up to `kMaxCalibrationEntries`, scaled with the tree height beyond), plus a window search
+    // of the measured width, timed on random windows of `keys`. Memory is the segment headers
+    // plus the directory bytes per entry seen in the calibration.
+    template<typename KeyType, typename SegmentType, template<typename> class DirectoryType>
+    class ParameterTuner {
+        static const size_t kMinError = 4;
+        static const size_t kMaxError = 4096;
+        // Error of the sampled corridors once the stride kicks in.
+        static const size_t kSampleError = 8;
+        static const size_t kSampleBlocks = 64;
+        static const size_t kBlockKeys = 4096;
+        static const size_t kMaxCalibrationEntries = 1 << 20;
+        static const size_t kProbes = 1 << 15;
+
+    public:
+        // The estimates for one candidate error.
+        struct Candidate {
+            size_t max_error;
+            size_t num_seg;
+            double mean_segment_keys;
+            double mean_window;
+            size_t memory_bytes;
+            double lookup_ns;
+        };
+
+        // `keys` must be sorted and outlive the tuner.
+        explicit ParameterTuner(const std::vector<KeyType> &keys): keys_(keys) {}
+
+        TuningResult Tune(const TuningGoal &goal) {
+            assert(!keys_.empty());
+            candidates_.clear();
+            for (size_t error = kMinError; error <= kMaxError; error *= 2)
+                candidates_.push_back(Estimate(error));
+
+            const Candidate *best = nullptr;
+            bool goal_missed = false;
+            if (goal.lookup_ns > 0) {
+                for (const Candidate &c : candidates_)
+                    if (c.lookup_ns <= goal.lookup_ns && (!best || c.memory_bytes < best->memory_bytes)) best = &c;
+                if (!best) {
+                    best = Fastest();
+                    goal_missed = true;
+                }
+            } else if (goal.memory_budget > 0) {
+                for (const Candidate &c : candidates_)
+                    if (c.memory_bytes <= goal.memory_budget && (!best || c.lookup_ns < best->lookup_ns)) best = &c;
+                if (!best) {
+                    best = &*std::min_element(candidates_.begin(), candidates_.end(), [](const Candidate &a, const Candidate &b) {
+                        return a.memory_bytes < b.memory_bytes;
+                    });
+                    goal_missed = true;
+                }
+            } else {
+                best = Fastest();
+            }
+            // An empty index builds its first segments once the overflow buffer holds about one
+            // segment's worth of keys.
+            size_t overflow_threshold = std::max<size_t>(best->max_error, std::llround(best->mean_segment_keys));
+            return {best->max_error, overflow_threshold, best->num_seg, best->memory_bytes, best->lookup_ns, goal_missed};
+        }
+
+        // Every candidate of the last `Tune`, by increasing error.
+        const std::vector<Candidate> &candidates() const { return candidates_; }
+
+    private:
+        const Candidate *Fastest() const {
+            return &*std::min_element(candidates_.begin(), candidates_.end(), [](const Candidate &a, const Candidate &b) {
+                return a.lookup_ns < b.lookup_ns;
+            });
+        }
+
+        Candidate Estimate(size_t error) {
+            const size_t n = keys_.size();
+            const size_t stride = std::max<size_t>(1, error / kSampleError);
+            const size_t sample_error = std::max<size_t>(1, error / stride);
+            // Blocks may not overlap. Inputs that fit into one block are sampled as a whole.
+            const size_t block_span = kBlockKeys * stride;
+            const size_t num_blocks = std::clamp<size_t>(n / block_span, 1, kSampleBlocks);
+            const bool whole = n <= block_span;
+
+            // The last segment of a block is cut short by the block's end, so only the others
+            // count, unless no block holds more than one.
+            double segment_keys = 0, window_keys = 0, last_keys = 0;
+            size_t num_segments = 0, num_last = 0;
+            std::vector<KeyType> sample;
+            for (size_t b = 0; b < num_blocks; ++b) {
+                sample.clear();
+                for (size_t i = b * (n / num_blocks), end = std::min(n, i + block_span); i < end; i += stride)
+                    sample.push_back(keys_[i]);
+                Builder<KeyType> builder(sample.front(), sample.back(), sample_error);
+                for (KeyType key : sample) builder.AddKey(key);
+                builder.Finalize();
+                std::vector<SegmentMessage<KeyType>> messages = builder.get_segments_message();
+                for (size_t i = 0; i < messages.size(); ++i) {
+                    SegmentMessage<KeyType> &msg = messages[i];
+                    if (i + 1 == messages.size() && !whole) {
+                        last_keys += msg.size;
+                        ++num_last;
+                        continue;
+                    }
+                    SegmentType::MeasureError(sample.data() + msg.offset, msg);
+                    segment_keys += msg.size;
+                    // Lookups hit segments in proportion to their keys.
+                    window_keys += static_cast<double>(msg.size) * std::min<size_t>(msg.error * stride, error);
+                    ++num_segments;
+                }
+            }
+
+            Candidate c;
+            c.max_error = error;
+            c.mean_segment_keys = stride * (num_segments ? segment_keys / num_segments : last_keys / num_last);
+            c.mean_window = num_segments ? window_keys / segment_keys : error;
+            c.num_seg = std::max<size_t>(1, std::llround(n / c.mean_segment_keys));
+            double entry_bytes = 0;
+            c.lookup_ns = DirectoryLookupNs(c.num_seg, entry_bytes) + WindowSearchNs(c.mean_window);
+            c.memory_bytes = c.num_seg * (sizeof(SegmentType) + static_cast<size_t>(entry_bytes));
+            return c;
+        }
+
+        // Mean time of a lower bound lookup in a directory of `num_entries` evenly spaced keys,
+        // and the bytes it takes per entry.
+        double DirectoryLookupNs(size_t num_entries, double &entry_bytes) {
+            const size_t n = keys_.size();
+            const size_t m = std::min({num_entries, kMaxCalibrationEntries, n});
+            std::vector<KeyType> boundaries;
+            boundaries.reserve(m);
+            for (size_t i = 1; i <= m; ++i) boundaries.push_back(keys_[i * n / m - 1]);
+            boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+            std::vector<uintptr_t> values(boundaries.size());
+            for (size_t i = 0; i < values.size(); ++i) values[i] = i + 1;
+
+            // Destroyed after the directory, which leaves its nodes to the allocator.
+            SlabAllocator allocator;
+            DirectoryType<KeyType> directory;
+            directory.set_allocator(&allocator);
+            directory.BulkBuild(boundaries, values);
+            entry_bytes = static_cast<double>(directory.inner_node_bytes() + directory.leaf_bytes()) / boundaries.size();
+
+            std::mt19937_64 rng(num_entries);
+            std::vector<KeyType> probes(kProbes);
+            for (KeyType &key : probes) key = keys_[rng() % n];
+            uintptr_t sink = 0;
+            auto begin = std::chrono::steady_clock::now();
+            for (KeyType key : probes) sink += reinterpret_cast<uintptr_t>(directory.LowerBound(key));
+            auto end = std::chrono::steady_clock::now();
+            sink_ += sink;
+
+            double ns = std::chrono::duration<double, std::nano>(end - begin).count() / kProbes;
+            // Beyond the calibrated size, the lookup grows with the height of the tree.
+            if (boundaries.size() < num_entries && boundaries.size() > 1)
+                ns *= std::log2(static_cast<double>(num_entries)) / std::log2(static_cast<double>(boundaries.size()));
+            return ns;
+        }
+
+        // Mean time of a window search `window` keys to either side of a random key of `keys_`,
+        // like `Segment::SearchArray` below its model estimate.
+        double WindowSearchNs(double window) {
+            const size_t n = keys_.size();
+            const size_t half = static_cast<size_t>(window);
+            std::mt19937_64 rng(half);
+            std::vector<size_t> positions(kProbes);
+            for (size_t &pos : positions) pos = rng() % n;
+            size_t sink = 0;
+            auto begin = std::chrono::steady_clock::now();
+            for (size_t pos : positions) {
+                size_t lo = pos > half ? pos - half : 0, hi = std::min(n, pos + half + 1);
+                sink += LowerBoundInWindow<const KeyType *>(keys_.data(), lo, hi, keys_[pos]);
+            }
+            auto end = std::chrono::steady_clock::now();
+            sink_ += sink;
+            return std::chrono::duration<double, std::nano>(end - begin).count() / kProbes;
+        }
+
+        const std::vector<KeyType> &keys_;
+        std::vector<Candidate> candidates_;
+        // Keeps the timed lookups from being optimized away.
+        volatile size_t sink_ = 0;
+    };
+}
+
+#endif //ARTS_TUNER_H
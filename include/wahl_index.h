@@ -6,282 +6,1388 @@
 #define ART_TEST_ART_SPLINE_H
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "builder.h"
+#include "allocator.h"
 #include "art_tree.h"
+#include "learned_directory.h"
 #include "segment.h"
+#include "concurrency.h"
+#include "stats.h"
+#include "tuner.h"
 
 namespace wahl {
 
-    template<typename KeyType, typename ValueType>
+    // With `kThreadSafe`, any number of threads may call `Insert`, `Find` and `Range` concurrently.
+    // `Find`/`Range` never take a lock: they validate segment and tree node versions and restart
+    // on conflict. `Insert` only latches the target segment (or the global overflow buffer).
+    // Rebuilds are serialized among themselves and publish new segments before retiring the old
+    // ones, so readers keep using the old segment until the swap.
+    //
+    // `kArrayBuffer` selects the segment slot buffers and `kLayout` their array layout, see
+    // `Segment`.
+    //
+    // `DirectoryType` maps the last key of every segment to the segment: `ArtTree`, which
+    // absorbs rebuilds in place, or `LearnedDirectory` for read-mostly workloads. A directory
+    // provides `LowerBound`, `OptimisticLowerBound`, `LowerBoundGroup` (with `kMaxGroupSize`),
+    // `Lookup`, `BulkBuild`, `Remove`, the byte counts of `ArtTree`, and `set_allocator` and
+    // `set_epoch_manager`.
+    template<typename KeyType, typename ValueType, bool kThreadSafe = false, bool kArrayBuffer = false,
+             SlotLayout kLayout = SlotLayout::kSplit, template<typename> class DirectoryType = ArtTree>
     class WahlIndex {
+        static_assert(!(kThreadSafe && kArrayBuffer), "SortedArrayBuffer does not support concurrent readers");
+        typedef Segment<KeyType, ValueType, kArrayBuffer, kLayout> SegmentType;
+        typedef DirectoryType<KeyType> Directory;
+        typedef LoggedWrite<KeyType, ValueType> WriteEntry;
+        typedef typename SegmentType::WriteLog WriteLog;
     public:
 
         WahlIndex(size_t max_error = 32, size_t overflow_threshold = 1024)
                 : min_key_(std::numeric_limits<KeyType>::max()),
                   max_key_(std::numeric_limits<KeyType>::min()),
                   num_total_keys_(0),
+                  num_seg_array_keys_(0),
                   num_seg_(0),
                   overflow_threshold_(overflow_threshold),
-                  max_error_(max_error), segments_head_(nullptr), segments_tail_(nullptr) {
-            Segment<KeyType, ValueType>::segment_allocated_byte = 0;
+                  max_error_(max_error), allocator_(kThreadSafe), global_overflow_buffer_(&allocator_, MemoryTag::kOverflow),
+                  segments_head_(nullptr), segments_tail_(nullptr) {
+            tree_.set_allocator(&allocator_);
+            if (kThreadSafe) {
+                epoch_.reset(new EpochManager());
+                tree_.set_epoch_manager(epoch_.get());
+            }
         }
 
         WahlIndex(const WahlIndex&) = delete ;
         WahlIndex &operator=(const WahlIndex&) = delete ;
 
         ~WahlIndex() {
-            // todo free segments
-            // ...
-            auto cur_seg = segments_head_;
-            while  (cur_seg) {
-                auto next_seg = cur_seg->next_segment();
-                delete cur_seg;
-                cur_seg = next_seg;
-            }
-            Segment<KeyType, ValueType>::segment_allocated_byte = 0;
+            if (kThreadSafe) StopBackgroundRetrain();
+            // Segments, tree nodes and buffers are all released with `allocator_`. Retired
+            // segments may still point into the mappings, so they go first.
+            epoch_.reset();
+            if (mapped_file_) munmap(mapped_file_, mapped_file_size_);
         }
 
         // Keys must be sorted.
+        // Not thread-safe: must be called before the index is shared.
         void BulkLoad(const std::vector<KeyType> &keys, const std::vector<ValueType> &values) {
             assert(keys.size() > 0);
             assert(keys.size() == values.size());
 
             // Build WahlIndex.
             min_key_ = std::min(min_key_, keys.front());
-            max_key_ = std::max(max_key_, keys.back());
+            max_key_ = std::max(max_key_.load(), keys.back());
 
-            wahl::Builder<KeyType> asb(min_key_, max_key_, max_error_);
-            for (const auto& key : keys) {
-                asb.AddKey(key);
-            }
-            asb.Finalize();
+            std::vector<SegmentMessage<KeyType>> seg_message = BuildSegmentMessages(keys, max_error_);
+            SpliceSegments(seg_message, keys, values, nullptr, nullptr);
+            num_seg_ += seg_message.size();
+            num_total_keys_ = keys.size();
+            num_seg_array_keys_ = keys.size();
+//            tree_.print_node_msg();
+        }
 
-            auto &seg_message = asb.get_segments_message();
-            Segment<KeyType, ValueType> *pre_seg = nullptr;
-            for (const SegmentMessage<KeyType> & msg : seg_message) {
-                auto seg = new Segment<KeyType, ValueType>();
+        // `BulkLoad` with the `max_error` and `overflow_threshold` that `Tune` picks for `keys`.
+        // Not thread-safe: must be called before the index is shared.
+        TuningResult BulkLoad(const std::vector<KeyType> &keys, const std::vector<ValueType> &values, const TuningGoal &goal) {
+            TuningResult result = Tune(keys, goal);
+            BulkLoad(keys, values);
+            return result;
+        }
+
+        // Sets `max_error` and `overflow_threshold` to meet `goal` for the sorted `keys`, from the
+        // estimates of `ParameterTuner`, and returns them. The index must still be empty.
+        TuningResult Tune(const std::vector<KeyType> &keys, const TuningGoal &goal) {
+            assert(segments_head_ == nullptr);
+            TuningResult result = ParameterTuner<KeyType, SegmentType, DirectoryType>(keys).Tune(goal);
+            max_error_ = result.max_error;
+            overflow_threshold_ = result.overflow_threshold;
+            return result;
+        }
+
+        // `BulkLoad` from sorted (key, value) pairs that are read once, front to back, so
+        // `[first, last)` may come from a file reader. Each segment is filled as soon as the
+        // `Builder` closes it, only the keys of the open segment are held on the side. Runs on
+        // one thread.
+        // Not thread-safe: must be called before the index is shared.
+        template<typename InputIterator>
+        void BulkLoad(InputIterator first, InputIterator last) {
+            Builder<KeyType> builder(max_error_);
+            // Pairs of the open segment, from position `base` on.
+            std::vector<KeyType> keys;
+            std::vector<ValueType> values;
+            size_t base = 0, num_messages = 0, num_keys = 0;
+            std::vector<KeyType> tree_keys;
+            std::vector<uintptr_t> tree_values;
+            SegmentType *pre_seg = nullptr;
+            assert(segments_head_ == nullptr);
+
+            auto flush = [&](SegmentMessage<KeyType> msg) {
+                assert(msg.offset == base && msg.size <= keys.size());
+                msg.offset = 0;
+                msg.max_error = max_error_;
+                SegmentType::MeasureError(keys.data(), msg);
+                auto seg = CreateObject<SegmentType>(&allocator_, MemoryTag::kSegment, &allocator_);
                 seg->AddKV(msg, keys, values);
-                seg->set_pre_segment(pre_seg);
                 seg->set_slope(msg.slope);
-//                seg->set_full(msg.full);
+                seg->set_pre_segment(pre_seg);
                 if (pre_seg) pre_seg->set_next_segment(seg);
                 else segments_head_ = seg;
                 pre_seg = seg;
-                tree_.Insert(msg.key, reinterpret_cast<uintptr_t>(seg));
+                tree_keys.push_back(seg->back());
+                tree_values.push_back(reinterpret_cast<uintptr_t>(seg));
+
+                keys.erase(keys.begin(), keys.begin() + msg.size);
+                values.erase(values.begin(), values.begin() + msg.size);
+                base += msg.size;
+                // Don't hold on to the space of an unusually long segment.
+                if (keys.capacity() > kMinKeysPerChunk && keys.size() * 4 < keys.capacity()) {
+                    keys.shrink_to_fit();
+                    values.shrink_to_fit();
+                }
+            };
+
+            for (; first != last; ++first) {
+                const auto &kv = *first;
+                assert(num_keys == 0 || keys.empty() || kv.first >= keys.back());
+                if (num_keys == 0) min_key_ = std::min(min_key_, static_cast<KeyType>(kv.first));
+                builder.AddKey(kv.first);
+                keys.push_back(kv.first);
+                values.push_back(kv.second);
+                ++num_keys;
+                const auto &messages = builder.get_segments_message();
+                while (num_messages < messages.size()) flush(messages[num_messages++]);
             }
+            if (num_keys == 0) return;
+            KeyType last_key = keys.back();
+            builder.Finalize();
+            const auto &messages = builder.get_segments_message();
+            while (num_messages < messages.size()) flush(messages[num_messages++]);
+            assert(keys.empty());
+
             segments_tail_ = pre_seg;
-            num_seg_ += seg_message.size();
-            num_total_keys_ = keys.size();
-            num_seg_array_keys_ = keys.size();
-//            tree_.print_node_msg();
+            tree_.BulkBuild(tree_keys, tree_values);
+            max_key_ = std::max(max_key_.load(), last_key);
+            num_seg_ += tree_keys.size();
+            num_total_keys_ = num_keys;
+            num_seg_array_keys_ = num_keys;
+            CountStat(StatCounter::kSegmentsBuilt, tree_keys.size());
+            CountStat(StatCounter::kBuildBytes, num_keys * (sizeof(KeyType) + sizeof(ValueType)));
+        }
+
+        // Writes all live keys to `path` in the format `Load` maps. Segments without buffered
+        // or deleted keys are written with their models, the others are rebuilt first.
+        // No writer (including the background retrain worker) may run concurrently.
+        bool Save(const std::string &path) {
+            size_t num_keys = num_global_overflow_keys_;
+            for (auto seg = segments_head_.load(); seg; seg = seg->next_segment()) {
+                num_keys += seg->GetLiveKvNum();
+            }
+
+            FileHeader header;
+            header.magic = kFileMagic;
+            header.key_size = sizeof(KeyType);
+            header.value_size = sizeof(ValueType);
+            header.max_error = max_error_;
+            header.num_keys = num_keys;
+            header.keys_offset = AlignFileOffset(sizeof(FileHeader));
+            header.values_offset = AlignFileOffset(header.keys_offset + num_keys * sizeof(KeyType));
+            header.segments_offset = AlignFileOffset(header.values_offset + num_keys * sizeof(ValueType));
+
+            int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) return false;
+            if (ftruncate(fd, header.segments_offset) != 0) {
+                close(fd);
+                return false;
+            }
+            void *base = mmap(nullptr, header.segments_offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (base == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+            auto keys = reinterpret_cast<KeyType *>(static_cast<char *>(base) + header.keys_offset);
+            auto values = reinterpret_cast<ValueType *>(static_cast<char *>(base) + header.values_offset);
+
+            std::vector<SegmentMessage<KeyType>> directory;
+            size_t num_written = 0;
+            auto append = [&](const std::vector<KeyType> &run_keys, const std::vector<ValueType> &run_values,
+                              size_t error) {
+                if (run_keys.empty() || num_written + run_keys.size() > num_keys) return;
+                for (SegmentMessage<KeyType> msg : BuildSegmentMessages(run_keys, error)) {
+                    msg.offset += num_written;
+                    directory.push_back(msg);
+                }
+                memcpy(keys + num_written, run_keys.data(), run_keys.size() * sizeof(KeyType));
+                memcpy(values + num_written, run_values.data(), run_values.size() * sizeof(ValueType));
+                num_written += run_keys.size();
+            };
+            for (auto seg = segments_head_.load(); seg; seg = seg->next_segment()) {
+                if (seg->IsCompact()) {
+                    size_t size = seg->array_size();
+                    if (num_written + size > num_keys) break;
+                    directory.push_back({seg->back(), num_written, static_cast<uint32_t>(size), seg->slope(),
+                                         seg->model_error(), seg->mean_error(), seg->max_error()});
+                    seg->ExportKV(keys + num_written, values + num_written);
+                    num_written += size;
+                } else {
+                    std::vector<KeyType> run_keys;
+                    std::vector<ValueType> run_values;
+                    seg->ToSortedData(run_keys, run_values);
+                    append(run_keys, run_values, seg->max_error());
+                }
+            }
+            if (!global_overflow_buffer_.Empty()) {
+                std::vector<KeyType> run_keys;
+                std::vector<ValueType> run_values;
+                global_overflow_buffer_.ToSortedData(run_keys, run_values);
+                append(run_keys, run_values, max_error_);
+            }
+            munmap(base, header.segments_offset);
+
+            header.num_segments = directory.size();
+            size_t directory_bytes = directory.size() * sizeof(SegmentMessage<KeyType>);
+            bool ok = num_written == num_keys &&
+                      pwrite(fd, directory.data(), directory_bytes, header.segments_offset) == ssize_t(directory_bytes) &&
+                      pwrite(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header));
+            ok = close(fd) == 0 && ok;
+            return ok;
+        }
+
+        // Maps a file written by `Save`. The keys and values are served from the mapping
+        // without copying, and only the segment headers and the tree are built, so the index
+        // answers its first lookup right away. Pages of the mapping are private: an update
+        // copies the touched page, inserts go to buffers as usual and a rebuilt segment owns
+        // its new arrays. The index must be empty and adopts the `max_error` of the file.
+        // Not thread-safe: must be called before the index is shared.
+        bool Load(const std::string &path) {
+            assert(segments_head_ == nullptr && mapped_file_ == nullptr);
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(FileHeader)) {
+                close(fd);
+                return false;
+            }
+            const size_t file_size = st.st_size;
+            void *base = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (base == MAP_FAILED) return false;
+            // The index stays untouched until the whole file checks out.
+            auto fail = [&] {
+                munmap(base, file_size);
+                return false;
+            };
+
+            const FileHeader &header = *static_cast<const FileHeader *>(base);
+            // Counts and offsets are bounded by the file first, so the sums and products below
+            // cannot wrap.
+            if (header.magic != kFileMagic || header.key_size != sizeof(KeyType) ||
+                header.value_size != sizeof(ValueType) ||
+                header.num_keys > file_size / (sizeof(KeyType) + sizeof(ValueType)) ||
+                header.num_segments > file_size / sizeof(SegmentMessage<KeyType>) ||
+                header.keys_offset > file_size || header.values_offset > file_size ||
+                header.segments_offset > file_size ||
+                header.keys_offset % alignof(KeyType) != 0 || header.values_offset % alignof(ValueType) != 0 ||
+                header.segments_offset % alignof(SegmentMessage<KeyType>) != 0 ||
+                header.values_offset < header.keys_offset + header.num_keys * sizeof(KeyType) ||
+                header.segments_offset < header.values_offset + header.num_keys * sizeof(ValueType) ||
+                header.segments_offset + header.num_segments * sizeof(SegmentMessage<KeyType>) > file_size ||
+                (header.num_keys == 0) != (header.num_segments == 0)) {
+                return fail();
+            }
+            // The segments must own every key exactly once.
+            auto directory = reinterpret_cast<const SegmentMessage<KeyType> *>(static_cast<char *>(base) + header.segments_offset);
+            size_t next_offset = 0;
+            for (size_t i = 0; i < header.num_segments; next_offset += directory[i++].size) {
+                if (directory[i].offset != next_offset || directory[i].size == 0 ||
+                    next_offset + directory[i].size > header.num_keys) return fail();
+            }
+            if (next_offset != header.num_keys) return fail();
+            mapped_file_ = base;
+            mapped_file_size_ = file_size;
+            mapped_array_bytes_ = header.num_keys * (sizeof(KeyType) + sizeof(ValueType));
+            max_error_ = header.max_error;
+            if (header.num_keys == 0) return true;
+
+            auto keys = reinterpret_cast<KeyType *>(static_cast<char *>(base) + header.keys_offset);
+            auto values = reinterpret_cast<ValueType *>(static_cast<char *>(base) + header.values_offset);
+
+            SegmentType *pre_seg = nullptr;
+            std::vector<KeyType> tree_keys(header.num_segments);
+            std::vector<uintptr_t> tree_values(header.num_segments);
+            for (size_t i = 0; i < header.num_segments; ++i) {
+                auto seg = CreateObject<SegmentType>(&allocator_, MemoryTag::kSegment, &allocator_);
+                seg->MapKV(directory[i], keys, values);
+                seg->set_slope(directory[i].slope);
+                seg->set_pre_segment(pre_seg);
+                if (pre_seg) pre_seg->set_next_segment(seg);
+                else segments_head_ = seg;
+                tree_keys[i] = seg->back();
+                tree_values[i] = reinterpret_cast<uintptr_t>(seg);
+                pre_seg = seg;
+            }
+            segments_tail_ = pre_seg;
+            tree_.BulkBuild(tree_keys, tree_values);
+
+            min_key_ = keys[0];
+            max_key_ = keys[header.num_keys - 1];
+            num_seg_ = header.num_segments;
+            num_total_keys_ = header.num_keys;
+            num_seg_array_keys_ = header.num_keys;
+            return true;
         }
 
         inline void Insert(KeyType key, ValueType value) {
-            num_total_keys_ += 1;
+            if (kThreadSafe) {
+                num_total_keys_.fetch_add(1, std::memory_order_relaxed);
+                ConcurrentWrite({key, value, WriteEntry::INSERT});
+                return;
+            }
+            num_total_keys_.store(num_total_keys_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
             if (segments_head_ == nullptr || key > max_key_) {
                 global_overflow_buffer_.ReuseInsert(key, value );
                 num_global_overflow_keys_ += 1;
-                if ((num_seg_ == 0 && num_total_keys_ > overflow_threshold_) || ( num_seg_ && num_global_overflow_keys_ > num_seg_array_keys_ / num_seg_ )) {
+                if (IsOverflowFull()) {
 //                    std::cout << "transform " << num_global_overflow_keys_ << std::endl;
                     TransformOverflowToSegment();
                 }
                 return;
             }
             auto seg = GetSplineSegment(key);
-            seg->Insert(key, value, max_error_);
+            seg->Insert(key, value);
 
-            if (seg->IsRetain(num_seg_array_keys_ / num_seg_)) {
+            if (seg->IsRetain(AvgSegmentKeys())) {
 //                std::cout << "retain " << num_seg_array_keys_ << " " << num_seg_ << " " <<  num_seg_array_keys_ / num_seg_ << std::endl;
                 Retrain(seg);
             }
         }
 
+        // Returns false if `key` does not exist.
+        bool Update(KeyType key, ValueType value) {
+            return Write({key, value, WriteEntry::UPDATE});
+        }
+
+        // Returns false if `key` does not exist. A key inserted several times loses one entry.
+        // Deleted array keys stay behind as tombstones until their segment is rebuilt, which
+        // happens as soon as they make up more than half of it.
+        bool Erase(KeyType key) {
+            if (!Write({key, ValueType(), WriteEntry::ERASE})) return false;
+            num_total_keys_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
         bool Find(KeyType key, ValueType& value) {
+            if (kThreadSafe) {
+                return ConcurrentFind(key, value);
+            }
             if (__glibc_unlikely(segments_head_ == nullptr || key > max_key_)){
                 return global_overflow_buffer_.Find(key, value);
             }
-            return GetSplineSegment(key)->Find(key, max_error_, value);
+            SegmentType *seg = FindSegment(key);
+            SampleAccess(seg);
+            return seg->Find(key, value);
+        }
+
+        // Looks up `num_keys` keys: `found[i]` tells whether `keys[i]` exists and `values[i]` holds
+        // its value. Keys are resolved in groups, stage by stage (directory, segment, model slot,
+        // slot buffer), prefetching what the next stage reads for every key of the group before
+        // it is used, so that the cache misses of independent lookups overlap.
+        void FindBatch(const KeyType *keys, size_t num_keys, ValueType *values, bool *found) {
+            if (kThreadSafe) {
+                // Optimistic lookups restart individually, so they are not interleaved.
+                for (size_t i = 0; i < num_keys; ++i) found[i] = Find(keys[i], values[i]);
+                return;
+            }
+            for (size_t begin = 0; begin < num_keys; begin += Directory::kMaxGroupSize) {
+                size_t group_size = std::min(num_keys - begin, Directory::kMaxGroupSize);
+                FindGroup(keys + begin, group_size, values + begin, found + begin);
+            }
         }
 
         void Range(KeyType start_key, KeyType end_key, std::vector<std::pair<KeyType, ValueType>> &kvs) {
+            if (kThreadSafe) {
+                ConcurrentRange(start_key, end_key, kvs);
+                return;
+            }
             bool early_stop = false;
-            uint32_t sorted_num = 0;
             if (__glibc_unlikely(segments_head_ == nullptr || start_key > max_key_)) {
                 if (!global_overflow_buffer_.Empty())
-                    global_overflow_buffer_.Range(start_key, end_key, kvs, sorted_num);
+                    global_overflow_buffer_.Range(start_key, end_key, kvs);
                 return ;
             }
             auto seg = GetSplineSegment(start_key);
-            seg->Range(start_key, end_key, max_error_, kvs, early_stop);
+            seg->Range(start_key, end_key, kvs, early_stop);
             while (!early_stop && (seg = seg->next_segment())) {
-                seg->Range(start_key, end_key, max_error_, kvs, early_stop);
+                seg->Range(start_key, end_key, kvs, early_stop);
             }
             if (__glibc_unlikely(end_key > max_key_ && !global_overflow_buffer_.Empty())) {
-                global_overflow_buffer_.Range(start_key, end_key, kvs, sorted_num);
+                global_overflow_buffer_.Range(start_key, end_key, kvs);
             }
         }
 
-        // Returns the size in bytes.
+        // Thread-safe mode only. Moves `Retrain` off the inserting threads: a segment that trips
+        // `IsRetain` is queued and rebuilt by a worker thread, while inserts keep landing in its
+        // buffers until the new segments are swapped in.
+        void StartBackgroundRetrain() {
+            static_assert(kThreadSafe, "background retraining needs the thread-safe index");
+            std::lock_guard<std::mutex> guard(retrain_queue_mutex_);
+            if (retrain_worker_.joinable()) return;
+            stop_retrain_ = false;
+            retrain_worker_ = std::thread(&WahlIndex::RetrainWorker, this);
+        }
+
+        // Finishes the queued rebuilds and stops the worker. Later retrains run inline again.
+        void StopBackgroundRetrain() {
+            {
+                std::lock_guard<std::mutex> guard(retrain_queue_mutex_);
+                if (!retrain_worker_.joinable()) return;
+                stop_retrain_ = true;
+            }
+            retrain_queue_cv_.notify_one();
+            retrain_worker_.join();
+        }
+
+        // Returns the size in bytes of everything but the key and value arrays of the segments.
         size_t GetSizeInByte() const {
-            return sizeof(*this) +  tree_.size() + Segment<KeyType, ValueType>::segment_allocated_byte;
+            MemoryStats stats = GetMemoryStats();
+            return stats.Total() - stats.segment_array_bytes;
+        }
+
+        // Returns the bytes used by this index, broken down by component.
+        MemoryStats GetMemoryStats() const {
+            MemoryStats stats;
+            stats.index_bytes = sizeof(*this);
+            stats.inner_node_bytes = tree_.inner_node_bytes();
+            stats.leaf_bytes = tree_.leaf_bytes();
+            stats.segment_bytes = allocator_.allocated_bytes(MemoryTag::kSegment);
+            // The mapped key and value arrays count as segment arrays, only the rest of the file
+            // is overhead.
+            stats.segment_array_bytes = allocator_.allocated_bytes(MemoryTag::kData) + mapped_array_bytes_;
+            stats.slot_buffer_bytes = allocator_.allocated_bytes(MemoryTag::kBuffer);
+            stats.overflow_buffer_bytes = allocator_.allocated_bytes(MemoryTag::kOverflow);
+            stats.mapped_bytes = mapped_file_size_ - mapped_array_bytes_;
+            stats.reserved_bytes = allocator_.reserved_bytes();
+            return stats;
         }
 
         size_t num_seg() {
             return num_seg_;
         }
 
+        size_t max_error() const {
+            return max_error_;
+        }
+
+        size_t overflow_threshold() const {
+            return overflow_threshold_;
+        }
+
+        // Puts a direct-mapped cache of `entries` segments (rounded up to a power of two, 0
+        // turns it off) in front of the directory for `Find`. Every thread has its own. An
+        // entry maps the keys of a segment seen by a lookup, from the looked up key or the
+        // segment's first key up to its last one, so skewed lookups that keep hitting the same
+        // segments skip the tree. Keys pick their entry by the average key range of a segment
+        // at the time of the call, so call it once the index is loaded. Retiring any segment
+        // invalidates all entries. Hits and misses are counted as `kSegmentCacheHits` and
+        // `kSegmentCacheMisses`.
+        // Not thread-safe.
+        void EnableSegmentCache(size_t entries) {
+            size_t size = entries ? 1 : 0;
+            while (size < entries) size *= 2;
+            segment_cache_size_ = size;
+            segment_cache_shift_ = 0;
+            if (segments_head_ == nullptr) return;
+            KeyType span = (segments_tail_.load()->back() - segments_head_.load()->front()) / num_seg_;
+            while (segment_cache_shift_ + 1 < sizeof(KeyType) * 8 && (span >> (segment_cache_shift_ + 1)))
+                ++segment_cache_shift_;
+        }
+
+        // Workload-adaptive error bounds. Lookups are sampled per segment, and every rebuild
+        // (`Retrain`, the background worker, `AdaptSegmentErrors`) picks the bound of a run
+        // from the lookups per key it drew: `hot_error` if that is at least `kHotAccessRatio`
+        // times the average over the index, for shorter searches, `cold_error` if it is at
+        // most 1/`kHotAccessRatio` of it, for fewer segments and a smaller directory, and
+        // `max_error` otherwise. Searches use the bound a segment was built with. `hot_error`
+        // 0 turns it off, which is the default.
+        // Not thread-safe.
+        void EnableAdaptiveError(size_t hot_error, size_t cold_error) {
+            hot_error_ = hot_error;
+            cold_error_ = hot_error ? cold_error : 0;
+        }
+
+        // Adaptive error mode only. Rebuilds the segments whose bound no longer matches their
+        // share of the sampled lookups: each hot segment on its own, consecutive cold ones
+        // together, which merges them. Then halves all counts, so the bounds follow shifts of
+        // the workload. Does nothing until `kMinSamplesPerSegment` lookups per segment were
+        // sampled on average. Returns the number of rebuilt runs. In thread-safe mode it may
+        // run alongside readers and writers, and holds `rebuild_mutex_` throughout.
+        size_t AdaptSegmentErrors() {
+            if (hot_error_ == 0) return 0;
+            if (!kThreadSafe) return AdaptSegmentErrorsLocked();
+            EpochGuard guard(*epoch_);
+            std::lock_guard<std::mutex> rebuild_guard(rebuild_mutex_);
+            return AdaptSegmentErrorsLocked();
+        }
+
+        // Size of the directory that routes keys to segments.
+        size_t GetDirectorySizeInByte() const {
+            return tree_.size();
+        }
+
+        // The directory itself, for its own tuning knobs such as `ArtTree::set_radix_bits`.
+        // Not thread-safe.
+        Directory &directory() {
+            return tree_;
+        }
+
+        // Writes one line per segment property, each a `Log2Histogram` over all segments:
+        // array keys, buffered keys, slots with a buffer, tombstones, the model error and the
+        // error bound.
+        // No writer (including the background retrain worker) may run concurrently.
+        void DumpSegmentStats(std::ostream &out) {
+            Log2Histogram array_keys, buffered_keys, buffered_slots, tombstones, model_errors, error_bounds;
+            for (SegmentType *seg = segments_head_; seg; seg = seg->next_segment()) {
+                array_keys.Add(seg->array_size());
+                buffered_keys.Add(seg->GetTotalKvNum() - seg->array_size());
+                buffered_slots.Add(seg->buffers().size());
+                tombstones.Add(seg->num_tombstones());
+                model_errors.Add(seg->model_error());
+                error_bounds.Add(seg->max_error());
+            }
+            out << "segments:" << num_seg_ << " overflow_keys:" << num_global_overflow_keys_ << std::endl
+                << "array_keys:" << array_keys.ToString() << std::endl
+                << "buffered_keys:" << buffered_keys.ToString() << std::endl
+                << "buffered_slots:" << buffered_slots.ToString() << std::endl
+                << "tombstones:" << tombstones.ToString() << std::endl
+                << "model_error:" << model_errors.ToString() << std::endl
+                << "error_bound:" << error_bounds.ToString() << std::endl;
+        }
+
         // Returns the spline segment that contains the `key`:
-        Segment<KeyType, ValueType>* GetSplineSegment(const KeyType key) {
-            return reinterpret_cast<Segment<KeyType, ValueType>*>(tree_.LowerBound(key));
+        SegmentType* GetSplineSegment(const KeyType key) {
+            if (kThreadSafe)
+                return reinterpret_cast<SegmentType*>(tree_.OptimisticLowerBound(key));
+            return reinterpret_cast<SegmentType*>(tree_.LowerBound(key));
         }
 
     private:
 
-        void Retrain(Segment<KeyType, ValueType>* segment) {
+        struct SegmentCacheEntry {
+            KeyType first;
+            KeyType last;
+            SegmentType *segment;
+            uint64_t version;    // `route_version_` when the entry was filled, 0 if empty
+        };
+
+        struct SegmentCache {
+            uint64_t owner = 0;  // `id_` of the index the entries belong to
+            std::vector<SegmentCacheEntry> entries;
+        };
+
+        // The calling thread's segment cache. Indexes of the same type share it, it starts
+        // over whenever the thread turns to another one.
+        static SegmentCache &LocalSegmentCache() {
+            thread_local SegmentCache cache;
+            return cache;
+        }
+
+        // Tells indexes apart for `LocalSegmentCache`, also one that reuses the address of a
+        // destroyed index.
+        static uint64_t NextIndexId() {
+            static std::atomic<uint64_t> next_id{1};
+            return next_id.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // `GetSplineSegment` through the segment cache, if enabled. In thread-safe mode the
+        // caller is in an epoch: a segment retired after the version check stays readable.
+        SegmentType *FindSegment(KeyType key) {
+            if (segment_cache_size_ == 0) return GetSplineSegment(key);
+            SegmentCache &cache = LocalSegmentCache();
+            if (__glibc_unlikely(cache.owner != id_ || cache.entries.size() != segment_cache_size_)) {
+                cache.owner = id_;
+                cache.entries.assign(segment_cache_size_, SegmentCacheEntry{KeyType(), KeyType(), nullptr, 0});
+            }
+            const uint64_t version = route_version_.load();
+            SegmentCacheEntry &entry = cache.entries[(key >> segment_cache_shift_) & (segment_cache_size_ - 1)];
+            if (entry.version == version && entry.first <= key && key <= entry.last) {
+                CountStat(StatCounter::kSegmentCacheHits);
+                return entry.segment;
+            }
+            CountStat(StatCounter::kSegmentCacheMisses);
+            SegmentType *seg = GetSplineSegment(key);
+            // The directory routes every key between the previous segment's last key and
+            // `seg->back()` to `seg`, `key` included.
+            if (seg) entry = {std::min(key, seg->front()), seg->back(), seg, version};
+            return seg;
+        }
+
+        void FindGroup(const KeyType *keys, size_t num_keys, ValueType *values, bool *found) {
+            const size_t kGroupSize = Directory::kMaxGroupSize;
+            // Lookups still in flight: index into `keys`, segment and slot.
+            size_t index[kGroupSize], pos[kGroupSize];
+            KeyType tree_keys[kGroupSize];
+            void *routes[kGroupSize];
+            SegmentType *segs[kGroupSize];
+
+            size_t n = 0;
+            for (size_t i = 0; i < num_keys; ++i) {
+                if (__glibc_unlikely(segments_head_ == nullptr || keys[i] > max_key_)) {
+                    found[i] = global_overflow_buffer_.Find(keys[i], values[i]);
+                } else {
+                    index[n] = i;
+                    tree_keys[n++] = keys[i];
+                }
+            }
+
+            tree_.LowerBoundGroup(tree_keys, n, routes);
+            for (size_t j = 0; j < n; ++j) {
+                segs[j] = reinterpret_cast<SegmentType*>(routes[j]);
+                __builtin_prefetch(segs[j]);
+                SampleAccess(segs[j]);
+            }
+            for (size_t j = 0; j < n; ++j) segs[j]->PrefetchFirstKey();
+            for (size_t j = 0; j < n; ++j) segs[j]->PrefetchSlot(tree_keys[j]);
+
+            size_t m = 0;
+            for (size_t j = 0; j < n; ++j) {
+                size_t i = index[j];
+                found[i] = segs[j]->FindInArray(tree_keys[j], values[i], pos[j]);
+                if (found[i]) continue;
+                segs[j]->buffers().PrefetchBit(pos[j]);
+                index[m] = i, segs[m] = segs[j], pos[m] = pos[j];
+                ++m;
+            }
+            for (size_t j = 0; j < m; ++j) segs[j]->buffers().PrefetchEntry(pos[j]);
+            for (size_t j = 0; j < m; ++j) {
+                auto buffer = segs[j]->buffer(pos[j]);
+                if (buffer) __builtin_prefetch(buffer);
+            }
+            for (size_t j = 0; j < m; ++j) {
+                size_t i = index[j];
+                auto buffer = segs[j]->buffer(pos[j]);
+                found[i] = buffer != nullptr && buffer->Find(keys[i], values[i]);
+            }
+        }
+
+        inline bool IsOverflowFull() {
+            return (num_seg_ == 0 && num_total_keys_ > overflow_threshold_) || ( num_seg_ && num_global_overflow_keys_ > num_seg_array_keys_ / num_seg_ );
+        }
+
+        // `Update` and `Erase`, which never add keys and so never transform the overflow buffer.
+        bool Write(const WriteEntry &w) {
+            if (kThreadSafe) return ConcurrentWrite(w);
+            if (segments_head_ == nullptr || w.key > max_key_) {
+                return ApplyOverflowWrite(w);
+            }
+            auto seg = GetSplineSegment(w.key);
+            if (!ApplyWrite(seg, w)) return false;
+            if (NeedsRebuild(seg, w)) Retrain(seg);
+            return true;
+        }
+
+        inline bool ApplyWrite(SegmentType *seg, const WriteEntry &w) {
+            switch (w.op) {
+                case WriteEntry::INSERT:
+                    seg->Insert(w.key, w.value);
+                    return true;
+                case WriteEntry::UPDATE:
+                    return seg->Update(w.key, w.value);
+                case WriteEntry::ERASE:
+                    return seg->Erase(w.key);
+            }
+            return false;
+        }
+
+        inline bool ApplyOverflowWrite(const WriteEntry &w) {
+            switch (w.op) {
+                case WriteEntry::INSERT:
+                    global_overflow_buffer_.ReuseInsert(w.key, w.value);
+                    num_global_overflow_keys_ += 1;
+                    return true;
+                case WriteEntry::UPDATE:
+                    return global_overflow_buffer_.Update(w.key, w.value);
+                case WriteEntry::ERASE:
+                    if (!global_overflow_buffer_.Erase(w.key)) return false;
+                    num_global_overflow_keys_ -= 1;
+                    return true;
+            }
+            return false;
+        }
+
+        // Inserts grow a segment until `Retrain` splits it, deletes leave tombstones that
+        // `Retrain` compacts away.
+        inline bool NeedsRebuild(SegmentType *seg, const WriteEntry &w) {
+            switch (w.op) {
+                case WriteEntry::INSERT:
+                    return seg->IsRetain(AvgSegmentKeys());
+                case WriteEntry::ERASE:
+                    return seg->IsSparse();
+                default:
+                    return false;
+            }
+        }
+
+        bool ConcurrentWrite(const WriteEntry &w) {
+            EpochGuard guard(*epoch_);
+            while (true) {
+                if (segments_head_ == nullptr || w.key > max_key_) {
+                    std::unique_lock<std::mutex> overflow_latch(overflow_mutex_);
+                    // A rebuild may have moved the boundary while we waited.
+                    if (segments_head_ != nullptr && w.key <= max_key_) continue;
+                    overflow_lock_.WriteLock();
+                    bool done = ApplyOverflowWrite(w);
+                    overflow_lock_.WriteUnlock();
+                    if (w.op != WriteEntry::INSERT || !IsOverflowFull()) return done;
+                    overflow_latch.unlock();
+
+                    std::lock_guard<std::mutex> rebuild_guard(rebuild_mutex_);
+                    if (IsOverflowFull()) TransformOverflowToSegment();
+                    return done;
+                }
+
+                bool done = false;
+                if (TryConcurrentSegmentWrite(w, done)) return done;
+            }
+        }
+
+        // Returns false if the key has to be routed again.
+        bool TryConcurrentSegmentWrite(const WriteEntry &w, bool &done) {
+            auto seg = GetSplineSegment(w.key);
+            if (seg == nullptr) return false;
+            seg->latch().Lock();
+            if (seg->version_lock().IsObsolete()) {
+                // Replaced by a rebuild.
+                seg->latch().Unlock();
+                return false;
+            }
+            seg->version_lock().WriteLock();
+            done = ApplyWrite(seg, w);
+            seg->version_lock().WriteUnlock();
+            if (done && seg->retrain_log()) seg->retrain_log()->push_back(w);
+            bool retrain = done && !seg->retrain_pending() && NeedsRebuild(seg, w);
+            if (retrain && EnqueueRetrain(seg->back())) {
+                seg->set_retrain_pending(true);
+                retrain = false;
+            }
+            seg->latch().Unlock();
+
+            if (retrain) {
+                // Rebuilds take `rebuild_mutex_` before any segment latch.
+                std::lock_guard<std::mutex> rebuild_guard(rebuild_mutex_);
+                seg->latch().Lock();
+                if (seg->version_lock().IsObsolete()) {
+                    seg->latch().Unlock();
+                    return true;
+                }
+                Retrain(seg);
+            }
+            return true;
+        }
+
+        bool ConcurrentFind(KeyType key, ValueType& value) {
+            EpochGuard guard(*epoch_);
+            while (true) {
+                bool need_restart = false;
+                // Read the boundary after the overflow snapshot: a rebuild moves keys out of the
+                // buffer and advances `max_key_` under the same write lock.
+                uint64_t overflow_version = overflow_lock_.ReadLockOrRestart(need_restart);
+                if (segments_head_ == nullptr || key > max_key_) {
+                    bool found = global_overflow_buffer_.Find(key, value, false);
+                    overflow_lock_.ReadUnlockOrRestart(overflow_version, need_restart);
+                    if (need_restart) continue;
+                    return found;
+                }
+
+                auto seg = FindSegment(key);
+                if (seg == nullptr) continue;
+                uint64_t version = seg->version_lock().ReadLockOrRestart(need_restart);
+                if (need_restart) continue;
+                bool found = seg->Find(key, value, false);
+                seg->version_lock().ReadUnlockOrRestart(version, need_restart);
+                if (need_restart) continue;
+                SampleAccess(seg);
+                return found;
+            }
+        }
+
+        void ConcurrentRange(KeyType start_key, KeyType end_key, std::vector<std::pair<KeyType, ValueType>> &kvs) {
+            EpochGuard guard(*epoch_);
+            // Every key below `resume_key` has already been emitted.
+            KeyType resume_key = start_key;
+            while (resume_key < end_key) {
+                bool need_restart = false;
+                size_t num_emitted = kvs.size();
+                uint64_t overflow_version = overflow_lock_.ReadLockOrRestart(need_restart);
+                if (segments_head_ == nullptr || resume_key > max_key_) {
+                    if (!global_overflow_buffer_.Empty())
+                        global_overflow_buffer_.Range(resume_key, end_key, kvs);
+                    overflow_lock_.ReadUnlockOrRestart(overflow_version, need_restart);
+                    if (need_restart) {
+                        kvs.resize(num_emitted);
+                        continue;
+                    }
+                    return;
+                }
+
+                auto seg = GetSplineSegment(resume_key);
+                while (seg) {
+                    num_emitted = kvs.size();
+                    bool early_stop = false;
+                    uint64_t version = seg->version_lock().ReadLockOrRestart(need_restart);
+                    if (need_restart) break;
+                    seg->Range(resume_key, end_key, kvs, early_stop);
+                    KeyType back = seg->back();
+                    auto next_seg = seg->next_segment();
+                    seg->version_lock().ReadUnlockOrRestart(version, need_restart);
+                    if (need_restart) {
+                        kvs.resize(num_emitted);
+                        break;
+                    }
+                    if (early_stop || back == std::numeric_limits<KeyType>::max()) return;
+                    resume_key = back + 1;
+                    if (resume_key >= end_key) return;
+                    seg = next_seg;
+                }
+                // Either a conflict or the end of the segment list: route `resume_key` again,
+                // which also covers keys that a concurrent rebuild moved out of the overflow buffer.
+            }
+        }
+
+        // Segments are identified by their last key in the queue: the worker routes it again, so
+        // a segment that was replaced in the meantime is never touched.
+        // Returns false if no worker is running, the caller then retrains inline.
+        bool EnqueueRetrain(KeyType key) {
+            {
+                std::lock_guard<std::mutex> guard(retrain_queue_mutex_);
+                if (stop_retrain_) return false;
+                retrain_queue_.push_back(key);
+            }
+            retrain_queue_cv_.notify_one();
+            return true;
+        }
 
+        void RetrainWorker() {
+            std::unique_lock<std::mutex> lock(retrain_queue_mutex_);
+            while (true) {
+                retrain_queue_cv_.wait(lock, [this] { return stop_retrain_ || !retrain_queue_.empty(); });
+                if (retrain_queue_.empty()) return;
+                KeyType key = retrain_queue_.front();
+                retrain_queue_.pop_front();
+                lock.unlock();
+                BackgroundRetrain(key);
+                lock.lock();
+            }
+        }
+
+        // Like `Retrain`, but only holds the segment latch to snapshot the data and to swap in the
+        // new segments. Writes between the two are logged by `TryConcurrentSegmentWrite` and
+        // replayed into the new segments before they are published.
+        void BackgroundRetrain(KeyType key) {
+            EpochGuard guard(*epoch_);
+            std::vector<SegmentType *> run;
             std::vector<KeyType> keys;
             std::vector<ValueType> values;
+            size_t error;
+            WriteLog pending;
+            // One log per segment: writers of different segments append concurrently.
+            std::vector<WriteLog> logs;
+            {
+                // Taking the snapshot under `rebuild_mutex_` keeps the neighbours in place.
+                std::lock_guard<std::mutex> rebuild_guard(rebuild_mutex_);
+                SegmentType *segment = GetSplineSegment(key);
+                if (segment == nullptr) return;
+                segment->latch().Lock();
+                if (segment->version_lock().IsObsolete() || !segment->retrain_pending()) {
+                    // The queued segment was already replaced.
+                    segment->latch().Unlock();
+                    return;
+                }
+                run = CollectRun(segment);
+                if (!ToSortedData(run, keys, values)) {
+                    // Everything was deleted: nothing to build.
+                    for (auto seg : run) RemoveSegment(seg);
+                    return;
+                }
+                KeepUpperBound(run.back(), keys, values, pending);
+                error = RunError(run);
+                logs.resize(run.size());
+                for (size_t i = 0; i < run.size(); ++i) {
+                    run[i]->set_retrain_log(&logs[i]);
+                    run[i]->latch().Unlock();
+                }
+            }
 
-            Segment<KeyType, ValueType> *pre_seg = segment->pre_segment(), *next_seg = segment->next_segment();
-
-            size_t total_kv_num = segment->GetTotalKvNum();
-//            if (pre_seg  &&  !pre_seg->full()) {
-//                std::cout << pre_seg->back() << std::endl;
-//                total_kv_num += pre_seg->GetTotalKvNum();
-//            }
-//            // merge global overflow buffer.
-//            if (next_seg == nullptr) {
-//                total_kv_num += num_global_overflow_keys_;
-//            } else if (!next_seg->full()){
-//                total_kv_num += next_seg->GetTotalKvNum();
-//            }
-            keys.reserve(total_kv_num);
-            values.reserve(total_kv_num);
+            std::vector<SegmentMessage<KeyType>> seg_message = BuildSegmentMessages(keys, error);
 
-//            if (pre_seg && !pre_seg->full()) {
-//                pre_seg->ToSortedData(keys, values);
-//                tree_.Remove(pre_seg->back());
-//                auto del_seg = pre_seg;
-//                pre_seg = pre_seg->pre_segment();
-//                //delete del_seg;
-//            }
-            segment->ToSortedData(keys, values);
-            tree_.Remove(segment->back());
-            delete segment;
-//            if (next_seg == nullptr ) {
-//                if (!global_overflow_buffer_.Empty()) {
-//                    global_overflow_buffer_.ToSortedData(keys, values);
-//                    global_overflow_buffer_.Clear();
-//                    num_global_overflow_keys_ = 0;
-//                }
-//            } else if (!next_seg->full()){
-//                next_seg->ToSortedData(keys, values);
-//                tree_.Remove(next_seg->back());
-//                auto del_seg = next_seg;
-//                next_seg = next_seg->pre_segment();
-//            }
-
-            wahl::Builder<KeyType> asb(keys.front(), keys.back(), max_error_);
-            for (const auto& key : keys) {
-                asb.AddKey(key);
-            }
-            asb.Finalize();
-
-            auto &seg_message = asb.get_segments_message();
+            std::lock_guard<std::mutex> rebuild_guard(rebuild_mutex_);
+            bool obsolete = false;
+            for (auto seg : run) {
+                seg->latch().Lock();
+                seg->set_retrain_log(nullptr);
+                obsolete = obsolete || seg->version_lock().IsObsolete();
+            }
+            if (obsolete) {
+                // Part of the run was absorbed by `TransformOverflowToSegment`, together with the
+                // logged writes. The survivors can be queued again.
+                for (auto seg : run) {
+                    seg->set_retrain_pending(false);
+                    seg->latch().Unlock();
+                }
+                return;
+            }
+            std::vector<const WriteLog *> replay{&pending};
+            for (const WriteLog &log : logs) replay.push_back(&log);
+            ReplaceRun(run, seg_message, keys, values, replay);
+            CountStat(StatCounter::kRetrains);
+            CountStat(StatCounter::kRetrainKeys, keys.size());
+        }
 
-//            std::cout << keys.front() <<  "---------" << keys.back() << " " << keys.size() << " " << num_seg_ <<  std::endl;
+        // Creates segments for `seg_message` and splices them into the segment list between
+        // `pre_seg` and `next_seg`. The new run is fully linked before it becomes reachable, and
+        // the tree is updated last, so a tree entry never points to a half-built segment.
+        // `pending` entries are inserted into the new run before it is published. The new
+        // segments share the sampled `accesses` of the keys in proportion to their size.
+        void SpliceSegments(const std::vector<SegmentMessage<KeyType>> &seg_message,
+                            const std::vector<KeyType> &keys, const std::vector<ValueType> &values,
+                            SegmentType *pre_seg, SegmentType *next_seg,
+                            const std::vector<const WriteLog *> &pending = {}, uint64_t accesses = 0) {
+            std::vector<SegmentType *> run;
+            run.reserve(seg_message.size());
             for (const SegmentMessage<KeyType> & msg : seg_message) {
-                auto seg = new Segment<KeyType, ValueType>();
-                seg->AddKV(msg, keys, values);
-                seg->set_pre_segment(pre_seg);
+                auto seg = CreateObject<SegmentType>(&allocator_, MemoryTag::kSegment, &allocator_);
+                seg->AllocateArrays(msg.size);
+                seg->set_pre_segment(run.empty() ? pre_seg : run.back());
                 seg->set_slope(msg.slope);
 //                seg->set_full(msg.full);
-//                std::cout << msg.key << " " << seg_message.size() << " "  << msg.full << " " << msg.size << std::endl;
-                if (pre_seg) pre_seg->set_next_segment(seg);
-                else segments_head_ = seg;
-                pre_seg = seg;
-                tree_.Insert(msg.key, reinterpret_cast<uintptr_t>(seg));
+                if (!run.empty()) run.back()->set_next_segment(seg);
+                run.push_back(seg);
             }
-            pre_seg->set_next_segment(next_seg);
-            if (next_seg) next_seg->set_pre_segment(pre_seg);
-            else segments_tail_ = pre_seg;
-            num_seg_ += (seg_message.size() - 1);
+            SegmentType *first = run.front(), *last = run.back();
+            last->set_next_segment(next_seg);
+
+            // The new run is still private, and the copies are independent.
+            #pragma omp parallel for schedule(dynamic, 64) if (keys.size() >= 2 * kMinKeysPerChunk)
+            for (size_t i = 0; i < run.size(); ++i) {
+                run[i]->CopyKV(seg_message[i], keys, values);
+                if (accesses) run[i]->set_accesses(accesses * seg_message[i].size / keys.size());
+            }
+
+            for (const WriteLog *log : pending) {
+                for (const WriteEntry &w : *log) {
+                    auto it = std::lower_bound(run.begin(), run.end(), w.key,
+                                               [](SegmentType *seg, KeyType k) { return seg->back() < k; });
+                    assert(it != run.end());
+                    ApplyWrite(*it, w);
+                }
+            }
+
+            if (pre_seg) pre_seg->set_next_segment(first);
+            else segments_head_ = first;
+            if (next_seg) next_seg->set_pre_segment(last);
+            else segments_tail_ = last;
+
+            std::vector<KeyType> tree_keys(run.size());
+            std::vector<uintptr_t> tree_values(run.size());
+            for (size_t i = 0; i < run.size(); ++i) {
+                tree_keys[i] = run[i]->back();
+                tree_values[i] = reinterpret_cast<uintptr_t>(run[i]);
+            }
+            tree_.BulkBuild(tree_keys, tree_values);
+            CountStat(StatCounter::kSegmentsBuilt, run.size());
+            CountStat(StatCounter::kBuildBytes, keys.size() * (sizeof(KeyType) + sizeof(ValueType)));
+        }
+
+        // Replaces the consecutive segments `run` by the segments built from `keys`. In
+        // thread-safe mode the caller holds `rebuild_mutex_` and the latches of `run`.
+        void ReplaceRun(const std::vector<SegmentType *> &run,
+                        const std::vector<SegmentMessage<KeyType>> &seg_message,
+                        const std::vector<KeyType> &keys, const std::vector<ValueType> &values,
+                        const std::vector<const WriteLog *> &pending = {}) {
+            uint64_t accesses = 0;
+            for (auto seg : run) accesses += seg->accesses();
+            SpliceSegments(seg_message, keys, values, run.front()->pre_segment(), run.back()->next_segment(),
+                           pending, accesses);
+            // Back to front: a new segment may span several old ones, and the key range of a
+            // removed entry has to fall through to a new segment, not to a later old one that
+            // is still live but doesn't hold its keys.
+            for (auto it = run.rbegin(); it != run.rend(); ++it) {
+                SegmentType *seg = *it;
+                // A merged segment's last key may now sit inside a new segment.
+                if (tree_.Lookup(seg->back()) == seg) tree_.Remove(seg->back());
+                num_seg_array_keys_ -= seg->array_size();
+                RetireSegment(seg);
+            }
+            num_seg_ += (seg_message.size() - run.size());
             num_seg_array_keys_ += keys.size();
         }
 
-        void TransformOverflowToSegment() {
+        // Frees a segment that is no longer reachable from the tree or the segment list.
+        // In thread-safe mode the caller holds its latch.
+        void RetireSegment(SegmentType *segment) {
+            // Before the segment turns obsolete: a reader that restarts on it misses the cache.
+            route_version_.fetch_add(1);
+            if (kThreadSafe) {
+                segment->version_lock().WriteLock();
+                segment->version_lock().WriteUnlockObsolete();
+                segment->latch().Unlock();
+                epoch_->Retire(segment, &DestroyRetired<SegmentType, MemoryTag::kSegment>, &allocator_);
+            } else {
+                DestroyObject(&allocator_, segment, MemoryTag::kSegment);
+            }
+        }
 
-            std::vector<KeyType> keys;
-            std::vector<ValueType> values;
+        // Unlinks a segment whose keys were all deleted. In thread-safe mode the caller holds
+        // `rebuild_mutex_` and the segment latch.
+        void RemoveSegment(SegmentType *segment) {
+            SegmentType *pre_seg = segment->pre_segment(), *next_seg = segment->next_segment();
+            if (next_seg == nullptr) {
+                // Keys past the new tail belong to the global overflow buffer again.
+                if (kThreadSafe) overflow_lock_.WriteLock();
+                max_key_ = pre_seg ? pre_seg->back() : std::numeric_limits<KeyType>::min();
+                if (kThreadSafe) overflow_lock_.WriteUnlock();
+            }
+            if (pre_seg) pre_seg->set_next_segment(next_seg);
+            else segments_head_ = next_seg;
+            if (next_seg) next_seg->set_pre_segment(pre_seg);
+            else segments_tail_ = pre_seg;
+            tree_.Remove(segment->back());
+            num_seg_array_keys_ -= segment->array_size();
+            RetireSegment(segment);
+            num_seg_ -= 1;
+        }
 
-            size_t total_kv_num = num_global_overflow_keys_;
+        // Runs the `Builder` over `keys`, which must be sorted and not empty. Large inputs are
+        // cut into chunks, one per thread, that never split a run of equal keys. Each chunk gets
+        // its own corridor, so a chunk boundary always ends a segment: at most one extra segment
+        // per chunk, and every segment still honours `error`.
+        std::vector<SegmentMessage<KeyType>> BuildSegmentMessages(const std::vector<KeyType> &keys, size_t error) const {
+            size_t num_chunks = 1;
+#ifdef _OPENMP
+            num_chunks = std::max<size_t>(1, std::min<size_t>(omp_get_max_threads(), keys.size() / kMinKeysPerChunk));
+#endif
+            std::vector<size_t> chunk_begin(num_chunks + 1, keys.size());
+            chunk_begin[0] = 0;
+            for (size_t i = 1; i < num_chunks; ++i) {
+                size_t begin = std::max(chunk_begin[i - 1], keys.size() / num_chunks * i);
+                while (begin < keys.size() && begin > 0 && keys[begin] == keys[begin - 1]) ++begin;
+                chunk_begin[i] = begin;
+            }
 
-            Segment<KeyType, ValueType> *pre_seg = segments_tail_, *next_seg = nullptr;
+            std::vector<std::vector<SegmentMessage<KeyType>>> chunk_messages(num_chunks);
+            #pragma omp parallel for schedule(static, 1) if (num_chunks > 1)
+            for (size_t i = 0; i < num_chunks; ++i) {
+                size_t begin = chunk_begin[i], end = chunk_begin[i + 1];
+                if (begin == end) continue;
+                wahl::Builder<KeyType> asb(keys[begin], keys[end - 1], error);
+                for (size_t j = begin; j < end; ++j) {
+                    asb.AddKey(keys[j]);
+                }
+                asb.Finalize();
+                chunk_messages[i] = asb.get_segments_message();
+                for (auto &msg : chunk_messages[i]) {
+                    SegmentType::MeasureError(keys.data() + begin + msg.offset, msg);
+                    msg.offset += begin;
+                    msg.max_error = error;
+                }
+            }
 
-            if (segments_tail_ /* && !segments_tail_->full() */) {
-                total_kv_num += segments_tail_->GetTotalKvNum();
+            if (num_chunks == 1) return std::move(chunk_messages[0]);
+            std::vector<SegmentMessage<KeyType>> seg_message;
+            for (const auto &messages : chunk_messages) {
+                seg_message.insert(seg_message.end(), messages.begin(), messages.end());
             }
+            return seg_message;
+        }
+
+        // A rebuilt run has to end on the same key as the segment it replaces: the tree routes
+        // every key up to `segment->back()` to it. If that key was deleted, it is rebuilt anyway
+        // and deleted again through `pending` before the run is published.
+        void KeepUpperBound(SegmentType *segment, std::vector<KeyType> &keys, std::vector<ValueType> &values,
+                            WriteLog &pending) {
+            if (keys.back() == segment->back()) return;
+            keys.push_back(segment->back());
+            values.push_back(ValueType());
+            pending.push_back({segment->back(), ValueType(), WriteEntry::ERASE});
+        }
 
+        inline size_t AvgSegmentKeys() {
+            size_t num_seg = num_seg_;
+            return num_seg ? num_seg_array_keys_ / num_seg : 0;
+        }
+
+        // A neighbour holding less than half the average segment is rebuilt together with the
+        // segment next to it, otherwise deletes would only ever leave smaller segments behind.
+        // Whether the merged keys end up in one segment is up to the Builder corridor.
+        inline bool IsUnderfull(SegmentType *seg) {
+            return seg->GetLiveKvNum() * 2 < AvgSegmentKeys();
+        }
+
+        // Returns `segment` together with its underfull neighbours, in list order. In thread-safe
+        // mode the caller holds `rebuild_mutex_` and the segment latch, and the neighbours
+        // are returned latched.
+        std::vector<SegmentType *> CollectRun(SegmentType *segment, bool merge_next = true) {
+            std::vector<SegmentType *> run;
+            SegmentType *pre_seg = segment->pre_segment(), *next_seg = segment->next_segment();
+            if (pre_seg && LatchIfUnderfull(pre_seg)) run.push_back(pre_seg);
+            run.push_back(segment);
+            if (merge_next && next_seg && LatchIfUnderfull(next_seg)) run.push_back(next_seg);
+            return run;
+        }
+
+        inline bool LatchIfUnderfull(SegmentType *seg) {
+            if (kThreadSafe) seg->latch().Lock();
+            if (IsUnderfull(seg)) return true;
+            if (kThreadSafe) seg->latch().Unlock();
+            return false;
+        }
+
+        // Returns false if `run` holds no live keys.
+        bool ToSortedData(const std::vector<SegmentType *> &run, std::vector<KeyType> &keys,
+                          std::vector<ValueType> &values, size_t extra_kv_num = 0) {
+            size_t total_kv_num = extra_kv_num;
+            for (auto seg : run) total_kv_num += seg->GetTotalKvNum();
             keys.reserve(total_kv_num);
             values.reserve(total_kv_num);
+            for (auto seg : run) seg->ToSortedData(keys, values);
+            return !keys.empty();
+        }
 
-            if (segments_tail_ /* && !segments_tail_->full() */) {
-                segments_tail_->ToSortedData(keys, values);
-                tree_.Remove(segments_tail_->back());
-                pre_seg = segments_tail_->pre_segment();
-                delete segments_tail_;
-                num_seg_ -= 1;
+        // Rebuilds `segment` from its live keys, which also drops its tombstones. Underfull
+        // neighbours are merged into the rebuild.
+        void Retrain(SegmentType* segment) {
+            std::vector<SegmentType *> run = CollectRun(segment);
+            RebuildRun(run, RunError(run));
+        }
+
+        // Rebuilds the consecutive segments `run` from their live keys with the error bound
+        // `error`. In thread-safe mode the caller holds `rebuild_mutex_` and the latches of `run`.
+        void RebuildRun(const std::vector<SegmentType *> &run, size_t error) {
+            std::vector<KeyType> keys;
+            std::vector<ValueType> values;
+
+            if (!ToSortedData(run, keys, values)) {
+                for (auto seg : run) RemoveSegment(seg);
+                return;
             }
+            WriteLog pending;
+            KeepUpperBound(run.back(), keys, values, pending);
 
-            global_overflow_buffer_.ToSortedData(keys, values);
+            std::vector<SegmentMessage<KeyType>> seg_message = BuildSegmentMessages(keys, error);
+
+//            std::cout << keys.front() <<  "---------" << keys.back() << " " << keys.size() << " " << num_seg_ <<  std::endl;
+            // Buffered keys never exceed `run.back()->back()`, so the last new segment ends on the
+            // same key and its tree entry simply overwrites the old one.
+            ReplaceRun(run, seg_message, keys, values, {&pending});
+            CountStat(StatCounter::kRetrains);
+            CountStat(StatCounter::kRetrainKeys, keys.size());
+        }
 
-            wahl::Builder<KeyType> asb(keys.front(), keys.back(), max_error_);
-            for (const auto& key : keys) {
-                asb.AddKey(key);
+        void TransformOverflowToSegment() {
+
+            std::vector<KeyType> keys;
+            std::vector<ValueType> values;
+
+            SegmentType *old_tail = segments_tail_;
+
+            std::unique_lock<std::mutex> overflow_latch(overflow_mutex_, std::defer_lock);
+            std::vector<SegmentType *> run;
+            if (old_tail) {
+                // Lock order: rebuild mutex (held by the caller), segment latches, overflow latch.
+                if (kThreadSafe) old_tail->latch().Lock();
+                run = CollectRun(old_tail, false);
             }
-            asb.Finalize();
+            if (kThreadSafe) overflow_latch.lock();
 
-            auto &seg_message = asb.get_segments_message();
-            for (const SegmentMessage<KeyType> & msg : seg_message) {
-                auto seg = new Segment<KeyType, ValueType>();
-                seg->AddKV(msg, keys, values);
-                seg->set_pre_segment(pre_seg);
-                seg->set_slope(msg.slope);
-//                seg->set_full(msg.full);
-                if (pre_seg) pre_seg->set_next_segment(seg);
-                else segments_head_ = seg;
-                pre_seg = seg;
-                tree_.Insert(msg.key, reinterpret_cast<uintptr_t>(seg));
+            ToSortedData(run, keys, values, num_global_overflow_keys_);
+            global_overflow_buffer_.ToSortedData(keys, values);
+
+            std::vector<SegmentMessage<KeyType>> seg_message = BuildSegmentMessages(keys, RunError(run));
+            if (run.empty()) {
+                SpliceSegments(seg_message, keys, values, nullptr, nullptr);
+                num_seg_ += seg_message.size();
+                num_seg_array_keys_ += keys.size();
+            } else {
+                ReplaceRun(run, seg_message, keys, values);
             }
-            pre_seg->set_next_segment(next_seg);
-            if (next_seg) next_seg->set_pre_segment(pre_seg);
-            else segments_tail_ = pre_seg;
+
+            // Keys up to the new tail are now served by segments.
+            if (kThreadSafe) overflow_lock_.WriteLock();
+            max_key_ = std::max(max_key_.load(), keys.back());
             global_overflow_buffer_.Clear();
+            if (kThreadSafe) overflow_lock_.WriteUnlock();
             num_global_overflow_keys_ = 0;
-            num_seg_ += seg_message.size();
-            num_seg_array_keys_ += keys.size();
+            CountStat(StatCounter::kOverflowTransforms);
+            CountStat(StatCounter::kOverflowTransformKeys, keys.size());
+        }
+
+        // Adaptive error mode: counts every `kAccessSampleRate`th lookup of the calling thread
+        // against its segment. The count is only a hint, so a segment a concurrent rebuild
+        // just retired may take it.
+        inline void SampleAccess(SegmentType *seg) {
+            if (__glibc_likely(hot_error_ == 0)) return;
+            thread_local uint32_t countdown = kAccessSampleRate;
+            if (__glibc_likely(--countdown != 0)) return;
+            countdown = kAccessSampleRate;
+            seg->AddAccesses(kAccessSampleRate);
+            total_accesses_.fetch_add(kAccessSampleRate, std::memory_order_relaxed);
+        }
+
+        inline bool HasAccessSamples() {
+            return total_accesses_.load(std::memory_order_relaxed) >=
+                   kMinSamplesPerSegment * kAccessSampleRate * num_seg_;
+        }
+
+        // The error bound for `num_keys` keys that drew `accesses` of the sampled lookups,
+        // see `EnableAdaptiveError`.
+        size_t AdaptiveError(uint64_t accesses, size_t num_keys) {
+            if (hot_error_ == 0 || num_keys == 0 || !HasAccessSamples()) return max_error_;
+            double density = double(accesses) / num_keys;
+            double mean_density = double(total_accesses_.load(std::memory_order_relaxed)) / num_seg_array_keys_;
+            if (density >= mean_density * kHotAccessRatio) return hot_error_;
+            if (density * kHotAccessRatio <= mean_density) return cold_error_;
+            return max_error_;
+        }
+
+        size_t RunError(const std::vector<SegmentType *> &run) {
+            uint64_t accesses = 0;
+            size_t num_keys = 0;
+            for (auto seg : run) {
+                accesses += seg->accesses();
+                num_keys += seg->array_size();
+            }
+            return AdaptiveError(accesses, num_keys);
+        }
+
+        // See `AdaptSegmentErrors`. In thread-safe mode the caller holds `rebuild_mutex_`.
+        size_t AdaptSegmentErrorsLocked() {
+            if (!HasAccessSamples()) return 0;
+            size_t num_rebuilt = 0;
+            for (SegmentType *seg = segments_head_, *next; seg; seg = next) {
+                size_t error = AdaptiveError(seg->accesses(), seg->array_size());
+                next = seg->next_segment();
+                if (error == seg->max_error()) continue;
+                std::vector<SegmentType *> run{seg};
+                while (error == cold_error_ && next && run.size() < kMaxColdRunSegments &&
+                       AdaptiveError(next->accesses(), next->array_size()) == cold_error_) {
+                    run.push_back(next);
+                    next = next->next_segment();
+                }
+                if (kThreadSafe) {
+                    for (auto s : run) s->latch().Lock();
+                }
+                RebuildRun(run, error);
+                ++num_rebuilt;
+            }
+            uint64_t total = 0;
+            for (SegmentType *seg = segments_head_; seg; seg = seg->next_segment()) {
+                seg->set_accesses(seg->accesses() / 2);
+                total += seg->accesses();
+            }
+            total_accesses_.store(total, std::memory_order_relaxed);
+            return num_rebuilt;
+        }
+
+        // Layout of the files written by `Save`: this header, the key array, the value array and
+        // the segment directory, each starting on a cache line boundary.
+        struct FileHeader {
+            uint64_t magic;
+            uint32_t key_size;
+            uint32_t value_size;
+            uint64_t max_error;
+            uint64_t num_keys;
+            uint64_t num_segments;
+            uint64_t keys_offset;
+            uint64_t values_offset;
+            uint64_t segments_offset;
+        };
+
+        // Smallest share of keys worth a thread of its own during a build.
+        static constexpr size_t kMinKeysPerChunk = 1 << 20;
+
+        static constexpr uint64_t kFileMagic = 0x33584544494c4857; // "WHLIDEX3"
+
+        // Adaptive error mode, see `EnableAdaptiveError`. A cold run merges at most
+        // `kMaxColdRunSegments` segments, which bounds the keys a single rebuild copies.
+        static constexpr uint32_t kAccessSampleRate = 64;
+        static constexpr double kHotAccessRatio = 4;
+        static constexpr size_t kMinSamplesPerSegment = 4;
+        static constexpr size_t kMaxColdRunSegments = 64;
+
+        static inline uint64_t AlignFileOffset(uint64_t offset) {
+            return (offset + 63) / 64 * 64;
         }
 
         KeyType min_key_;
-        KeyType max_key_;
-        size_t num_total_keys_;
-        size_t num_seg_array_keys_;
-        size_t num_global_overflow_keys_ = 0;
+        std::atomic<KeyType> max_key_;
+        std::atomic<size_t> num_total_keys_;
+        std::atomic<size_t> num_seg_array_keys_;
+        std::atomic<size_t> num_global_overflow_keys_{0};
         size_t max_error_;
 
-        size_t num_seg_;
+        std::atomic<size_t> num_seg_;
 
         size_t overflow_threshold_;
 
-        ArtTree<KeyType> tree_;
+        // Backs the tree, the segments and all overflow buffers. Declared before everything
+        // that allocates from it, so it is destroyed last.
+        SlabAllocator allocator_;
+
+        // Thread-safe mode only.
+        std::unique_ptr<EpochManager> epoch_;
+
+        Directory tree_;
 
 
         OverflowBuffer<KeyType, ValueType> global_overflow_buffer_;
 
-        Segment<KeyType, ValueType> *segments_head_, *segments_tail_;
+        std::atomic<SegmentType *> segments_head_, segments_tail_;
+
+        // Set by `Load`, unmapped on destruction.
+        void *mapped_file_ = nullptr;
+        size_t mapped_file_size_ = 0;
+        // Key and value arrays within the mapping.
+        size_t mapped_array_bytes_ = 0;
+
+        // Thread-safe mode only. `rebuild_mutex_` serializes structural changes (tree, segment
+        // list), `overflow_mutex_` serializes writers of the global overflow buffer and
+        // `overflow_lock_` lets readers validate it.
+        std::mutex rebuild_mutex_;
+        std::mutex overflow_mutex_;
+        OptLock overflow_lock_;
+
+        // See `EnableSegmentCache`. `route_version_` counts retired segments.
+        const uint64_t id_ = NextIndexId();
+        size_t segment_cache_size_ = 0;
+        unsigned segment_cache_shift_ = 0;
+        std::atomic<uint64_t> route_version_{1};
+
+        // See `EnableAdaptiveError`. `total_accesses_` sums the samples of all segments.
+        size_t hot_error_ = 0;
+        size_t cold_error_ = 0;
+        std::atomic<uint64_t> total_accesses_{0};
+
+        // Background retraining, thread-safe mode only.
+        bool stop_retrain_ = true;
+        std::deque<KeyType> retrain_queue_;
+        std::mutex retrain_queue_mutex_;
+        std::condition_variable retrain_queue_cv_;
+        std::thread retrain_worker_;
 
     };
 
@@ -9,6 +9,10 @@ do
    ./build/$1 $path/$filename wh >> write_heavy_result.txt
    ./build/$1 $path/$filename wo >> write_only_result.txt
    ./build/$1 $path/$filename rrw >> read_range_write_result.txt
+   # Only `bench` runs the delete heavy workload, the baselines report it as unsupported.
+   if [ "$1" = bench ]; then
+      ./build/$1 $path/$filename dh >> delete_heavy_result.txt
+   fi
 done
 
 
@@ -4,6 +4,7 @@ rm read_heavy_result.txt
 rm write_heavy_result.txt
 rm write_only_result.txt
 rm read_range_write_result.txt
+rm delete_heavy_result.txt
 
 dataset=$1
 for i in `seq 1 3`
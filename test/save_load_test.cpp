@@ -0,0 +1,142 @@
+//
+// Save/Load round trips of the index, checked against a reference.
+//
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include "wahl_index.h"
+using namespace std;
+
+// Compares `index` with `reference` by point lookups (of present and absent keys) and a full
+// range. Returns the number of mismatches.
+template<typename Index>
+size_t Compare(Index &index, const map<uint64_t, uint64_t> &reference, mt19937_64 &rng) {
+    size_t failures = 0;
+    for (auto &kv : reference) {
+        uint64_t value;
+        if (!index.Find(kv.first, value) || value != kv.second) failures++;
+    }
+    for (size_t i = 0; i < 10000; ++i) {
+        const uint64_t key = rng();
+        uint64_t value;
+        auto it = reference.find(key);
+        const bool found = index.Find(key, value);
+        if (found != (it != reference.end()) || (found && value != it->second)) failures++;
+    }
+    vector<pair<uint64_t, uint64_t>> kvs;
+    index.Range(0, numeric_limits<uint64_t>::max(), kvs);
+    sort(kvs.begin(), kvs.end());
+    if (kvs != vector<pair<uint64_t, uint64_t>>(reference.begin(), reference.end())) failures++;
+    return failures;
+}
+
+// Random inserts of new keys, erases and updates, applied to `index` and `reference`.
+template<typename Index>
+void Write(Index &index, map<uint64_t, uint64_t> &reference, size_t num_ops, uint64_t key_space, mt19937_64 &rng) {
+    for (size_t i = 0; i < num_ops; ++i) {
+        const uint64_t key = rng() % key_space;
+        auto it = reference.find(key);
+        switch (rng() % 3) {
+            case 0:
+                if (it != reference.end()) break;
+                reference[key] = rng();
+                index.Insert(key, reference[key]);
+                break;
+            case 1:
+                index.Erase(key);
+                if (it != reference.end()) reference.erase(it);
+                break;
+            default:
+                if (it == reference.end()) break;
+                it->second = rng();
+                index.Update(key, it->second);
+                break;
+        }
+    }
+}
+
+// Saves an index with `num_bulk_keys` bulk loaded keys (none: only the global overflow
+// buffer holds keys) after `num_ops` writes, loads it into a new index, which is compared and
+// written to again. Returns the number of mismatches.
+template<bool kThreadSafe>
+size_t RoundTrip(const string &path, size_t num_bulk_keys, size_t num_ops) {
+    using Index = wahl::WahlIndex<uint64_t, uint64_t, kThreadSafe>;
+    mt19937_64 rng(num_bulk_keys + num_ops);
+    // Bulk keys are 16 apart on average, at random, so that they take many segments.
+    const uint64_t key_space = max<size_t>(num_bulk_keys, 1000) * 16;
+    map<uint64_t, uint64_t> reference;
+    size_t failures = 0, num_segments;
+    {
+        Index index(32);
+        if (num_bulk_keys) {
+            vector<uint64_t> keys, values;
+            for (size_t i = 0; i < num_bulk_keys; ++i) {
+                keys.push_back((keys.empty() ? 0 : keys.back()) + 1 + rng() % 31);
+                values.push_back(rng());
+                reference[keys.back()] = values.back();
+            }
+            index.BulkLoad(keys, values);
+        }
+        Write(index, reference, num_ops, key_space, rng);
+        if (!index.Save(path)) failures++;
+    }
+    {
+        Index index;
+        if (!index.Load(path)) failures++;
+        failures += Compare(index, reference, rng);
+        Write(index, reference, num_ops, key_space, rng);
+        failures += Compare(index, reference, rng);
+        num_segments = index.num_seg();
+    }
+    cout << "test:save_load"
+         << " thread_safe:" << kThreadSafe
+         << " bulk_keys:" << num_bulk_keys
+         << " ops:" << num_ops
+         << " keys:" << reference.size()
+         << " segments:" << num_segments
+         << " failures:" << failures
+         << endl;
+    return failures;
+}
+
+// `Load` must refuse a missing and a truncated file and leave the index usable.
+size_t BadFiles(const string &path) {
+    size_t failures = 0;
+    {
+        wahl::WahlIndex<uint64_t, uint64_t> index;
+        if (index.Load(path + ".missing")) failures++;
+    }
+    {
+        wahl::WahlIndex<uint64_t, uint64_t> index;
+        vector<uint64_t> keys;
+        for (uint64_t i = 0; i < 10000; ++i) keys.push_back(i * 3);
+        index.BulkLoad(keys, keys);
+        if (!index.Save(path)) failures++;
+    }
+    if (truncate(path.c_str(), 4096) != 0) failures++;
+    {
+        wahl::WahlIndex<uint64_t, uint64_t> index;
+        if (index.Load(path)) failures++;
+        index.Insert(7, 7);
+        uint64_t value;
+        if (!index.Find(7, value) || value != 7) failures++;
+    }
+    cout << "test:bad_files failures:" << failures << endl;
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    const string path = argc > 1 ? argv[1] : "save_load_test.wahl";
+    size_t failures = 0;
+    failures += RoundTrip<false>(path, 200000, 0);
+    failures += RoundTrip<false>(path, 200000, 100000);
+    failures += RoundTrip<false>(path, 0, 500);
+    failures += RoundTrip<true>(path, 200000, 100000);
+    failures += BadFiles(path);
+    unlink(path.c_str());
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+//
+// Concurrent writes and reads of the thread-safe index, checked against a reference.
+//
+#include <iostream>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include "wahl_index.h"
+using namespace std;
+
+// Every thread owns the keys that are `thread_id` modulo `kNumThreads`, so keys of all threads
+// share segments, but only the owner writes a key and its `std::map` is the exact reference
+// for them. Reads of own keys must match it at any time; ranges are filtered to own keys.
+const size_t kNumThreads = 4;
+const size_t kNumBulkKeys = 200000;
+// Bulk keys are this far apart on average, at random, so that they take many segments.
+const uint64_t kKeyGap = 64;
+const size_t kOpsPerThread = 200000;
+
+using Index = wahl::WahlIndex<uint64_t, uint64_t, true>;
+
+// Returns the number of mismatches seen by thread `thread_id`.
+size_t RunThread(Index &index, map<uint64_t, uint64_t> &reference, uint64_t key_space, size_t thread_id) {
+    mt19937_64 rng(thread_id + 1);
+    // A random key owned by this thread, either a bulk key or a key between them.
+    auto own_key = [&]() {
+        uint64_t key = rng() % key_space;
+        return key - key % kNumThreads + thread_id;
+    };
+    size_t failures = 0;
+    vector<pair<uint64_t, uint64_t>> kvs;
+    for (size_t i = 0; i < kOpsPerThread; ++i) {
+        const uint64_t key = own_key();
+        auto it = reference.find(key);
+        const bool exists = it != reference.end();
+        uint64_t value;
+        switch (rng() % 8) {
+            case 0:
+            case 1:
+                if (exists) break;
+                value = rng();
+                index.Insert(key, value);
+                reference[key] = value;
+                break;
+            case 2:
+                if (index.Erase(key) != exists) failures++;
+                if (exists) reference.erase(it);
+                break;
+            case 3:
+                value = rng();
+                if (index.Update(key, value) != exists) failures++;
+                if (exists) it->second = value;
+                break;
+            case 4: {
+                const uint64_t end_key = key + (rng() % 64) * kKeyGap;
+                kvs.clear();
+                index.Range(key, end_key, kvs);
+                auto own_end = remove_if(kvs.begin(), kvs.end(), [&](const pair<uint64_t, uint64_t> &kv) {
+                    return kv.first % kNumThreads != thread_id;
+                });
+                kvs.erase(own_end, kvs.end());
+                sort(kvs.begin(), kvs.end());
+                vector<pair<uint64_t, uint64_t>> expected(reference.lower_bound(key), reference.lower_bound(end_key));
+                if (kvs != expected) failures++;
+                break;
+            }
+            default: {
+                const bool found = index.Find(key, value);
+                if (found != exists || (found && value != it->second)) failures++;
+                break;
+            }
+        }
+    }
+    return failures;
+}
+
+// Returns the number of mismatches, during the run and in the final contents.
+size_t Stress(bool background_retrain) {
+    vector<uint64_t> keys, values;
+    vector<map<uint64_t, uint64_t>> references(kNumThreads);
+    mt19937_64 rng(0);
+    for (size_t i = 0; i < kNumBulkKeys; ++i) {
+        keys.push_back((keys.empty() ? 0 : keys.back()) + 1 + rng() % (2 * kKeyGap));
+        values.push_back(i);
+        references[keys.back() % kNumThreads][keys.back()] = i;
+    }
+    const uint64_t key_space = keys.back() + kKeyGap;
+    Index index(16, 256);
+    index.BulkLoad(keys, values);
+    if (background_retrain) index.StartBackgroundRetrain();
+
+    vector<atomic<size_t>> failures(kNumThreads);
+    vector<thread> threads;
+    for (size_t t = 0; t < kNumThreads; ++t)
+        threads.emplace_back([&, t]() { failures[t] = RunThread(index, references[t], key_space, t); });
+    for (auto &t : threads) t.join();
+    if (background_retrain) index.StopBackgroundRetrain();
+
+    size_t total_failures = 0, num_keys = 0;
+    for (auto &f : failures) total_failures += f;
+    map<uint64_t, uint64_t> all;
+    for (auto &reference : references) {
+        num_keys += reference.size();
+        all.insert(reference.begin(), reference.end());
+        for (auto &kv : reference) {
+            uint64_t value;
+            if (!index.Find(kv.first, value) || value != kv.second) total_failures++;
+        }
+    }
+    vector<pair<uint64_t, uint64_t>> kvs;
+    index.Range(0, numeric_limits<uint64_t>::max(), kvs);
+    sort(kvs.begin(), kvs.end());
+    if (kvs != vector<pair<uint64_t, uint64_t>>(all.begin(), all.end())) total_failures++;
+
+    cout << "test:stress"
+         << " background_retrain:" << background_retrain
+         << " threads:" << kNumThreads
+         << " keys:" << num_keys
+         << " segments:" << index.num_seg()
+         << " failures:" << total_failures
+         << endl;
+    return total_failures;
+}
+
+int main() {
+    size_t failures = Stress(false) + Stress(true);
+    return failures == 0 ? 0 : 1;
+}